@@ -0,0 +1,494 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// DPDK uses these but doesn't include them. :|
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_tcp.h>
+
+#include "nat_clock.h"
+#include "nat_config.h"
+#include "nat_forward.h"
+#include "nat_log.h"
+#include "nat_profile.h"
+#include "nat_stats.h"
+#include "nat_util.h"
+
+
+// Offline throughput benchmark: feeds synthetic bursts directly to nat_core_process on a single core, without any NIC,
+// so that changes to the datapath can be compared without a traffic generator.
+// It needs two devices that discard what they are sent; device 0 is the LAN, device 1 the WAN. For instance:
+//   ./build/nat-bench-nat-dpdk --no-huge -m 512 --vdev=net_null0 --vdev=net_null1 -- --flows 10000 --new-flows 1 --wan 50 --size 64 --expire 500 --packets 100000000
+// Only the time spent in nat_core_process and nat_core_flush is measured, not the time spent building packets.
+
+
+// --- Static config ---
+
+static const uint16_t BURST_SIZE = 32;
+
+static const uint16_t RX_QUEUE_SIZE = 128;
+static const uint16_t TX_QUEUE_SIZE = 512;
+
+static const unsigned MEMPOOL_BUFFER_COUNT = 8192;
+static const unsigned MEMPOOL_CACHE_SIZE = 256;
+
+static const uint8_t LAN_DEVICE = 0;
+static const uint8_t WAN_DEVICE = 1;
+
+// Flow i goes from 10.0.0.0 + i to 11.0.0.0 + i, port 80; the latter lets the WAN TX callback find i back.
+static const uint32_t INTERNAL_NET = 0x0A000000;
+static const uint32_t EXTERNAL_NET = 0x0B000000;
+static const uint16_t EXTERNAL_PORT = 80;
+static const uint32_t NAT_EXTERNAL_ADDR = 0x0C000001;
+static const uint16_t NAT_START_PORT = 1024;
+static const uint16_t INTERNAL_START_PORT = 1024;
+
+
+// --- Profile ---
+
+struct bench_profile {
+	// Number of concurrent flows
+	uint32_t flows;
+	// Percentage of LAN packets that start a new flow, replacing an existing one
+	double new_flows_percent;
+	// Percentage of bursts that come from the WAN, as replies to existing flows
+	double wan_percent;
+	// Frame size, without CRC
+	uint16_t packet_size;
+	// NAT flow expiration time, in milliseconds; short times with new flows put pressure on expiry
+	uint32_t expiration_time;
+	// NAT capacity
+	uint32_t max_flows;
+	// NAT WAN lookup mode
+	bool wan_lookup_direct;
+	// NAT flow hash function
+	enum nat_flow_hash_kind flow_hash;
+	// Whether packets carry packet types, as if the devices set them on RX
+	bool packet_type;
+	// Number of packets to process, after the warm-up
+	uint64_t packets;
+};
+
+static void
+bench_usage(void)
+{
+	NAT_INFO("Usage:\n"
+		 "[DPDK EAL options] --\n"
+		 "\t--flows <n>: Number of concurrent flows (default 1000).\n"
+		 "\t--new-flows <percent>: Percentage of LAN packets that start a new flow (default 0).\n"
+		 "\t--wan <percent>: Percentage of bursts from the WAN (default 50).\n"
+		 "\t--size <bytes>: Frame size (default 64).\n"
+		 "\t--expire <ms>: Flow expiration time, in milliseconds (default 10000).\n"
+		 "\t--max-flows <n>: NAT capacity (default 64512).\n"
+		 "\t--wan-lookup <mode>: NAT WAN lookup mode, 'hash' (default) or 'direct'.\n"
+		 "\t--flow-hash <hash>: NAT flow hash function, 'mix' (default), 'crc32c' or 'poly'.\n"
+		 "\t--packet-type: Mark packets with packet types, as devices that set them on RX do.\n"
+		 "\t--packets <n>: Number of packets to process (default 100000000).\n");
+}
+
+static void
+bench_profile_init(struct bench_profile* profile, int argc, char** argv)
+{
+	profile->flows = 1000;
+	profile->new_flows_percent = 0;
+	profile->wan_percent = 50;
+	profile->packet_size = 64;
+	profile->expiration_time = 10000;
+	profile->max_flows = 65536 - NAT_START_PORT;
+	profile->wan_lookup_direct = false;
+	profile->flow_hash = NAT_FLOW_HASH_MIX;
+	profile->packet_type = false;
+	profile->packets = 100000000;
+
+	struct option long_options[] = {
+		{"flows",	required_argument,	NULL, 'f'},
+		{"new-flows",	required_argument,	NULL, 'n'},
+		{"wan",		required_argument,	NULL, 'w'},
+		{"size",	required_argument,	NULL, 's'},
+		{"expire",	required_argument,	NULL, 't'},
+		{"max-flows",	required_argument,	NULL, 'm'},
+		{"packets",	required_argument,	NULL, 'p'},
+		{"wan-lookup",	required_argument,	NULL, 'l'},
+		{"flow-hash",	required_argument,	NULL, 'h'},
+		{"packet-type",	no_argument,		NULL, 'y'},
+		{NULL, 		0,			NULL, 0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:n:w:s:t:m:p:l:h:y", long_options, NULL)) != EOF) {
+		switch (opt) {
+			case 'f':
+				profile->flows = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				profile->new_flows_percent = strtod(optarg, NULL);
+				break;
+			case 'w':
+				profile->wan_percent = strtod(optarg, NULL);
+				break;
+			case 's':
+				profile->packet_size = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				profile->expiration_time = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				profile->max_flows = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				profile->packets = strtoull(optarg, NULL, 10);
+				break;
+			case 'l':
+				if (strcmp(optarg, "direct") != 0 && strcmp(optarg, "hash") != 0) {
+					rte_exit(EXIT_FAILURE, "Invalid WAN lookup mode: %s\n", optarg);
+				}
+				profile->wan_lookup_direct = strcmp(optarg, "direct") == 0;
+				break;
+			case 'h':
+				if (strcmp(optarg, "crc32c") == 0) {
+					profile->flow_hash = NAT_FLOW_HASH_CRC32C;
+				} else if (strcmp(optarg, "mix") == 0) {
+					profile->flow_hash = NAT_FLOW_HASH_MIX;
+				} else if (strcmp(optarg, "poly") == 0) {
+					profile->flow_hash = NAT_FLOW_HASH_POLY;
+				} else {
+					rte_exit(EXIT_FAILURE, "Invalid flow hash: %s\n", optarg);
+				}
+				break;
+			case 'y':
+				profile->packet_type = true;
+				break;
+			default:
+				bench_usage();
+				rte_exit(EXIT_FAILURE, "Unknown option %c\n", opt);
+		}
+	}
+
+	if (profile->flows == 0 || profile->flows > 0xFFFFFF) {
+		rte_exit(EXIT_FAILURE, "Number of flows must be in [1, 2^24)\n");
+	}
+	if (profile->new_flows_percent < 0 || profile->new_flows_percent > 100
+	 || profile->wan_percent < 0 || profile->wan_percent > 100) {
+		rte_exit(EXIT_FAILURE, "Percentages must be in [0, 100]\n");
+	}
+	uint16_t min_size = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct tcp_hdr);
+	if (profile->packet_size < min_size || profile->packet_size > ETHER_MAX_LEN - ETHER_CRC_LEN) {
+		rte_exit(EXIT_FAILURE, "Frame size must be in [%" PRIu16 ", %d]\n", min_size, ETHER_MAX_LEN - ETHER_CRC_LEN);
+	}
+	if (profile->max_flows == 0) {
+		rte_exit(EXIT_FAILURE, "Max flows must be strictly positive\n");
+	}
+
+	// Reset getopt, so that other code can parse arguments too
+	optind = 0;
+}
+
+
+// --- Traffic ---
+
+struct bench_traffic {
+	struct bench_profile* profile;
+	struct rte_mempool* mbuf_pool;
+
+	// Per flow: current internal port, and external port chosen by the NAT (network order), 0 if not known yet
+	uint16_t* internal_ports;
+	uint16_t* external_ports;
+
+	uint64_t random;
+};
+
+// xorshift64, good enough to pick flows
+static uint64_t
+bench_random(struct bench_traffic* traffic)
+{
+	traffic->random ^= traffic->random << 13;
+	traffic->random ^= traffic->random >> 7;
+	traffic->random ^= traffic->random << 17;
+	return traffic->random;
+}
+
+static bool
+bench_random_percent(struct bench_traffic* traffic, double percent)
+{
+	return (bench_random(traffic) % 1000000) < (uint64_t) (percent * 10000);
+}
+
+// Records the external port the NAT chose for each flow, so that WAN packets can be replies;
+// this runs during measurements, but it is cheap and runs for the no-op forwarder as well.
+static uint16_t
+bench_wan_tx_callback(uint8_t device, uint16_t queue, struct rte_mbuf* bufs[], uint16_t bufs_len, void* arg)
+{
+	struct bench_traffic* traffic = (struct bench_traffic*) arg;
+
+	for (uint16_t buf = 0; buf < bufs_len; buf++) {
+		struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(bufs[buf]);
+		uint32_t flow = rte_be_to_cpu_32(ipv4_header->dst_addr) - EXTERNAL_NET;
+		if (flow < traffic->profile->flows) {
+			traffic->external_ports[flow] = nat_get_ipv4_tcpudp_header(ipv4_header)->src_port;
+		}
+	}
+
+	return bufs_len;
+}
+
+// All addresses and ports in network order
+static void
+bench_fill_packet(struct rte_mbuf* mbuf, uint16_t size,
+		  uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port)
+{
+	char* data = rte_pktmbuf_append(mbuf, size);
+	memset(data, 0, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct tcp_hdr));
+
+	struct ether_hdr* ether_header = (struct ether_hdr*) data;
+	ether_header->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	struct ipv4_hdr* ipv4_header = (struct ipv4_hdr*) (ether_header + 1);
+	ipv4_header->version_ihl = 0x45;
+	ipv4_header->total_length = rte_cpu_to_be_16(size - sizeof(struct ether_hdr));
+	ipv4_header->time_to_live = 64;
+	ipv4_header->next_proto_id = IPPROTO_TCP;
+	ipv4_header->src_addr = src_addr;
+	ipv4_header->dst_addr = dst_addr;
+
+	struct tcp_hdr* tcp_header = (struct tcp_hdr*) (ipv4_header + 1);
+	tcp_header->src_port = src_port;
+	tcp_header->dst_port = dst_port;
+	tcp_header->data_off = 0x50;
+	tcp_header->tcp_flags = 0x10; // ACK
+	tcp_header->rx_win = rte_cpu_to_be_16(0xFFFF);
+
+	ipv4_header->hdr_checksum = rte_ipv4_cksum(ipv4_header);
+	tcp_header->cksum = rte_ipv4_udptcp_cksum(ipv4_header, tcp_header);
+}
+
+static void
+bench_fill_lan_packet(struct bench_traffic* traffic, struct rte_mbuf* mbuf, uint32_t flow)
+{
+	bench_fill_packet(mbuf, traffic->profile->packet_size,
+			  rte_cpu_to_be_32(INTERNAL_NET + flow), rte_cpu_to_be_16(traffic->internal_ports[flow]),
+			  rte_cpu_to_be_32(EXTERNAL_NET + flow), rte_cpu_to_be_16(EXTERNAL_PORT));
+}
+
+// Returns false if the mbuf pool is exhausted
+static bool
+bench_fill_burst(struct bench_traffic* traffic, struct rte_mbuf** bufs, bool from_wan)
+{
+	if (rte_pktmbuf_alloc_bulk(traffic->mbuf_pool, bufs, BURST_SIZE) != 0) {
+		return false;
+	}
+
+	for (uint16_t buf = 0; buf < BURST_SIZE; buf++) {
+		uint32_t flow = bench_random(traffic) % traffic->profile->flows;
+
+		if (from_wan) {
+			// Flows whose external port is not known yet get dropped by the NAT as unknown
+			bench_fill_packet(bufs[buf], traffic->profile->packet_size,
+					  rte_cpu_to_be_32(EXTERNAL_NET + flow), rte_cpu_to_be_16(EXTERNAL_PORT),
+					  rte_cpu_to_be_32(NAT_EXTERNAL_ADDR), traffic->external_ports[flow]);
+		} else {
+			if (bench_random_percent(traffic, traffic->profile->new_flows_percent)) {
+				// The old flow is left to expire
+				traffic->internal_ports[flow]++;
+				if (traffic->internal_ports[flow] == 0) {
+					traffic->internal_ports[flow] = INTERNAL_START_PORT;
+				}
+				traffic->external_ports[flow] = 0;
+			}
+			bench_fill_lan_packet(traffic, bufs[buf], flow);
+		}
+
+		if (traffic->profile->packet_type) {
+			bufs[buf]->packet_type = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_TCP;
+		}
+	}
+
+	return true;
+}
+
+
+// --- Initialization ---
+
+static void
+bench_init_device(uint8_t device, struct rte_mempool* mbuf_pool)
+{
+	int retval;
+
+	struct rte_eth_conf device_conf;
+	memset(&device_conf, 0, sizeof(struct rte_eth_conf));
+	device_conf.rxmode.max_rx_pkt_len = ETHER_MAX_LEN;
+	device_conf.txmode.mq_mode = ETH_MQ_TX_NONE;
+
+	retval = rte_eth_dev_configure(device, 1, 1, &device_conf);
+	if (retval != 0) {
+		rte_exit(EXIT_FAILURE, "Cannot configure device %" PRIu8 ", err=%d", device, retval);
+	}
+
+	retval = rte_eth_rx_queue_setup(device, 0, RX_QUEUE_SIZE, rte_eth_dev_socket_id(device), NULL, mbuf_pool);
+	if (retval < 0) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate RX queue for device %" PRIu8 ", err=%d", device, retval);
+	}
+
+	retval = rte_eth_tx_queue_setup(device, 0, TX_QUEUE_SIZE, rte_eth_dev_socket_id(device), NULL);
+	if (retval < 0) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate TX queue for device %" PRIu8 ", err=%d", device, retval);
+	}
+
+	retval = rte_eth_dev_start(device);
+	if (retval < 0) {
+		rte_exit(EXIT_FAILURE, "Cannot start device %" PRIu8 ", err=%d", device, retval);
+	}
+}
+
+static void
+bench_init_config(struct nat_config* config, struct bench_profile* profile)
+{
+	memset(config, 0, sizeof(struct nat_config));
+	config->devices_mask = (1 << LAN_DEVICE) | (1 << WAN_DEVICE);
+	config->lan_main_device = LAN_DEVICE;
+	config->wan_device = WAN_DEVICE;
+	config->external_addrs[0] = rte_cpu_to_be_32(NAT_EXTERNAL_ADDR);
+	config->nb_external_addrs = 1;
+	config->start_port = NAT_START_PORT;
+	config->expiration_time = profile->expiration_time;
+	config->max_flows = profile->max_flows;
+	config->nb_cores = 1;
+	config->rss_reta_size = 0;
+	config->stats_interval = 0;
+	config->wan_lookup_direct = profile->wan_lookup_direct;
+	config->flow_hash = profile->flow_hash;
+	config->device_rx_packet_type[LAN_DEVICE] = profile->packet_type;
+	config->device_rx_packet_type[WAN_DEVICE] = profile->packet_type;
+	nat_config_build_l2_templates(config);
+}
+
+
+// --- Main ---
+
+int
+main(int argc, char *argv[])
+{
+	int ret = rte_eal_init(argc, argv);
+	if (ret < 0) {
+		rte_exit(EXIT_FAILURE, "Error with EAL initialization, ret=%d\n", ret);
+	}
+	argc -= ret;
+	argv += ret;
+
+	struct bench_profile profile;
+	bench_profile_init(&profile, argc, argv);
+
+	if (rte_eth_dev_count() < 2) {
+		rte_exit(EXIT_FAILURE, "Two devices are needed, e.g. --vdev=net_null0 --vdev=net_null1\n");
+	}
+
+	struct rte_mempool* mbuf_pool = rte_pktmbuf_pool_create(
+		"MEMPOOL", // name
+		MEMPOOL_BUFFER_COUNT * 2, // #elements
+		MEMPOOL_CACHE_SIZE, // cache size
+		0, // application private area size
+		RTE_MBUF_DEFAULT_BUF_SIZE, // data buffer size
+		rte_socket_id() // socket ID
+	);
+	if (mbuf_pool == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+	}
+
+	bench_init_device(LAN_DEVICE, mbuf_pool);
+	bench_init_device(WAN_DEVICE, mbuf_pool);
+
+	struct bench_traffic traffic;
+	traffic.profile = &profile;
+	traffic.mbuf_pool = mbuf_pool;
+	traffic.internal_ports = (uint16_t*) rte_malloc("bench ports", profile.flows * sizeof(uint16_t), 0);
+	traffic.external_ports = (uint16_t*) rte_zmalloc("bench ports", profile.flows * sizeof(uint16_t), 0);
+	if (traffic.internal_ports == NULL || traffic.external_ports == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate flows\n");
+	}
+	for (uint32_t flow = 0; flow < profile.flows; flow++) {
+		traffic.internal_ports[flow] = INTERNAL_START_PORT;
+	}
+	traffic.random = 0x9E3779B97F4A7C15ULL;
+
+	if (rte_eth_add_tx_callback(WAN_DEVICE, 0, bench_wan_tx_callback, &traffic) == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot add a TX callback, DPDK must be built with RTE_ETHDEV_RXTX_CALLBACKS\n");
+	}
+
+	struct nat_config config;
+	bench_init_config(&config, &profile);
+
+	nat_clock_init();
+	nat_stats_init();
+	NAT_PROFILE_INIT();
+	nat_clock_update(rte_rdtsc());
+	nat_core_init(&config, 0);
+
+	struct rte_mbuf* bufs[BURST_SIZE];
+
+	// Warm-up: create all flows, without measuring
+	for (uint32_t flow = 0; flow < profile.flows; flow += BURST_SIZE) {
+		uint16_t bufs_len = RTE_MIN((uint32_t) BURST_SIZE, profile.flows - flow);
+		if (rte_pktmbuf_alloc_bulk(mbuf_pool, bufs, bufs_len) != 0) {
+			rte_exit(EXIT_FAILURE, "Mbuf pool exhausted\n");
+		}
+		for (uint16_t buf = 0; buf < bufs_len; buf++) {
+			bench_fill_lan_packet(&traffic, bufs[buf], flow + buf);
+		}
+		nat_clock_update(rte_rdtsc());
+		nat_core_process(&config, 0, LAN_DEVICE, bufs, bufs_len);
+		nat_core_flush(&config, 0);
+	}
+
+	struct nat_core_stats* stats = nat_core_stats_get(0);
+	struct nat_core_stats warmup_stats = *stats;
+
+	// Measurement; bursts are flushed right away, since the NAT does not see time passing between them
+	uint64_t cycles = 0;
+	uint64_t packets = 0;
+	while (packets < profile.packets) {
+		bool from_wan = bench_random_percent(&traffic, profile.wan_percent);
+		if (!bench_fill_burst(&traffic, bufs, from_wan)) {
+			rte_exit(EXIT_FAILURE, "Mbuf pool exhausted\n");
+		}
+
+		// As in the poll loop, the clock is updated once per burst
+		uint64_t start = rte_rdtsc();
+		nat_clock_update(start);
+		nat_core_process(&config, 0, from_wan ? WAN_DEVICE : LAN_DEVICE, bufs, BURST_SIZE);
+		nat_core_flush(&config, 0);
+		cycles += rte_rdtsc() - start;
+
+		packets += BURST_SIZE;
+	}
+
+	nat_core_refresh_stats(&config, 0);
+
+	double seconds = (double) cycles / rte_get_tsc_hz();
+	NAT_INFO("Flows: %" PRIu32 ", new flows: %.2f%%, WAN: %.2f%%, size: %" PRIu16 ", expiration: %" PRIu32 " ms",
+		 profile.flows, profile.new_flows_percent, profile.wan_percent, profile.packet_size, profile.expiration_time);
+	NAT_INFO("WAN lookup: %s, flow hash: %s", profile.wan_lookup_direct ? "direct" : "hash", nat_config_flow_hash_name(profile.flow_hash));
+	NAT_INFO("Packets: %" PRIu64 ", throughput: %.3f Mpps, %.1f cycles/packet",
+		 packets, packets / seconds / 1000000.0, (double) cycles / packets);
+	NAT_INFO("Flows created: %" PRIu64 ", expired: %" PRIu64 "; dropped unknown flow: %" PRIu64 ", no port: %" PRIu64
+		 ", table full: %" PRIu64 ", TX full: %" PRIu64,
+		 stats->flows_created - warmup_stats.flows_created, stats->flows_expired - warmup_stats.flows_expired,
+		 stats->dropped_unknown_flow - warmup_stats.dropped_unknown_flow,
+		 stats->dropped_no_port - warmup_stats.dropped_no_port,
+		 stats->dropped_table_full - warmup_stats.dropped_table_full,
+		 stats->dropped_tx_full - warmup_stats.dropped_tx_full);
+	NAT_INFO("Flow map keys: %" PRIu64 ", collided: %" PRIu64 ", longest chain: %" PRIu64,
+		 stats->map_keys, stats->map_collided_keys, stats->map_max_chain_length);
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_per_lcore.h>
+
+#include "nat_clock.h"
+
+
+RTE_DEFINE_PER_LCORE(uint64_t, nat_clock_now);
+
+uint64_t nat_clock_tsc_per_ms;
+
+
+void
+nat_clock_init(void)
+{
+	nat_clock_tsc_per_ms = (rte_get_tsc_hz() + MS_PER_S - 1) / MS_PER_S;
+}
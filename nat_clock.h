@@ -0,0 +1,38 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_per_lcore.h>
+
+
+// Coarse per-lcore clock, in milliseconds since an arbitrary point, derived from the TSC.
+// Every lcore updates its own clock once per iteration of its poll loop, and the datapath reads it instead of the time,
+// so that there is no clock read per burst; the clock is thus "now" up to the duration of one iteration.
+//
+// Flows store 32-bit truncations of the clock, which wrap every ~49 days;
+// durations must thus be computed as unsigned 32-bit differences, which is correct up to that.
+
+RTE_DECLARE_PER_LCORE(uint64_t, nat_clock_now);
+
+extern uint64_t nat_clock_tsc_per_ms;
+
+
+// Must be called once, before any lcore uses the clock
+void
+nat_clock_init(void);
+
+// Sets the calling lcore's clock, given a recent TSC value
+static void
+nat_clock_update(uint64_t tsc)
+{
+	RTE_PER_LCORE(nat_clock_now) = tsc / nat_clock_tsc_per_ms;
+}
+
+// Current time of the calling lcore's clock, in milliseconds
+static uint64_t
+nat_clock_now(void)
+{
+	return RTE_PER_LCORE(nat_clock_now);
+}
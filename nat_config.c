@@ -1,14 +1,21 @@
 #include <getopt.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 // DPDK needs these but doesn't include them. :|
 #include <linux/limits.h>
 #include <sys/types.h>
 
+#include <netinet/in.h>
+
 #include <cmdline_parse_etheraddr.h>
 #include <cmdline_parse_ipaddr.h>
 #include <rte_common.h>
 #include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mempool.h>
 
 #include "nat_config.h"
 
@@ -18,77 +25,285 @@
 		rte_exit(EXIT_FAILURE, format, ##__VA_ARGS__);
 
 
-static uintmax_t
-nat_config_parse_int(const char* str, const char* name, int base, char next) {
+static struct option nat_config_long_options[] = {
+	{"burst-min",		required_argument,	NULL, 'B'},
+	{"control",		required_argument,	NULL, 'C'},
+	{"eth-dest",		required_argument,	NULL, 'm'},
+	{"expire",		required_argument,	NULL, 't'},
+	{"extip",		required_argument,	NULL, 'i'},
+	{"flow-hash",		required_argument,	NULL, 'H'},
+	{"idle-polls",		required_argument,	NULL, 'I'},
+	{"lan-dev",		required_argument,	NULL, 'l'},
+	{"max-flows",		required_argument,	NULL, 'f'},
+	{"mempool-cache",	required_argument,	NULL, 'c'},
+	{"mempool-size",	required_argument,	NULL, 'b'},
+	{"numa",		required_argument,	NULL, 'N'},
+	{"devs-mask",		required_argument,	NULL, 'p'},
+	{"pipeline",		required_argument,	NULL, 'P'},
+	{"replicate-to",	required_argument,	NULL, 'R'},
+	{"rx-queue-size",	required_argument,	NULL, 'r'},
+	{"slow-path",		no_argument,		NULL, 'x'},
+	{"snapshot",		required_argument,	NULL, 'F'},
+	{"standby",		required_argument,	NULL, 'Y'},
+	{"starting-port",	required_argument,	NULL, 's'},
+	{"stats-interval",	required_argument,	NULL, 'S'},
+	{"tx-queue-size",	required_argument,	NULL, 'T'},
+	{"wan",			required_argument,	NULL, 'w'},
+	{"wan-lookup",		required_argument,	NULL, 'W'},
+	{NULL, 			0,			NULL, 0  }
+};
+
+
+static bool
+nat_config_try_parse_int(const char* str, int base, char next, uintmax_t* result)
+{
 	char* temp;
-	intmax_t result = strtoimax(str, &temp, base);
+	*result = strtoimax(str, &temp, base);
 
 	// There's also a weird failure case with overflows, but let's not care
-	if(temp == str || *temp != next) {
+	return temp != str && *temp == next;
+}
+
+static uintmax_t
+nat_config_parse_int(const char* str, const char* name, int base, char next) {
+	uintmax_t result;
+	if (!nat_config_try_parse_int(str, base, next, &result)) {
 		rte_exit(EXIT_FAILURE, "Error while parsing '%s': %s\n", name, str);
 	}
 
 	return result;
 }
 
+// Parses a duration in milliseconds, given as "<n>ms" or "<n>s"; plain numbers are seconds.
+// Returns NULL, or why it is not valid
+static const char*
+nat_config_parse_time_ms(const char* str, uint32_t* result) {
+	char* unit;
+	uintmax_t value = strtoumax(str, &unit, 10);
+
+	uintmax_t multiplier;
+	if (unit != str && strcmp(unit, "ms") == 0) {
+		multiplier = 1;
+	} else if (unit != str && (*unit == '\0' || strcmp(unit, "s") == 0)) {
+		multiplier = 1000;
+	} else {
+		return "Invalid time";
+	}
+
+	// Durations are compared as 32-bit differences of clock times, see nat_clock.h
+	if (value > INT32_MAX / multiplier) {
+		return "Time is too long";
+	}
+
+	*result = value * multiplier;
+	return NULL;
+}
+
+static int
+nat_config_compare_addrs(const void* left, const void* right)
+{
+	uint32_t left_addr = rte_be_to_cpu_32(*((const uint32_t*) left));
+	uint32_t right_addr = rte_be_to_cpu_32(*((const uint32_t*) right));
+	return left_addr < right_addr ? -1 : left_addr > right_addr;
+}
+
+// Parses a comma-separated list of external addresses and prefixes, e.g. "192.0.2.1,198.51.100.0/28"
+static void
+nat_config_parse_external_addrs(struct nat_config* config, const char* str)
+{
+	config->nb_external_addrs = 0;
+
+	const char* token = str;
+	while (1) {
+		const char* token_end = strchr(token, ',');
+		size_t token_len = token_end == NULL ? strlen(token) : (size_t) (token_end - token);
+
+		// The cmdline parser does not stop at commas
+		char buffer[INET_ADDRSTRLEN + 3];
+		if (token_len == 0 || token_len >= sizeof(buffer)) {
+			PARSE_ERROR("Invalid external IP address: %s\n", str);
+		}
+		memcpy(buffer, token, token_len);
+		buffer[token_len] = '\0';
+
+		bool is_prefix = strchr(buffer, '/') != NULL;
+		struct cmdline_token_ipaddr tk;
+		tk.ipaddr_data.flags = is_prefix ? CMDLINE_IPADDR_V4 | CMDLINE_IPADDR_NETWORK : CMDLINE_IPADDR_V4;
+
+		struct cmdline_ipaddr res;
+		if (cmdline_parse_ipaddr((cmdline_parse_token_hdr_t*) &tk, buffer, &res, sizeof(res)) < 0) {
+			PARSE_ERROR("Invalid external IP address: %s\n", buffer);
+		}
+
+		uint64_t count = is_prefix ? 1ULL << (32 - res.prefixlen) : 1;
+		if (config->nb_external_addrs + count > NAT_MAX_EXTERNAL_ADDRS) {
+			PARSE_ERROR("Too many external IP addresses, the maximum is %d.\n", NAT_MAX_EXTERNAL_ADDRS);
+		}
+
+		uint32_t first_addr = rte_be_to_cpu_32(res.addr.ipv4.s_addr) & ~((uint32_t) (count - 1));
+		for (uint32_t n = 0; n < count; n++) {
+			config->external_addrs[config->nb_external_addrs] = rte_cpu_to_be_32(first_addr + n);
+			config->nb_external_addrs++;
+		}
+
+		if (token_end == NULL) {
+			break;
+		}
+		token = token_end + 1;
+	}
+
+	// Sorted without duplicates, see nat_config_external_addr_index
+	qsort(config->external_addrs, config->nb_external_addrs, sizeof(uint32_t), &nat_config_compare_addrs);
+	uint16_t unique_len = 1;
+	for (uint16_t n = 1; n < config->nb_external_addrs; n++) {
+		if (config->external_addrs[n] != config->external_addrs[unique_len - 1]) {
+			config->external_addrs[unique_len] = config->external_addrs[n];
+			unique_len++;
+		}
+	}
+	config->nb_external_addrs = unique_len;
+}
+
+// Options that can also be changed at runtime, see nat_config_set_option; returns NULL, or why the value is not valid
+static const char*
+nat_config_parse_runtime_option(struct nat_config* config, int opt, const char* value)
+{
+	unsigned nb_devices = rte_eth_dev_count();
+	uintmax_t number;
+	const char* error;
+	const char* mac;
+	switch (opt) {
+		case 'm':
+			mac = strchr(value, ',');
+			if (mac == NULL || !nat_config_try_parse_int(value, 10, ',', &number)) {
+				return "Invalid eth-dest, expected <device>,<mac>";
+			}
+			if (number >= nb_devices) {
+				return "eth-dest: device does not exist";
+			}
+			if (cmdline_parse_etheraddr(NULL, mac + 1, &(config->endpoint_macs[number]), sizeof(int64_t)) < 0) {
+				return "Invalid MAC address";
+			}
+			return NULL;
+
+		case 'p':
+			if (!nat_config_try_parse_int(value, 16, '\0', &number)) {
+				return "Invalid devices mask";
+			}
+			config->devices_mask = number;
+			return NULL;
+
+		case 'S':
+			if (!nat_config_try_parse_int(value, 10, '\0', &number)) {
+				return "Invalid stats interval";
+			}
+			config->stats_interval = number;
+			return NULL;
+
+		case 't':
+			error = nat_config_parse_time_ms(value, &config->expiration_time);
+			if (error != NULL) {
+				return error;
+			}
+			if (config->expiration_time == 0) {
+				return "Expiration time must be strictly positive";
+			}
+			return NULL;
+	}
+	return "Option cannot be changed at runtime";
+}
+
 void
 nat_config_init(struct nat_config* config, int argc, char** argv)
 {
 	unsigned nb_devices = rte_eth_dev_count();
 
-	struct option long_options[] = {
-		{"eth-dest",		required_argument,	NULL, 'm'},
-		{"expire",		required_argument,	NULL, 't'},
-		{"extip",		required_argument,	NULL, 'i'},
-		{"lan-dev",		required_argument,	NULL, 'l'},
-		{"max-flows",		required_argument,	NULL, 'f'},
-		{"devs-mask",		required_argument,	NULL, 'p'},
-		{"starting-port",	required_argument,	NULL, 's'},
-		{"wan",			required_argument,	NULL, 'w'},
-		{NULL, 			0,			NULL, 0  }
-	};
-
 	// All devices enabled by default
 	config->devices_mask = UINT32_MAX;
 
-	// Set the devices' own MACs
+	// One queue per core; the RSS table size is known once devices are configured
+	config->nb_cores = rte_lcore_count();
+	config->rss_reta_size = 0;
+
+	// No stats by default
+	config->stats_interval = 0;
+
+	// Only used by the NAT, which needs at least one
+	config->external_addrs[0] = 0;
+	config->nb_external_addrs = 1;
+
+	config->wan_lookup_direct = 0;
+	config->flow_hash = NAT_FLOW_HASH_MIX;
+	config->slow_path = 0;
+	config->pipeline_rx_lcores = 0;
+	config->pipeline_tx_lcores = 0;
+
+	// Queue and pool sizes from the l3fwd sample
+	config->rx_queue_size = 128;
+	config->tx_queue_size = 512;
+	config->mempool_size = 8192;
+	config->mempool_cache_size = 256;
+	config->numa_policy = NAT_NUMA_WARN;
+
+	// Adaptive bursts, but no sleeping by default, as waking up costs latency
+	config->burst_min = 4;
+	config->idle_polls = 0;
+
+	config->snapshot_path = NULL;
+	config->control_path = NULL;
+	config->repl_path = NULL;
+	config->repl_standby = 0;
+
+	// Set the devices' own MACs; offloads are known once devices are configured
 	for (uint8_t device = 0; device < nb_devices; device++) {
 		rte_eth_macaddr_get(device, &config->device_macs[device]);
+		config->device_tx_cksum_offload[device] = 0;
+		config->device_rx_packet_type[device] = 0;
 	}
 
 	int opt;
-	while ((opt = getopt_long(argc, argv, "m:e:t:i:l:f:p:s:w:", long_options, NULL)) != EOF) {
-		unsigned device;
+	while ((opt = getopt_long(argc, argv, "B:C:m:e:t:i:H:I:l:f:c:b:N:p:P:R:r:xF:Y:s:S:T:w:W:", nat_config_long_options, NULL)) != EOF) {
+		const char* error;
 		switch (opt) {
-			case 'm':
-				device = nat_config_parse_int(optarg, "eth-dest device", 10, ',');
-				if (device >= nb_devices) {
-					PARSE_ERROR("eth-dest: device %d >= nb_devices (%d)\n", device, nb_devices);
+			case 'B':
+				config->burst_min = nat_config_parse_int(optarg, "burst-min", 10, '\0');
+				if (config->burst_min == 0) {
+					PARSE_ERROR("Minimum burst size must be strictly positive.\n");
 				}
+				break;
 
-				optarg += 2;
-				if (cmdline_parse_etheraddr(NULL, optarg, &(config->endpoint_macs[device]), sizeof(int64_t)) < 0) {
-					PARSE_ERROR("Invalid MAC address: %s\n", optarg);
-				}
+			case 'C':
+				config->control_path = optarg;
 				break;
 
+			case 'm':
+			case 'p':
+			case 'S':
 			case 't':
-		  		config->expiration_time = nat_config_parse_int(optarg, "exp-time", 10, '\0');
-				if (config->expiration_time == 0) {
-					PARSE_ERROR("Expiration time must be strictly positive.\n");
+				error = nat_config_parse_runtime_option(config, opt, optarg);
+				if (error != NULL) {
+					PARSE_ERROR("%s: %s\n", error, optarg);
 				}
 				break;
 
-			case 'i':;
-				struct cmdline_token_ipaddr tk;
-				tk.ipaddr_data.flags = CMDLINE_IPADDR_V4;
+			case 'i':
+				nat_config_parse_external_addrs(config, optarg);
+				break;
 
-				struct cmdline_ipaddr res;
-				if (cmdline_parse_ipaddr((cmdline_parse_token_hdr_t*) &tk, optarg, &res, sizeof(res)) < 0) {
-					PARSE_ERROR("Invalid external IP address: %s\n", optarg);
+			case 'H':
+				if (strcmp(optarg, "crc32c") == 0) {
+					config->flow_hash = NAT_FLOW_HASH_CRC32C;
+				} else if (strcmp(optarg, "mix") == 0) {
+					config->flow_hash = NAT_FLOW_HASH_MIX;
+				} else if (strcmp(optarg, "poly") == 0) {
+					config->flow_hash = NAT_FLOW_HASH_POLY;
+				} else {
+					PARSE_ERROR("Invalid flow hash: %s\n", optarg);
 				}
+				break;
 
-				config->external_addr = res.addr.ipv4.s_addr;
+			case 'I':
+				config->idle_polls = nat_config_parse_int(optarg, "idle-polls", 10, '\0');
 				break;
 
 			case 'l':
@@ -105,46 +320,197 @@ nat_config_init(struct nat_config* config, int argc, char** argv)
 				}
 				break;
 
-			case 'p':
-				config->devices_mask = nat_config_parse_int(optarg, "devices-mask", 16, '\0');
+			case 'c':
+				config->mempool_cache_size = nat_config_parse_int(optarg, "mempool-cache", 10, '\0');
+				if (config->mempool_cache_size > RTE_MEMPOOL_CACHE_MAX_SIZE) {
+					PARSE_ERROR("Mempool cache size must be at most %d.\n", RTE_MEMPOOL_CACHE_MAX_SIZE);
+				}
+				break;
+
+			case 'b':
+				config->mempool_size = nat_config_parse_int(optarg, "mempool-size", 10, '\0');
+				if (config->mempool_size == 0) {
+					PARSE_ERROR("Mempool size must be strictly positive.\n");
+				}
+				break;
+
+			case 'N':
+				if (strcmp(optarg, "warn") == 0) {
+					config->numa_policy = NAT_NUMA_WARN;
+				} else if (strcmp(optarg, "strict") == 0) {
+					config->numa_policy = NAT_NUMA_STRICT;
+				} else if (strcmp(optarg, "rebalance") == 0) {
+					config->numa_policy = NAT_NUMA_REBALANCE;
+				} else {
+					PARSE_ERROR("Invalid NUMA policy: %s\n", optarg);
+				}
+				break;
+
+			case 'P':
+				config->pipeline_rx_lcores = nat_config_parse_int(optarg, "pipeline RX lcores", 10, ',');
+				config->pipeline_tx_lcores = nat_config_parse_int(strchr(optarg, ',') + 1, "pipeline TX lcores", 10, '\0');
+				if (config->pipeline_rx_lcores == 0 || config->pipeline_tx_lcores == 0) {
+					PARSE_ERROR("Pipeline mode needs at least one RX and one TX lcore.\n");
+				}
+				break;
+
+			case 'R':
+				config->repl_path = optarg;
+				config->repl_standby = 0;
+				break;
+
+			case 'r':
+				config->rx_queue_size = nat_config_parse_int(optarg, "rx-queue-size", 10, '\0');
+				if (config->rx_queue_size == 0) {
+					PARSE_ERROR("RX queue size must be strictly positive.\n");
+				}
+				break;
+
+			case 'x':
+				config->slow_path = 1;
+				break;
+
+			case 'F':
+				config->snapshot_path = optarg;
+				break;
+
+			case 'Y':
+				config->repl_path = optarg;
+				config->repl_standby = 1;
 				break;
 
 			case 's':
 				config->start_port = nat_config_parse_int(optarg, "start-port", 10, '\0');
 				break;
 
+			case 'T':
+				config->tx_queue_size = nat_config_parse_int(optarg, "tx-queue-size", 10, '\0');
+				if (config->tx_queue_size == 0) {
+					PARSE_ERROR("TX queue size must be strictly positive.\n");
+				}
+				break;
+
 			case 'w':
 				config->wan_device = nat_config_parse_int(optarg, "wan-dev", 10, '\0');
 				if (config->wan_device >= nb_devices) {
 					PARSE_ERROR("WAN device does not exist.\n");
 				}
 				break;
+
+			case 'W':
+				if (strcmp(optarg, "direct") == 0) {
+					config->wan_lookup_direct = 1;
+				} else if (strcmp(optarg, "hash") == 0) {
+					config->wan_lookup_direct = 0;
+				} else {
+					PARSE_ERROR("Invalid WAN lookup mode: %s\n", optarg);
+				}
+				break;
 		}
 	}
 
+	// The slow path core does not forward packets itself, nor do pipeline RX and TX lcores
+	if (config->slow_path) {
+		if (config->nb_cores < 2) {
+			PARSE_ERROR("The slow path needs its own lcore, besides at least one forwarding lcore.\n");
+		}
+		config->nb_cores--;
+	}
+	if (config->pipeline_rx_lcores != 0) {
+		if (config->nb_cores <= config->pipeline_rx_lcores + config->pipeline_tx_lcores) {
+			PARSE_ERROR("Pipeline mode needs at least one worker lcore, besides the RX and TX lcores.\n");
+		}
+		config->nb_cores -= config->pipeline_rx_lcores + config->pipeline_tx_lcores;
+	}
+	if (config->pipeline_tx_lcores > config->nb_cores) {
+		PARSE_ERROR("Pipeline mode needs at least as many workers as TX lcores, which each serve some of the workers.\n");
+	}
+
 	if ((config->devices_mask & (1 << config->lan_main_device)) == 0) {
 		PARSE_ERROR("Main LAN device is not enabled.\n");
 	}
 	if ((config->devices_mask & (1 << config->wan_device)) == 0) {
 		PARSE_ERROR("WAN device is not enabled.\n");
 	}
+	if (config->max_flows < config->nb_cores) {
+		PARSE_ERROR("Flow table size must be at least the number of cores, as it is split among them.\n");
+	}
+	// DPDK requires caches to be at most 1/1.5 of the pool, see rte_mempool_create
+	if (config->mempool_cache_size * 3 > config->mempool_size * 2) {
+		PARSE_ERROR("Mempool cache size must be at most two thirds of the mempool size.\n");
+	}
+	if (65536 - config->start_port < config->nb_cores) {
+		PARSE_ERROR("There must be at least as many external ports as cores, as they are split among them.\n");
+	}
+
+	nat_config_build_l2_templates(config);
 
 	// Reset getopt
 	optind = 1;
 }
 
+const char*
+nat_config_set_option(struct nat_config* config, const struct nat_config* startup, const char* name, const char* value)
+{
+	int opt = 0;
+	for (struct option* option = nat_config_long_options; option->name != NULL; option++) {
+		if (strcmp(option->name, name) == 0) {
+			opt = option->val;
+		}
+	}
+
+	const char* error = nat_config_parse_runtime_option(config, opt, value);
+	if (error != NULL) {
+		return error;
+	}
+	nat_config_build_l2_templates(config);
+
+	// Devices are configured and started at startup, thus they can only be disabled, and enabled again
+	if ((config->devices_mask & ~startup->devices_mask) != 0) {
+		return "Only devices enabled at startup can be enabled";
+	}
+	if ((config->devices_mask & (1 << config->lan_main_device)) == 0 || (config->devices_mask & (1 << config->wan_device)) == 0) {
+		return "The main LAN and WAN devices cannot be disabled";
+	}
+	return NULL;
+}
+
 void
 nat_config_cmdline_print_usage(void)
 {
 	printf("Usage:\n"
 		"[DPDK EAL options] --\n"
+		"\t--burst-min <n>: smallest RX burst size (default 4); bursts grow under load, up to the compile-time batch size.\n"
+		"\t--control <socket>: accept runtime changes of --eth-dest, --devs-mask, --expire and --stats-interval\n"
+		"\t\ton the UNIX socket, one '<option> <value>' line per change (e.g. 'expire 30s').\n"
 		"\t--eth-dest <device>,<mac>: MAC address of the endpoint linked to a device.\n"
-		"\t--expire <time>: flow expiration time.\n"
-		"\t--extip <ip>: external IP address.\n"
+		"\t--expire <time>: flow expiration time, in seconds, or in milliseconds with an 'ms' suffix (e.g. 300ms).\n"
+		"\t--extip <ips>: external IP addresses, as a comma-separated list of addresses and prefixes (e.g. 192.0.2.1,198.51.100.0/28).\n"
+		"\t--flow-hash <hash>: hash function of flows, 'mix' (default, seeded multiply-mix), 'crc32c' (faster with SSE4.2,\n"
+		"\t\tbut its collisions do not depend on the seed) or 'poly' (unseeded polynomial, for comparison).\n"
+		"\t--idle-polls <n>: sleep after <n> consecutive polls without packets (0 = never, default), on RX interrupts\n"
+		"\t\tif devices support them, otherwise with increasing pauses and sleeps.\n"
 		"\t--lan-dev <device>: set device to be the main LAN device (for non-NAT).\n"
 		"\t--max-flows <n>: flow table capacity.\n"
+		"\t--mempool-cache <n>: per-core cache size of the buffer pools (default 256).\n"
+		"\t--mempool-size <n>: buffers per device and per core (default 8192); each NUMA socket with devices has its own pool.\n"
+		"\t--numa <policy>: what to do with lcores that would poll devices on another NUMA socket,\n"
+		"\t\t'warn' (default), 'strict' (refuse to start) or 'rebalance' (only forward on lcores of the socket with the most devices).\n"
 		"\t--devs-mask / -p <n>: devices mask to enable/disable devices\n"
+		"\t--pipeline <rx>,<tx>: pipeline mode, for devices without symmetric RSS: <rx> lcores receive packets and hand them\n"
+		"\t\tto worker lcores by flow, which hand them to <tx> lcores that send them; the other lcores are workers.\n"
+		"\t--replicate-to <socket>: replicate flows to a standby instance listening on the UNIX socket.\n"
+		"\t--rx-queue-size <n>: descriptors per RX queue (default 128).\n"
+		"\t--slow-path: dedicate the last lcore to ICMP, fragments and IP options, which are otherwise dropped\n"
+		"\t\t(except TCP/UDP packets with IP options, which are then translated by the core that receives them).\n"
+		"\t--snapshot <file>: save flows to <file> when stopped with SIGTERM, and restore them from it on startup,\n"
+		"\t\tif it was saved with the same cores, flow table size, ports, RSS table and external IPs.\n"
+		"\t--standby <socket>: be a standby instance, receiving flows on the UNIX socket from an active one with the same\n"
+		"\t\tconfiguration, and forwarding packets only once it is gone.\n"
 		"\t--starting-port <n>: start of the port range for external ports.\n"
+		"\t--stats-interval <time>: print statistics every <time> seconds (0 = never, default).\n"
+		"\t--tx-queue-size <n>: descriptors per TX queue (default 512).\n"
 		"\t--wan <device>: set device to be the external one.\n"
+		"\t--wan-lookup <mode>: how WAN packets find their flow, 'hash' (default) or 'direct' (indexed by external port).\n"
 	);
 }
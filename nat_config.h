@@ -1,10 +1,42 @@
 #pragma once
 
 #include <inttypes.h>
+#include <string.h>
 
+#include <rte_branch_prediction.h>
+#include <rte_byteorder.h>
+#include <rte_common.h>
 #include <rte_ether.h>
 
 
+// Maximum number of external addresses; flows store the index of theirs in 8 bits
+#define NAT_MAX_EXTERNAL_ADDRS 256
+
+// Hash functions of flow IDs, see unverified-nat/nat_flow_hash.h
+enum nat_flow_hash_kind {
+	NAT_FLOW_HASH_CRC32C,
+	NAT_FLOW_HASH_MIX,
+	NAT_FLOW_HASH_POLY
+};
+
+// Ethernet addresses of the packets a device sends, in header order, i.e. its endpoint's MAC then its own;
+// padded to 16 bytes so that they can be written with one vector store, see nat_l2_rewrite
+struct nat_l2_template {
+	struct ether_addr d_addr;
+	struct ether_addr s_addr;
+	uint8_t padding[4];
+} __attribute__((__aligned__(16)));
+
+// What to do with lcores that would poll devices on another NUMA socket
+enum nat_numa_policy {
+	// Use them anyway, but say so
+	NAT_NUMA_WARN,
+	// Refuse to start
+	NAT_NUMA_STRICT,
+	// Only use lcores on the socket with the most devices
+	NAT_NUMA_REBALANCE
+};
+
 struct nat_config {
 	// Device mask, to enable/disable devices if needed
 	uint32_t devices_mask;
@@ -15,8 +47,9 @@ struct nat_config {
 	// WAN device, i.e. external
 	uint8_t wan_device;
 
-	// External IP address
-	uint32_t external_addr;
+	// External IP addresses, in network order, sorted by their host order value
+	uint32_t external_addrs[NAT_MAX_EXTERNAL_ADDRS];
+	uint16_t nb_external_addrs;
 
 	// MAC addresses of devices
 	struct ether_addr device_macs[RTE_MAX_ETHPORTS];
@@ -24,20 +57,172 @@ struct nat_config {
 	// MAC addresses of the endpoints the devices are linked to
 	struct ether_addr endpoint_macs[RTE_MAX_ETHPORTS];
 
+	// Built from the MAC addresses above, see nat_config_build_l2_templates
+	struct nat_l2_template l2_templates[RTE_MAX_ETHPORTS];
+
+	// Whether devices compute the IPv4 and TCP/UDP checksums of packets they send
+	uint8_t device_tx_cksum_offload[RTE_MAX_ETHPORTS];
+
+	// Whether devices set the packet type of packets they receive, from Ethernet to TCP/UDP
+	uint8_t device_rx_packet_type[RTE_MAX_ETHPORTS];
+
 	// External port at which to start allocating flows
-	// i.e. ports will be allocated in [start_port, start_port + max_flows]
+	// i.e. ports will be allocated in [start_port, 65535], on every external address
 	uint16_t start_port;
 
-	// Expiration time of flows in seconds
+	// Expiration time of flows in milliseconds
 	uint32_t expiration_time;
 
-	// Size of the flow table
+	// Size of the flow table; there can be more flows than external addresses and ports,
+	// since flows with different remote endpoints can share an external address and port (except in direct WAN lookup mode)
 	uint32_t max_flows;
+
+	// Number of cores forwarding packets, each of which has its own RX/TX queue on every device
+	uint16_t nb_cores;
+
+	// Size of the devices' RSS redirection table, or 0 if they do not support RSS
+	uint16_t rss_reta_size;
+
+	// Interval at which to print statistics, in seconds, or 0 to never print them
+	uint32_t stats_interval;
+
+	// Whether WAN packets are looked up by indexing flows with their external port, instead of hashing their ID
+	uint8_t wan_lookup_direct;
+
+	// Hash function of flow IDs, seeded randomly at startup
+	enum nat_flow_hash_kind flow_hash;
+
+	// Whether the last lcore is a slow path core, to which the others hand packets they cannot handle themselves
+	// (e.g. ICMP and fragments); it is not one of the nb_cores, and its ID is nb_cores
+	uint8_t slow_path;
+
+	// Pipeline mode, see nat_pipeline.h: numbers of RX and TX lcores, or 0 for run-to-completion, where cores poll devices.
+	// They are not among the nb_cores; their IDs, which index stats and control readers, follow the cores' and the slow path core's
+	uint16_t pipeline_rx_lcores;
+	uint16_t pipeline_tx_lcores;
+
+	// Sizes of the devices' RX and TX queues, in descriptors
+	uint16_t rx_queue_size;
+	uint16_t tx_queue_size;
+
+	// Number of buffers per device and per core; each NUMA socket with devices gets its own pool,
+	// sized for the devices on that socket
+	uint32_t mempool_size;
+
+	// Per-core cache size of the buffer pools
+	uint32_t mempool_cache_size;
+
+	// How to handle lcores on another socket than the devices they poll
+	enum nat_numa_policy numa_policy;
+
+	// Smallest burst size cores receive; bursts grow up to the compile-time BATCH_SIZE under load
+	uint16_t burst_min;
+
+	// Number of consecutive polls of all devices without packets after which cores sleep, or 0 to always busy-poll;
+	// cores sleep on RX interrupts if the devices support them, and back off with pauses and short sleeps otherwise
+	uint32_t idle_polls;
+
+	// File to save flows to on SIGTERM, and to restore them from on startup, or NULL; points into argv
+	const char* snapshot_path;
+
+	// UNIX socket on which to accept config changes while running, or NULL; points into argv, see nat_control.h
+	const char* control_path;
+
+	// UNIX socket through which flows are replicated to a standby instance, or NULL; points into argv.
+	// Active instances connect to it, standby ones listen on it, see unverified-nat/nat_repl.h
+	const char* repl_path;
+	uint8_t repl_standby;
 };
 
 
+// Index of an external address (in network order) in config->external_addrs, or -1 if it is not one
+static int32_t
+nat_config_external_addr_index(struct nat_config* config, uint32_t addr)
+{
+	// Addresses from a prefix are contiguous, thus the index is the offset from the first one
+	uint32_t offset = rte_be_to_cpu_32(addr) - rte_be_to_cpu_32(config->external_addrs[0]);
+	if (likely(offset < config->nb_external_addrs && config->external_addrs[offset] == addr)) {
+		return offset;
+	}
+
+	// Otherwise, they are sorted
+	int32_t low = 0;
+	int32_t high = config->nb_external_addrs - 1;
+	while (low <= high) {
+		int32_t middle = (low + high) / 2;
+		uint32_t middle_addr = rte_be_to_cpu_32(config->external_addrs[middle]);
+		if (middle_addr == rte_be_to_cpu_32(addr)) {
+			return middle;
+		} else if (middle_addr < rte_be_to_cpu_32(addr)) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return -1;
+}
+
+// Core whose slice of the external port range contains the port (in network order), or -1 if it is outside the range;
+// every core gets an equal slice, the last one also gets the remainders, see nat_core_init
+static int32_t
+nat_config_external_port_core(struct nat_config* config, uint16_t port)
+{
+	uint32_t ports_per_core = (65536 - config->start_port) / config->nb_cores;
+	uint32_t offset = (uint32_t) rte_be_to_cpu_16(port) - config->start_port;
+	if (offset > 65535) {
+		return -1;
+	}
+	return RTE_MIN(offset / ports_per_core, config->nb_cores - 1u);
+}
+
+// Must be called whenever device_macs or endpoint_macs change
+static void
+nat_config_build_l2_templates(struct nat_config* config)
+{
+	for (uint8_t device = 0; device < RTE_MAX_ETHPORTS; device++) {
+		memset(&config->l2_templates[device], 0, sizeof(struct nat_l2_template));
+		config->l2_templates[device].d_addr = config->endpoint_macs[device];
+		config->l2_templates[device].s_addr = config->device_macs[device];
+	}
+}
+
+static const char*
+nat_config_flow_hash_name(enum nat_flow_hash_kind kind)
+{
+	switch (kind) {
+		case NAT_FLOW_HASH_CRC32C:
+			return "crc32c";
+		case NAT_FLOW_HASH_MIX:
+			return "mix";
+		case NAT_FLOW_HASH_POLY:
+			return "poly";
+	}
+	return "unknown";
+}
+
+static const char*
+nat_config_numa_policy_name(enum nat_numa_policy policy)
+{
+	switch (policy) {
+		case NAT_NUMA_WARN:
+			return "warn";
+		case NAT_NUMA_STRICT:
+			return "strict";
+		case NAT_NUMA_REBALANCE:
+			return "rebalance";
+	}
+	return "unknown";
+}
+
+
 void
 nat_config_init(struct nat_config* config, int argc, char** argv);
 
 void
 nat_config_cmdline_print_usage(void);
+
+// Changes an option of a copy of the running config, given as on the command line, e.g. "expire" and "30s";
+// only options that change neither the size nor the layout of the cores' state can be changed, given the startup config.
+// Returns NULL, or why the option cannot be changed, in which case the config may be partially changed.
+const char*
+nat_config_set_option(struct nat_config* config, const struct nat_config* startup, const char* name, const char* value);
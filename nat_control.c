@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// DPDK uses these but doesn't include them. :|
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rte_atomic.h>
+#include <rte_common.h>
+#include <rte_debug.h>
+#include <rte_malloc.h>
+
+#include "nat_config.h"
+#include "nat_control.h"
+#include "nat_log.h"
+
+
+struct nat_config* volatile nat_control_config;
+volatile uint64_t nat_control_epoch;
+struct nat_control_reader nat_control_readers[RTE_MAX_LCORE + 1];
+
+// Config the NAT started with, which decides what can change
+static struct nat_config* nat_control_startup;
+
+static int nat_control_listen_fd;
+
+// How long the control thread waits between checks of the readers' epochs, in microseconds
+static const unsigned CONTROL_GRACE_POLL_US = 100;
+
+// Longest command line clients can send
+#define CONTROL_LINE_SIZE 256
+
+
+static struct nat_config*
+nat_control_copy(struct nat_config* config)
+{
+	struct nat_config* copy = (struct nat_config*) rte_malloc("nat_config", sizeof(struct nat_config), RTE_CACHE_LINE_SIZE);
+	if (copy != NULL) {
+		memcpy(copy, config, sizeof(struct nat_config));
+	}
+	return copy;
+}
+
+// Only the control thread publishes configs, thus it needs no lock
+static void
+nat_control_publish(struct nat_config* config)
+{
+	struct nat_config* old_config = nat_control_config;
+	uint64_t epoch = nat_control_epoch + 1;
+
+	nat_control_config = config;
+	rte_smp_wmb();
+	nat_control_epoch = epoch;
+
+	// Grace period; readers flush periodically even when idle, thus it is short
+	unsigned nb_readers = nat_control_nb_readers(nat_control_startup);
+	for (unsigned reader = 0; reader < nb_readers; reader++) {
+		while (nat_control_readers[reader].epoch < epoch) {
+			usleep(CONTROL_GRACE_POLL_US);
+		}
+	}
+
+	rte_free(old_config);
+}
+
+// Returns NULL, or why the change was refused
+static const char*
+nat_control_set(const char* name, const char* value)
+{
+	struct nat_config* config = nat_control_copy(nat_control_config);
+	if (config == NULL) {
+		return "Out of memory";
+	}
+
+	const char* error = nat_config_set_option(config, nat_control_startup, name, value);
+	if (error != NULL) {
+		rte_free(config);
+		return error;
+	}
+
+	nat_control_publish(config);
+	NAT_INFO("Control: set %s to %s.", name, value);
+	return NULL;
+}
+
+// Answers one client's lines until it disconnects
+static void
+nat_control_serve(int fd)
+{
+	FILE* stream = fdopen(fd, "r");
+	if (stream == NULL) {
+		close(fd);
+		return;
+	}
+
+	char line[CONTROL_LINE_SIZE];
+	while (fgets(line, sizeof(line), stream) != NULL) {
+		char* name = strtok(line, " \t\r\n");
+		char* value = strtok(NULL, " \t\r\n");
+		const char* error = name == NULL || value == NULL ? "Expected '<option> <value>'" : nat_control_set(name, value);
+
+		char reply[CONTROL_LINE_SIZE];
+		int reply_len = error == NULL ? snprintf(reply, sizeof(reply), "OK\n") : snprintf(reply, sizeof(reply), "ERROR %s\n", error);
+		if (write(fd, reply, RTE_MIN((size_t) reply_len, sizeof(reply) - 1)) < 0) {
+			break;
+		}
+	}
+
+	fclose(stream);
+}
+
+// Serves clients one at a time; it is mostly blocked, thus it shares the master lcore's CPU
+static void*
+nat_control_main(void* arg)
+{
+	(void) arg;
+
+	while (1) {
+		int fd = accept(nat_control_listen_fd, NULL, NULL);
+		if (fd >= 0) {
+			nat_control_serve(fd);
+		}
+	}
+
+	return NULL;
+}
+
+
+void
+nat_control_init(struct nat_config* config)
+{
+	nat_control_startup = config;
+	nat_control_config = nat_control_copy(config);
+	if (nat_control_config == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_control_init\n");
+	}
+
+	nat_control_epoch = 0;
+	for (unsigned reader = 0; reader < RTE_MAX_LCORE + 1; reader++) {
+		nat_control_readers[reader].epoch = 0;
+	}
+
+	if (config->control_path == NULL) {
+		return;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	if (strlen(config->control_path) >= sizeof(address.sun_path)) {
+		rte_exit(EXIT_FAILURE, "Control socket path is too long: %s\n", config->control_path);
+	}
+	strcpy(address.sun_path, config->control_path);
+	unlink(config->control_path);
+
+	nat_control_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (nat_control_listen_fd < 0 || bind(nat_control_listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0
+	    || listen(nat_control_listen_fd, 1) != 0) {
+		rte_exit(EXIT_FAILURE, "Control: cannot listen on %s (%s)\n", config->control_path, strerror(errno));
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, &nat_control_main, NULL) != 0) {
+		rte_exit(EXIT_FAILURE, "Cannot create the control thread\n");
+	}
+	NAT_INFO("Control: accepting config changes on %s.", config->control_path);
+}
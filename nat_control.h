@@ -0,0 +1,60 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_atomic.h>
+#include <rte_common.h>
+#include <rte_lcore.h>
+
+#include "nat_config.h"
+
+
+// Runtime reconfiguration, through the UNIX stream socket given with --control.
+// Clients send one change per line, as "<option> <value>" with the syntax of the command-line option (e.g. "expire 30s"),
+// and get back one line, "OK" or "ERROR <reason>"; see nat_config_set_option for which options can change.
+//
+// The running config is read-copy-update: the control thread copies the current config, changes the copy,
+// publishes it and bumps an epoch. Readers (every lcore that uses the config) pick up the published config
+// whenever they flush, which is their quiescent point, and then record the epoch they saw;
+// once every reader has seen the new epoch, none of them can still use the old config, which is freed.
+// The datapath thus only reads plain pointers, without any lock or atomic operation per packet.
+
+// Epoch a reader saw, in its own cache line since every reader writes its own
+struct nat_control_reader {
+	volatile uint64_t epoch;
+} __rte_cache_aligned;
+
+extern struct nat_config* volatile nat_control_config;
+extern volatile uint64_t nat_control_epoch;
+// One per lcore, plus the stats thread
+extern struct nat_control_reader nat_control_readers[RTE_MAX_LCORE + 1];
+
+
+// Publishes a copy of the startup config, which must outlive the NAT, and starts the control thread if config->control_path is set.
+// Readers are the cores, then the slow path core if any, then the pipeline RX and TX lcores if any, see nat_config.h,
+// then the stats thread; must be called once, before any reader starts
+void
+nat_control_init(struct nat_config* config);
+
+// Number of readers, thus the stats thread's ID plus one
+static inline unsigned
+nat_control_nb_readers(struct nat_config* config)
+{
+	return config->nb_cores + config->slow_path + config->pipeline_rx_lcores + config->pipeline_tx_lcores + 1;
+}
+
+// Returns the current config, and records that the reader no longer uses older ones;
+// called by every reader from its lcore, at a point where it does not hold any pointer to the config
+static inline struct nat_config*
+nat_control_quiesce(unsigned reader)
+{
+	// The config is published before the epoch, thus it is at least as recent as the epoch
+	uint64_t epoch = nat_control_epoch;
+	rte_smp_rmb();
+	struct nat_config* config = nat_control_config;
+
+	// Earlier reads of the old config must be done before the control thread can see the epoch and free it
+	rte_smp_mb();
+	nat_control_readers[reader].epoch = epoch;
+	return config;
+}
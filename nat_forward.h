@@ -1,14 +1,59 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include <rte_mbuf.h>
 
 #include "nat_config.h"
 
 
+// Cores are identified by a core ID in [0, config->nb_cores), which is also the ID of the RX and TX queues
+// they own on every device; all functions for a given core ID are always called from the same lcore.
+
 void
 nat_core_init(struct nat_config* config, unsigned core_id);
 
 void
 nat_core_process(struct nat_config* config, unsigned core_id, uint8_t device, struct rte_mbuf** bufs, uint16_t bufs_len);
+
+// Publishes the core's counters that live in its own structures, such as the flow maps' spread, see nat_stats.h;
+// called every stats interval from the core's loop, thus must not walk the flows
+void
+nat_core_refresh_stats(struct nat_config* config, unsigned core_id);
+
+// Slow path, for packets the cores hand over, only used if config->slow_path is set.
+// nat_slow_path_init is called once before any core starts, then nat_slow_path_process repeatedly from the slow path lcore,
+// whose TX queue on every device is queue config->nb_cores.
+void
+nat_slow_path_init(struct nat_config* config);
+
+void
+nat_slow_path_process(struct nat_config* config);
+
+// Warm restart, only used if config->snapshot_path is set, see unverified-nat/nat_snapshot.h.
+// nat_snapshot_load is called once before any core starts, and nat_core_init then restores the core's flows;
+// nat_snapshot_save is called from the master lcore once all cores have returned, and saves all of their flows.
+void
+nat_snapshot_load(struct nat_config* config);
+
+void
+nat_snapshot_save(struct nat_config* config);
+
+// Replication to a standby instance, only used if config->repl_path is set, see unverified-nat/nat_repl.h.
+// nat_repl_init is called once before any core starts. On a standby instance, cores call nat_core_standby in their
+// poll loop, and must not receive packets as long as it returns true; it applies the active instance's updates.
+void
+nat_repl_init(struct nat_config* config);
+
+bool
+nat_core_standby(struct nat_config* config, unsigned core_id);
+
+// Called from the core's lcore when the config changed at runtime, before the core uses it to process packets,
+// see nat_control.h; only the fields nat_config_set_option can change differ from the previous config
+void
+nat_core_update_config(struct nat_config* config, unsigned core_id);
+
+// Sends the packets the core buffered; called periodically, so that packets are not held back when traffic is low
+void
+nat_core_flush(struct nat_config* config, unsigned core_id);
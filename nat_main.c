@@ -1,37 +1,62 @@
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
 
 // DPDK uses these but doesn't include them. :|
 #include <linux/limits.h>
 #include <sys/types.h>
 
 #include <rte_common.h>
+#include <rte_cycles.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
+#include <rte_interrupts.h>
 #include <rte_launch.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include <rte_pause.h>
 
+#include "nat_clock.h"
 #include "nat_config.h"
+#include "nat_control.h"
 #include "nat_forward.h"
 #include "nat_log.h"
+#include "nat_pipeline.h"
+#include "nat_profile.h"
+#include "nat_rss.h"
+#include "nat_stats.h"
 #include "nat_util.h"
 
 
 // --- Static config ---
 
-// Size of batches to receive; trade-off between latency and throughput
+// Largest size of batches to receive; trade-off between latency and throughput, see nat_burst_adapt
 // Can be overriden at compile time
 #ifndef BATCH_SIZE
 static const uint16_t BATCH_SIZE = 32;
 #endif
 
-// Queue sizes for receiving/transmitting packets (set to their values from l3fwd sample)
-static const uint16_t RX_QUEUE_SIZE = 128;
-static const uint16_t TX_QUEUE_SIZE = 512;
+// Maximum time packets can be buffered before being sent, in microseconds (set to its value from l2fwd sample)
+static const uint64_t TX_DRAIN_US = 100;
 
-// Memory pool #buffers and per-core cache size (set to their values from l3fwd sample)
-static const unsigned MEMPOOL_BUFFER_COUNT = 8192;
-static const unsigned MEMPOOL_CACHE_SIZE = 256;
+// Longest time idle cores sleep on RX interrupts, in milliseconds, so that they still print stats and answer the slow path
+static const int IDLE_INTR_TIMEOUT_MS = 10;
+
+// Idle cores without RX interrupts pause 2^level times for the first levels, then sleep 2^(level - pause levels) microseconds,
+// up to the longest sleep
+static const unsigned IDLE_PAUSE_LEVELS = 10;
+static const unsigned IDLE_MAX_SLEEP_US = 1000;
+
+// How often the stats thread checks whether to print, and picks up config changes, in microseconds
+static const unsigned STATS_POLL_US = 10000;
+
+
+// Set by SIGTERM; lcores then return, and the flows are saved, see nat_snapshot_save
+static volatile sig_atomic_t stopping = 0;
 
 
 // --- Initialization ---
@@ -41,39 +66,123 @@ nat_print_config(struct nat_config* config)
 {
 	NAT_INFO("\n--- NAT Config ---\n");
 
-	NAT_INFO("Batch size: %" PRIu16, BATCH_SIZE);
+	NAT_INFO("Batch size: %" PRIu16 " to %" PRIu16 ", adaptive", config->burst_min, BATCH_SIZE);
+	if (config->idle_polls == 0) {
+		NAT_INFO("Idle: never, cores always busy-poll");
+	} else {
+		NAT_INFO("Idle: after %" PRIu32 " empty polls, on RX interrupts or backing off up to %u us",
+			 config->idle_polls, IDLE_MAX_SLEEP_US);
+	}
+	NAT_INFO("Cores: %" PRIu16 ", slow path core: %s", config->nb_cores, config->slow_path ? "yes" : "no");
+	if (config->pipeline_rx_lcores == 0) {
+		NAT_INFO("Layout: run-to-completion, cores poll devices");
+	} else {
+		NAT_INFO("Layout: pipeline, %" PRIu16 " RX lcores to %" PRIu16 " workers to %" PRIu16 " TX lcores",
+			 config->pipeline_rx_lcores, config->nb_cores, config->pipeline_tx_lcores);
+	}
+	NAT_INFO("RSS redirection table size: %" PRIu16, config->rss_reta_size);
 
 	NAT_INFO("Devices mask: 0x%" PRIx32, config->devices_mask);
 	NAT_INFO("Main LAN device: %" PRIu8, config->lan_main_device);
 	NAT_INFO("WAN device: %" PRIu8, config->wan_device);
 
-	char* ext_ip_str = nat_ipv4_to_str(config->external_addr);
-	NAT_INFO("External IP: %s", ext_ip_str);
-	free(ext_ip_str);
+	char* first_ext_ip_str = nat_ipv4_to_str(config->external_addrs[0]);
+	char* last_ext_ip_str = nat_ipv4_to_str(config->external_addrs[config->nb_external_addrs - 1]);
+	NAT_INFO("External IPs: %" PRIu16 ", from %s to %s", config->nb_external_addrs, first_ext_ip_str, last_ext_ip_str);
+	free(first_ext_ip_str);
+	free(last_ext_ip_str);
 
 	uint8_t nb_devices = rte_eth_dev_count();
 	for (uint8_t dev = 0; dev < nb_devices; dev++) {
 		char* dev_mac_str = nat_mac_to_str(&(config->device_macs[dev]));
 		char* end_mac_str = nat_mac_to_str(&(config->endpoint_macs[dev]));
 
-		NAT_INFO("Device %" PRIu8 " own-mac: %s, end-mac: %s", dev, dev_mac_str, end_mac_str);
+		NAT_INFO("Device %" PRIu8 " own-mac: %s, end-mac: %s, TX checksum offload: %s, RX packet type: %s",
+			 dev, dev_mac_str, end_mac_str, config->device_tx_cksum_offload[dev] ? "yes" : "no",
+			 config->device_rx_packet_type[dev] ? "yes" : "no");
 
 		free(dev_mac_str);
 		free(end_mac_str);
 	}
 
 	NAT_INFO("Starting port: %" PRIu16, config->start_port);
-	NAT_INFO("Expiration time: %" PRIu32, config->expiration_time);
-	NAT_INFO("Max flows: %" PRIu16, config->max_flows);
+	NAT_INFO("Expiration time: %" PRIu32 " ms", config->expiration_time);
+	NAT_INFO("Max flows: %" PRIu32, config->max_flows);
+	NAT_INFO("Stats interval: %" PRIu32, config->stats_interval);
+	NAT_INFO("WAN lookup: %s", config->wan_lookup_direct ? "direct" : "hash");
+	NAT_INFO("Flow hash: %s", nat_config_flow_hash_name(config->flow_hash));
+	NAT_INFO("RX/TX queue sizes: %" PRIu16 "/%" PRIu16, config->rx_queue_size, config->tx_queue_size);
+	NAT_INFO("Mempool size: %" PRIu32 " per device and core, cache size: %" PRIu32, config->mempool_size, config->mempool_cache_size);
+	NAT_INFO("NUMA policy: %s", nat_config_numa_policy_name(config->numa_policy));
+	NAT_INFO("Snapshot: %s", config->snapshot_path == NULL ? "none" : config->snapshot_path);
+	NAT_INFO("Control socket: %s", config->control_path == NULL ? "none" : config->control_path);
+	if (config->repl_path == NULL) {
+		NAT_INFO("Replication: none");
+	} else {
+		NAT_INFO("Replication: %s through %s", config->repl_standby ? "standby" : "active", config->repl_path);
+	}
 
 	NAT_INFO("\n--- --- ------ ---\n");
 }
 
+// Whether the device can compute IPv4, TCP and UDP checksums of the packets it sends
+static bool
+nat_device_tx_cksum_offload(uint8_t device)
+{
+	struct rte_eth_dev_info dev_info;
+	rte_eth_dev_info_get(device, &dev_info);
+
+	const uint32_t needed_offloads = DEV_TX_OFFLOAD_IPV4_CKSUM | DEV_TX_OFFLOAD_TCP_CKSUM | DEV_TX_OFFLOAD_UDP_CKSUM;
+	return (dev_info.tx_offload_capa & needed_offloads) == needed_offloads;
+}
+
+// Whether the device sets the Ethernet, IPv4 and TCP/UDP packet types of the packets it receives
+static bool
+nat_device_rx_packet_type(uint8_t device)
+{
+	const uint32_t ptype_mask = RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK;
+	int nb_ptypes = rte_eth_dev_get_supported_ptypes(device, ptype_mask, NULL, 0);
+	if (nb_ptypes <= 0) {
+		return false;
+	}
+
+	uint32_t ptypes[nb_ptypes];
+	nb_ptypes = rte_eth_dev_get_supported_ptypes(device, ptype_mask, ptypes, nb_ptypes);
+
+	bool has_ether = false, has_ipv4 = false, has_tcp = false, has_udp = false;
+	for (int n = 0; n < nb_ptypes; n++) {
+		has_ether |= (ptypes[n] & RTE_PTYPE_L2_MASK) == RTE_PTYPE_L2_ETHER;
+		has_ipv4 |= RTE_ETH_IS_IPV4_HDR(ptypes[n]) != 0;
+		has_tcp |= (ptypes[n] & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_TCP;
+		has_udp |= (ptypes[n] & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP;
+	}
+	return has_ether && has_ipv4 && has_tcp && has_udp;
+}
+
+// NUMA socket of the device; devices whose socket is unknown (e.g. virtual ones) are considered local to the master lcore
 static int
-nat_init_device(uint8_t device, struct rte_mempool *mbuf_pool)
+nat_device_socket(uint8_t device)
+{
+	int socket = rte_eth_dev_socket_id(device);
+	return socket < 0 ? (int) rte_socket_id() : socket;
+}
+
+// Devices get one RX queue per core, or per RX lcore in pipeline mode, and one TX queue per core plus one for the slow path;
+// RX queues draw their buffers from the pool, which should be on the device's socket
+static int
+nat_init_device(struct nat_config* config, uint8_t device, uint16_t nb_rx_queues, uint16_t nb_tx_queues,
+		struct rte_mempool *mbuf_pool)
 {
 	int retval;
 
+	struct rte_eth_dev_info dev_info;
+	rte_eth_dev_info_get(device, &dev_info);
+
+	if (nb_rx_queues > dev_info.max_rx_queues || nb_tx_queues > dev_info.max_tx_queues) {
+		rte_exit(EXIT_FAILURE, "Device %" PRIu8 " does not support %" PRIu16 " RX and %" PRIu16 " TX queues",
+			 device, nb_rx_queues, nb_tx_queues);
+	}
+
 	// Configure the device
 	// This is ugly code; DPDK samples use designated initializers,
 	// but those are not available in C++, and this code needs to compile
@@ -89,42 +198,66 @@ nat_init_device(uint8_t device, struct rte_mempool *mbuf_pool)
 	device_conf.rxmode.jumbo_frame =    0;
 	device_conf.rxmode.hw_strip_crc =   0;
 	device_conf.txmode.mq_mode = ETH_MQ_TX_NONE;
-	device_conf.rx_adv_conf.rss_conf.rss_key = NULL;
-	device_conf.rx_adv_conf.rss_conf.rss_hf = ETH_RSS_IP;
+	// Idle cores sleep on RX interrupts; drivers without them are handled at run time, see nat_idle_init
+	// Pipeline workers do not poll devices, thus they cannot use them
+	device_conf.intr_conf.rxq = config->idle_polls != 0 && config->pipeline_rx_lcores == 0;
+	// Symmetric key, so that both directions of a flow end up on the same core, see nat_rss.h
+	// Ports must be part of the hash, otherwise the NAT cannot choose where replies go.
+	device_conf.rx_adv_conf.rss_conf.rss_key = NAT_RSS_KEY;
+	device_conf.rx_adv_conf.rss_conf.rss_key_len = dev_info.hash_key_size == 0 ? 40 : dev_info.hash_key_size;
+	device_conf.rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IPV4 | ETH_RSS_NONFRAG_IPV4_TCP | ETH_RSS_NONFRAG_IPV4_UDP)
+						& dev_info.flow_type_rss_offloads;
+	if (device_conf.rx_adv_conf.rss_conf.rss_hf == 0) {
+		device_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+	}
+
+	if (device_conf.rx_adv_conf.rss_conf.rss_key_len > sizeof(NAT_RSS_KEY)) {
+		rte_exit(EXIT_FAILURE, "RSS key of device %" PRIu8 " is too long", device);
+	}
 
 	retval = rte_eth_dev_configure(
 		device, // The device
-		1, // # of RX queues
-		1, // # of TX queues
+		nb_rx_queues, // # of RX queues
+		nb_tx_queues, // # of TX queues
 		&device_conf // device config
 	);
 	if (retval != 0) {
 		rte_exit(EXIT_FAILURE, "Cannot configure device %" PRIu8 ", err=%d", device, retval);
 	}
 
-	// Allocate and set up 1 RX queue per device
-	retval = rte_eth_rx_queue_setup(
-		device, // device ID
-		0, // queue ID
-		RX_QUEUE_SIZE, // size
-		rte_eth_dev_socket_id(device), // socket
-		NULL, // config (NULL = default)
-		mbuf_pool // memory pool
-	);
-	if (retval < 0) {
-		rte_exit(EXIT_FAILURE, "Cannot allocate RX queue for device %" PRIu8 ", err=%d", device, retval);
+	// The default TX config of some drivers disables checksum offloads, to use a faster TX path
+	struct rte_eth_txconf tx_conf = dev_info.default_txconf;
+	if (nat_device_tx_cksum_offload(device)) {
+		tx_conf.txq_flags &= ~ETH_TXQ_FLAGS_NOXSUMS;
 	}
 
-	// Allocate and set up 1 TX queue per device
-	retval = rte_eth_tx_queue_setup(
-		device, // device ID
-		0, // queue ID
-		TX_QUEUE_SIZE, // size
-		rte_eth_dev_socket_id(device), // socket
-		NULL // config (NULL = default)
-	);
-	if (retval < 0) {
-		rte_exit(EXIT_FAILURE, "Cannot allocate TX queue for device %" PRIu8 " err=%d", device, retval);
+	for (uint16_t queue = 0; queue < nb_tx_queues; queue++) {
+		// Allocate and set up 1 RX queue per core or RX lcore
+		if (queue < nb_rx_queues) {
+			retval = rte_eth_rx_queue_setup(
+				device, // device ID
+				queue, // queue ID
+				config->rx_queue_size, // size
+				nat_device_socket(device), // socket
+				NULL, // config (NULL = default)
+				mbuf_pool // memory pool
+			);
+			if (retval < 0) {
+				rte_exit(EXIT_FAILURE, "Cannot allocate RX queue %" PRIu16 " for device %" PRIu8 ", err=%d", queue, device, retval);
+			}
+		}
+
+		// Allocate and set up 1 TX queue per core, and the slow path's
+		retval = rte_eth_tx_queue_setup(
+			device, // device ID
+			queue, // queue ID
+			config->tx_queue_size, // size
+			nat_device_socket(device), // socket
+			&tx_conf // config
+		);
+		if (retval < 0) {
+			rte_exit(EXIT_FAILURE, "Cannot allocate TX queue %" PRIu16 " for device %" PRIu8 " err=%d", queue, device, retval);
+		}
 	}
 
 	// Start the device
@@ -133,51 +266,555 @@ nat_init_device(uint8_t device, struct rte_mempool *mbuf_pool)
 		rte_exit(EXIT_FAILURE, "Cannot start device on device %" PRIu8 ", err=%d", device, retval);
 	}
 
+	// Make the redirection table explicit, i.e. entry i goes to queue (i mod #queues), on all devices;
+	// the NAT relies on all devices sending the same RSS hash to the same queue.
+	if (nb_rx_queues > 1 && device_conf.rxmode.mq_mode == ETH_MQ_RX_RSS && dev_info.reta_size > 0) {
+		struct rte_eth_rss_reta_entry64 reta_conf[dev_info.reta_size / RTE_RETA_GROUP_SIZE];
+		for (uint16_t entry = 0; entry < dev_info.reta_size; entry++) {
+			reta_conf[entry / RTE_RETA_GROUP_SIZE].mask = UINT64_MAX;
+			reta_conf[entry / RTE_RETA_GROUP_SIZE].reta[entry % RTE_RETA_GROUP_SIZE] = entry % nb_rx_queues;
+		}
+
+		retval = rte_eth_dev_rss_reta_update(device, reta_conf, dev_info.reta_size);
+		if (retval != 0) {
+			rte_exit(EXIT_FAILURE, "Cannot set RSS redirection table of device %" PRIu8 ", err=%d", device, retval);
+		}
+	}
+
 	// Enable RX in promiscuous mode for the Ethernet device
 	rte_eth_promiscuous_enable(device);
 
 	return 0;
 }
 
+// Size of the redirection table used by the device, or 0 if it does not spread packets using RSS
+static uint16_t
+nat_device_reta_size(uint8_t device)
+{
+	struct rte_eth_dev_info dev_info;
+	rte_eth_dev_info_get(device, &dev_info);
 
-// --- Per-core work ---
+	const uint64_t needed_offloads = ETH_RSS_NONFRAG_IPV4_TCP | ETH_RSS_NONFRAG_IPV4_UDP;
+	if ((dev_info.flow_type_rss_offloads & needed_offloads) != needed_offloads) {
+		return 0;
+	}
+
+	return dev_info.reta_size;
+}
+
+// Chooses the lcores of the forwarding cores, of the pipeline RX then TX lcores, and of the slow path core, if any,
+// according to the NUMA policy, and sets the number of forwarding cores accordingly.
+// Lcores are taken in order, master first, and the slow path core is the last one, so that without NUMA issues,
+// the master lcore is core 0.
+static void
+nat_assign_lcores(struct nat_config* config, unsigned* core_lcores, unsigned* stage_lcores, unsigned* slow_path_lcore)
+{
+	unsigned nb_devices = rte_eth_dev_count();
+
+	// The socket with the most enabled devices is where rebalancing puts cores
+	unsigned devices_per_socket[RTE_MAX_NUMA_NODES] = { 0 };
+	bool devices_span_sockets = false;
+	int devices_socket = -1;
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config->devices_mask & (1 << device)) != 0) {
+			int socket = nat_device_socket(device);
+			devices_span_sockets |= devices_socket != -1 && socket != devices_socket;
+			devices_per_socket[socket]++;
+			if (devices_socket == -1 || devices_per_socket[socket] > devices_per_socket[devices_socket]) {
+				devices_socket = socket;
+			}
+		}
+	}
+
+	if (devices_span_sockets) {
+		if (config->numa_policy == NAT_NUMA_STRICT) {
+			rte_exit(EXIT_FAILURE, "Enabled devices are on several NUMA sockets, thus every core would poll a remote one.\n");
+		}
+		NAT_INFO("Enabled devices are on several NUMA sockets; every core polls a remote one.");
+	}
+
+	unsigned lcores[RTE_MAX_LCORE];
+	unsigned nb_lcores = 0;
+	lcores[nb_lcores++] = rte_get_master_lcore();
+	unsigned lcore;
+	RTE_LCORE_FOREACH_SLAVE(lcore) {
+		lcores[nb_lcores++] = lcore;
+	}
+
+	// Every lcore polls or sends to every device, thus it is either on the devices' socket, or it is not
+	unsigned nb_kept = 0;
+	for (unsigned n = 0; n < nb_lcores; n++) {
+		int socket = rte_lcore_to_socket_id(lcores[n]);
+		if (socket != devices_socket) {
+			switch (config->numa_policy) {
+				case NAT_NUMA_WARN:
+					NAT_INFO("Lcore %u is on NUMA socket %d, remote to devices on socket %d.", lcores[n], socket, devices_socket);
+					break;
+				case NAT_NUMA_STRICT:
+					rte_exit(EXIT_FAILURE, "Lcore %u is on NUMA socket %d, remote to devices on socket %d.\n",
+						 lcores[n], socket, devices_socket);
+				case NAT_NUMA_REBALANCE:
+					NAT_INFO("Lcore %u is on NUMA socket %d, remote to devices on socket %d; leaving it idle.",
+						 lcores[n], socket, devices_socket);
+					continue;
+			}
+		}
+		lcores[nb_kept++] = lcores[n];
+	}
+
+	// Every TX lcore serves at least one worker
+	unsigned nb_stages = config->pipeline_rx_lcores + config->pipeline_tx_lcores;
+	unsigned min_cores = RTE_MAX(1u, (unsigned) config->pipeline_tx_lcores);
+	if (nb_kept < min_cores + nb_stages + config->slow_path) {
+		rte_exit(EXIT_FAILURE, "Not enough lcores on NUMA socket %d, where the devices are.\n", devices_socket);
+	}
+
+	if (config->slow_path) {
+		nb_kept--;
+		*slow_path_lcore = lcores[nb_kept];
+	}
+	nb_kept -= nb_stages;
+	for (unsigned stage = 0; stage < nb_stages; stage++) {
+		stage_lcores[stage] = lcores[nb_kept + stage];
+	}
+	for (unsigned core_id = 0; core_id < nb_kept; core_id++) {
+		core_lcores[core_id] = lcores[core_id];
+	}
+	config->nb_cores = nb_kept;
+}
+
+
+// --- Idle ---
+
+struct nat_idle_state {
+	// Whether the core sleeps on RX interrupts, as opposed to backing off
+	bool rx_intr;
+	uint32_t empty_polls;
+	unsigned backoff_level;
+};
+
+// Bursts double when they come back full, since the queue is likely to hold more,
+// and halve when they come back less than a quarter full, since the queue is shallow and latency matters more
+static inline uint16_t
+nat_burst_adapt(struct nat_config* config, uint16_t burst, uint16_t received)
+{
+	if (received == burst) {
+		return RTE_MIN(burst * 2, BATCH_SIZE);
+	}
+	if (received < burst / 4) {
+		return RTE_MAX(burst / 2, config->burst_min);
+	}
+	return burst;
+}
 
-static __attribute__((noreturn)) void
-lcore_main(struct nat_config* config)
+// Registers the core's RX queues with its epoll instance, falling back to back-off if any device does not support RX interrupts
+static void
+nat_idle_init(struct nat_config* config, unsigned core_id, struct nat_idle_state* idle)
 {
+	idle->rx_intr = config->idle_polls != 0 && config->pipeline_rx_lcores == 0;
+	idle->empty_polls = 0;
+	idle->backoff_level = 0;
+
 	uint8_t nb_devices = rte_eth_dev_count();
-	unsigned core_id = rte_lcore_id();
+	for (uint8_t device = 0; idle->rx_intr && device < nb_devices; device++) {
+		if ((config->devices_mask & (1 << device)) != 0 &&
+		    rte_eth_dev_rx_intr_ctl_q(device, core_id, RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL) != 0) {
+			NAT_INFO("Core %u: device %" PRIu8 " has no RX interrupts, backing off when idle instead.", core_id, device);
+			idle->rx_intr = false;
+		}
+	}
+}
 
+// Sleeps until packets arrive or a timeout expires; packets that arrive between the last poll and enabling interrupts
+// may not wake the core up, which the timeout bounds. Returns whether packets arrived.
+static bool
+nat_idle_intr_sleep(struct nat_config* config, unsigned core_id)
+{
+	uint8_t nb_devices = rte_eth_dev_count();
 	for (uint8_t device = 0; device < nb_devices; device++) {
-		if (rte_eth_dev_socket_id(device) > 0 && rte_eth_dev_socket_id(device) != (int) rte_socket_id()) {
-			NAT_INFO("Device %" PRIu8 " is on remote NUMA node to polling thread.", device);
+		if ((config->devices_mask & (1 << device)) != 0) {
+			rte_eth_dev_rx_intr_enable(device, core_id);
 		}
 	}
 
+	struct rte_epoll_event events[RTE_MAX_ETHPORTS];
+	int nb_events = rte_epoll_wait(RTE_EPOLL_PER_THREAD, events, RTE_MAX_ETHPORTS, IDLE_INTR_TIMEOUT_MS);
+
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config->devices_mask & (1 << device)) != 0) {
+			rte_eth_dev_rx_intr_disable(device, core_id);
+		}
+	}
+
+	return nb_events > 0;
+}
+
+// Called after every poll of all devices; once there have been enough empty polls in a row, sends what is buffered and sleeps
+static void
+nat_idle_poll(struct nat_config* config, unsigned core_id, struct nat_idle_state* idle, struct nat_core_stats* stats,
+	      bool received)
+{
+	if (likely(received)) {
+		idle->empty_polls = 0;
+		idle->backoff_level = 0;
+		return;
+	}
+
+	if (config->idle_polls == 0 || ++idle->empty_polls < config->idle_polls) {
+		return;
+	}
+
+	// Nothing may stay buffered while the core sleeps
+	nat_core_flush(config, core_id);
+
+	uint64_t start_tsc = rte_rdtsc();
+	if (idle->rx_intr) {
+		// How long the interrupt took to wake the core up cannot be measured without the packets' arrival times,
+		// which devices do not give in TSC cycles; only whether packets, rather than the timeout, woke it up is counted
+		if (nat_idle_intr_sleep(config, core_id)) {
+			stats->intr_wakeups++;
+		}
+		stats->idle_sleeps++;
+	} else if (idle->backoff_level < IDLE_PAUSE_LEVELS) {
+		for (unsigned n = 0; n < (1u << idle->backoff_level); n++) {
+			rte_pause();
+		}
+		idle->backoff_level++;
+	} else {
+		unsigned sleep_us = RTE_MIN(1u << (idle->backoff_level - IDLE_PAUSE_LEVELS), IDLE_MAX_SLEEP_US);
+		usleep(sleep_us);
+		if (sleep_us < IDLE_MAX_SLEEP_US) {
+			idle->backoff_level++;
+		}
+
+		uint64_t asked_tsc = rte_get_tsc_hz() / US_PER_S * sleep_us;
+		uint64_t slept_tsc = rte_rdtsc() - start_tsc;
+		uint64_t oversleep = slept_tsc > asked_tsc ? slept_tsc - asked_tsc : 0;
+		stats->oversleeps++;
+		stats->oversleep_tsc += oversleep;
+		stats->oversleep_max_tsc = RTE_MAX(stats->oversleep_max_tsc, oversleep);
+		stats->idle_sleeps++;
+	}
+	stats->idle_tsc += rte_rdtsc() - start_tsc;
+
+	// Polling resumes, and sleeps again after as many empty polls
+	idle->empty_polls = 0;
+}
+
+
+// --- Per-core work ---
+
+// Also used by pipeline RX and TX lcores, whose core_id is their index among RX or TX lcores
+struct lcore_args {
+	struct nat_config* config;
+	unsigned core_id;
+};
+
+// Receives the core's packets from the device, either from its RX queue, or in pipeline mode from the RX lcores' rings
+static inline uint16_t
+nat_core_receive(struct nat_config* config, unsigned core_id, uint8_t device, struct rte_mbuf** bufs, uint16_t burst)
+{
+	if (likely(config->pipeline_rx_lcores == 0)) {
+		return rte_eth_rx_burst(device, core_id, bufs, burst);
+	}
+
+	uint16_t bufs_len = 0;
+	for (unsigned rx = 0; rx < config->pipeline_rx_lcores && bufs_len < burst; rx++) {
+		struct rte_ring* ring = nat_pipeline_rx_rings[nat_pipeline_rx_ring_index(config, rx, device, core_id)];
+		bufs_len += rte_ring_sc_dequeue_burst(ring, (void**) &bufs[bufs_len], burst - bufs_len, NULL);
+	}
+	return bufs_len;
+}
+
+static int
+lcore_main(void* arg)
+{
+	struct lcore_args* args = (struct lcore_args*) arg;
+	struct nat_config* config = args->config;
+	unsigned core_id = args->core_id;
+
+	uint8_t nb_devices = rte_eth_dev_count();
+
+	// Flow tables are allocated here, thus on this lcore's socket
+	nat_clock_update(rte_rdtsc());
 	nat_core_init(config, core_id);
 
-	NAT_INFO("Core %u forwarding packets.", core_id);
+	NAT_INFO("Core %u (lcore %u) forwarding packets.", core_id, rte_lcore_id());
 
-	// Run until the application is killed
-	while (1) {
+	struct nat_core_stats* stats = nat_core_stats_get(core_id);
+
+	// Every device's queue gets its own burst size, starting from the largest one
+	uint16_t bursts[RTE_MAX_ETHPORTS];
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		bursts[device] = BATCH_SIZE;
+	}
+
+	struct nat_idle_state idle;
+	nat_idle_init(config, core_id, &idle);
+	const uint64_t start_tsc = rte_rdtsc();
+
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * TX_DRAIN_US;
+	uint64_t prev_tsc = 0;
+
+	// Every core refreshes its own stats, which the stats thread prints, if at all
+	uint64_t stats_tsc = rte_get_tsc_hz() * config->stats_interval;
+	uint64_t prev_stats_tsc = rte_rdtsc();
+
+	// Run until the application is stopped
+	while (!stopping) {
+		uint64_t cur_tsc = rte_rdtsc();
+		nat_clock_update(cur_tsc);
+
+		if (unlikely(cur_tsc - prev_tsc > drain_tsc)) {
+			nat_core_flush(config, core_id);
+			prev_tsc = cur_tsc;
+			stats->run_tsc = cur_tsc - start_tsc;
+
+			// Nothing refers to the config between iterations, thus the core picks up changes here, see nat_control.h
+			struct nat_config* new_config = nat_control_quiesce(core_id);
+			if (unlikely(new_config != config)) {
+				config = new_config;
+				nat_core_update_config(config, core_id);
+				stats_tsc = rte_get_tsc_hz() * config->stats_interval;
+			}
+
+			if (stats_tsc != 0 && cur_tsc - prev_stats_tsc > stats_tsc) {
+				nat_core_refresh_stats(config, core_id);
+				prev_stats_tsc = cur_tsc;
+			}
+		}
+
+		// Standby cores do not forward until they take over
+		if (unlikely(config->repl_standby) && nat_core_standby(config, core_id)) {
+			rte_pause();
+			continue;
+		}
+
+		bool received = false;
 		for (uint8_t device = 0; device < nb_devices; device++) {
 			if ((config->devices_mask & (1 << device)) == 0) {
 				continue;
 			}
 
 			struct rte_mbuf* bufs[BATCH_SIZE];
-			uint16_t bufs_len = rte_eth_rx_burst(device, 0, bufs, BATCH_SIZE);
+			uint16_t bufs_len = nat_core_receive(config, core_id, device, bufs, bursts[device]);
+			bursts[device] = nat_burst_adapt(config, bursts[device], bufs_len);
 
 			if (likely(bufs_len != 0)) {
+				stats->rx_packets[device] += bufs_len;
 				nat_core_process(config, core_id, device, bufs, bufs_len);
+				received = true;
 			}
 		}
+
+		nat_idle_poll(config, core_id, &idle, stats, received);
 	}
+
+	nat_core_flush(config, core_id);
+	NAT_INFO("Core %u stopped.", core_id);
+
+	return 0;
+}
+
+static int
+slow_path_lcore_main(void* arg)
+{
+	struct nat_config* config = (struct nat_config*) arg;
+	const unsigned reader = config->nb_cores;
+
+	NAT_INFO("Slow path core (lcore %u) handling exceptions.", rte_lcore_id());
+
+	// Run until the application is stopped; config changes are picked up at every iteration,
+	// which costs little next to handling exceptions
+	while (!stopping) {
+		nat_clock_update(rte_rdtsc());
+		config = nat_control_quiesce(reader);
+		nat_slow_path_process(config);
+	}
+
+	return 0;
+}
+
+// Pipeline RX lcore: polls its RX queue of every device, and hands packets to the workers that own their flows, see nat_pipeline.h
+static int
+pipeline_rx_lcore_main(void* arg)
+{
+	struct lcore_args* args = (struct lcore_args*) arg;
+	struct nat_config* config = args->config;
+	const unsigned rx = args->core_id;
+	const unsigned reader = nat_pipeline_rx_id(config, rx);
+
+	uint8_t nb_devices = rte_eth_dev_count();
+	struct nat_core_stats* stats = nat_core_stats_get(reader);
+
+	NAT_INFO("Pipeline RX %u (lcore %u) receiving packets.", rx, rte_lcore_id());
+
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * TX_DRAIN_US;
+	uint64_t prev_tsc = 0;
+
+	while (!stopping) {
+		uint64_t cur_tsc = rte_rdtsc();
+		if (unlikely(cur_tsc - prev_tsc > drain_tsc)) {
+			config = nat_control_quiesce(reader);
+			prev_tsc = cur_tsc;
+		}
+
+		for (uint8_t device = 0; device < nb_devices; device++) {
+			if ((config->devices_mask & (1 << device)) == 0) {
+				continue;
+			}
+
+			struct rte_mbuf* bufs[BATCH_SIZE];
+			uint16_t bufs_len = rte_eth_rx_burst(device, rx, bufs, BATCH_SIZE);
+			if (bufs_len == 0) {
+				continue;
+			}
+
+			unsigned workers[BATCH_SIZE];
+			for (uint16_t n = 0; n < bufs_len; n++) {
+				workers[n] = nat_pipeline_worker(config, bufs[n]);
+			}
+
+			// One enqueue per worker, of its packets in the order they were received
+			for (uint16_t n = 0; n < bufs_len; n++) {
+				if (bufs[n] == NULL) {
+					continue;
+				}
+
+				struct rte_mbuf* worker_bufs[BATCH_SIZE];
+				uint16_t worker_bufs_len = 0;
+				for (uint16_t m = n; m < bufs_len; m++) {
+					if (bufs[m] != NULL && workers[m] == workers[n]) {
+						worker_bufs[worker_bufs_len++] = bufs[m];
+						bufs[m] = NULL;
+					}
+				}
+
+				struct rte_ring* ring = nat_pipeline_rx_rings[nat_pipeline_rx_ring_index(config, rx, device, workers[n])];
+				uint16_t enqueued = rte_ring_sp_enqueue_burst(ring, (void**) worker_bufs, worker_bufs_len, NULL);
+				stats->pipeline_packets += enqueued;
+				stats->pipeline_dropped += worker_bufs_len - enqueued;
+				for (uint16_t m = enqueued; m < worker_bufs_len; m++) {
+					rte_pktmbuf_free(worker_bufs[m]);
+				}
+			}
+		}
+	}
+
+	NAT_INFO("Pipeline RX %u stopped.", rx);
+
+	return 0;
+}
+
+// Pipeline TX lcore: sends the packets of its workers, those whose ID modulo the number of TX lcores is its index,
+// gathering their packets for each device into bursts; workers are drained in turns, so that none is starved
+static int
+pipeline_tx_lcore_main(void* arg)
+{
+	struct lcore_args* args = (struct lcore_args*) arg;
+	struct nat_config* config = args->config;
+	const unsigned tx = args->core_id;
+	const unsigned reader = nat_pipeline_tx_id(config, tx);
+
+	uint8_t nb_devices = rte_eth_dev_count();
+	struct nat_core_stats* stats = nat_core_stats_get(reader);
+
+	NAT_INFO("Pipeline TX %u (lcore %u) sending packets.", tx, rte_lcore_id());
+
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * TX_DRAIN_US;
+	uint64_t prev_tsc = 0;
+
+	// Worker to drain first, and the number of workers of this lcore
+	unsigned first_worker = tx;
+	unsigned nb_workers = (config->nb_cores - tx + config->pipeline_tx_lcores - 1) / config->pipeline_tx_lcores;
+
+	while (!stopping) {
+		uint64_t cur_tsc = rte_rdtsc();
+		if (unlikely(cur_tsc - prev_tsc > drain_tsc)) {
+			config = nat_control_quiesce(reader);
+			prev_tsc = cur_tsc;
+		}
+
+		// Workers may still flush packets for devices disabled at runtime, thus all devices with rings are drained
+		for (uint8_t device = 0; device < nb_devices; device++) {
+			if (nat_pipeline_tx_ring(config, tx, device) == NULL) {
+				continue;
+			}
+
+			struct rte_mbuf* bufs[BATCH_SIZE];
+			uint16_t bufs_len = 0;
+			unsigned worker = first_worker;
+			for (unsigned n = 0; n < nb_workers && bufs_len < BATCH_SIZE; n++) {
+				struct rte_ring* ring = nat_pipeline_tx_ring(config, worker, device);
+				bufs_len += rte_ring_sc_dequeue_burst(ring, (void**) &bufs[bufs_len], BATCH_SIZE - bufs_len, NULL);
+				worker += config->pipeline_tx_lcores;
+				if (worker >= config->nb_cores) {
+					worker = tx;
+				}
+			}
+			if (bufs_len == 0) {
+				continue;
+			}
+
+			uint16_t sent = rte_eth_tx_burst(device, tx, bufs, bufs_len);
+			stats->pipeline_packets += sent;
+			stats->pipeline_dropped += bufs_len - sent;
+			for (uint16_t n = sent; n < bufs_len; n++) {
+				rte_pktmbuf_free(bufs[n]);
+			}
+		}
+
+		first_worker += config->pipeline_tx_lcores;
+		if (first_worker >= config->nb_cores) {
+			first_worker = tx;
+		}
+	}
+
+	NAT_INFO("Pipeline TX %u stopped.", tx);
+
+	return 0;
+}
+
+
+// --- Stats ---
+
+// Prints the counters that lcores keep in the stats memzone, and dumps the profile when asked to, off the forwarding lcores
+static void*
+nat_stats_main(void* arg)
+{
+	const unsigned reader = (unsigned) (uintptr_t) arg;
+
+	uint64_t prev_stats_tsc = rte_rdtsc();
+	while (1) {
+		usleep(STATS_POLL_US);
+
+		struct nat_config* config = nat_control_quiesce(reader);
+		uint64_t cur_tsc = rte_rdtsc();
+		uint64_t stats_tsc = rte_get_tsc_hz() * config->stats_interval;
+		if (stats_tsc != 0 && cur_tsc - prev_stats_tsc > stats_tsc) {
+			nat_stats_print(config);
+			if (config->pipeline_rx_lcores != 0) {
+				nat_pipeline_print_stats(config);
+			}
+			prev_stats_tsc = cur_tsc;
+		}
+
+		NAT_PROFILE_POLL();
+	}
+
+	return NULL;
 }
 
 
 // --- Main ---
 
+static void
+nat_signal_handler(int signal)
+{
+	(void) signal;
+	stopping = 1;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -191,36 +828,170 @@ main(int argc, char *argv[])
 
 	struct nat_config config;
 	nat_config_init(&config, argc, argv);
-	nat_print_config(&config);
 
-	// Create a memory pool
+	// Must be done before anything depends on the number of cores
+	static unsigned core_lcores[RTE_MAX_LCORE];
+	static unsigned stage_lcores[RTE_MAX_LCORE];
+	unsigned slow_path_lcore = RTE_MAX_LCORE;
+	nat_assign_lcores(&config, core_lcores, stage_lcores, &slow_path_lcore);
+
+	if (config.burst_min > BATCH_SIZE) {
+		rte_exit(EXIT_FAILURE, "Minimum burst size must be at most the batch size, %" PRIu16 ".\n", BATCH_SIZE);
+	}
+
+	// Create one memory pool per socket with devices, so that devices receive into local memory
+	// Every core has its own RX/TX queues on every device, thus a pool grows with both;
+	// the slow path core only has TX queues, but also holds packets in its rings, as do pipeline RX and TX lcores
 	unsigned nb_devices = rte_eth_dev_count();
-	struct rte_mempool* mbuf_pool = rte_pktmbuf_pool_create(
-		"MEMPOOL", // name
-		MEMPOOL_BUFFER_COUNT * nb_devices, // #elements
-		MEMPOOL_CACHE_SIZE, // cache size
-		0, // application private area size
-		RTE_MBUF_DEFAULT_BUF_SIZE, // data buffer size
-		rte_socket_id() // socket ID
-	);
-	if (mbuf_pool == NULL) {
-		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+	unsigned devices_per_socket[RTE_MAX_NUMA_NODES] = { 0 };
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config.devices_mask & (1 << device)) != 0) {
+			devices_per_socket[nat_device_socket(device)]++;
+		}
+	}
+
+	struct rte_mempool* mbuf_pools[RTE_MAX_NUMA_NODES] = { NULL };
+	for (int socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+		if (devices_per_socket[socket] == 0) {
+			continue;
+		}
+
+		char name[RTE_MEMPOOL_NAMESIZE];
+		snprintf(name, sizeof(name), "MEMPOOL_%d", socket);
+		mbuf_pools[socket] = rte_pktmbuf_pool_create(
+			name, // name
+			config.mempool_size * devices_per_socket[socket]
+				* (config.nb_cores + config.slow_path + config.pipeline_rx_lcores + config.pipeline_tx_lcores), // #elements
+			config.mempool_cache_size, // cache size
+			0, // application private area size
+			RTE_MBUF_DEFAULT_BUF_SIZE, // data buffer size
+			socket // socket ID
+		);
+		if (mbuf_pools[socket] == NULL) {
+			rte_exit(EXIT_FAILURE, "Cannot create mbuf pool on socket %d\n", socket);
+		}
 	}
 
 	// Initialize all devices
 	for (uint8_t device = 0; device < nb_devices; device++) {
 		if ((config.devices_mask & (1 << device)) == 0) {
 			NAT_INFO("Skipping disabled device %" PRIu8 ".", device);
-		} else if (nat_init_device(device, mbuf_pool) == 0) {
+		} else if (nat_init_device(&config, device,
+					   config.pipeline_rx_lcores == 0 ? config.nb_cores : config.pipeline_rx_lcores,
+					   config.nb_cores + config.slow_path, mbuf_pools[nat_device_socket(device)]) == 0) {
 			NAT_INFO("Initialized device %" PRIu8 ".", device);
 		} else {
 			rte_exit(EXIT_FAILURE, "Cannot init device %" PRIu8 ".", device);
 		}
 	}
 
+	// Checksums are computed in software for devices that cannot do it
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		config.device_tx_cksum_offload[device] =
+			(config.devices_mask & (1 << device)) != 0 && nat_device_tx_cksum_offload(device);
+	}
+
+	// Packets are classified in software for devices that do not tell their type
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		config.device_rx_packet_type[device] =
+			(config.devices_mask & (1 << device)) != 0 && nat_device_rx_packet_type(device);
+	}
+
+	// Find out whether the NICs spread flows among cores; they must all agree on how to do it.
+	// In pipeline mode, RX lcores spread flows among workers instead, as the NICs would
+	if (config.pipeline_rx_lcores != 0) {
+		config.rss_reta_size = config.nb_cores > 1 ? NAT_PIPELINE_RETA_SIZE : 0;
+		if (config.pipeline_rx_lcores > 1 && nat_device_reta_size(config.wan_device) == 0) {
+			NAT_INFO("Devices do not support RSS; only the first pipeline RX lcore receives packets.");
+		}
+	} else if (config.nb_cores > 1) {
+		config.rss_reta_size = nat_device_reta_size(config.wan_device);
+		for (uint8_t device = 0; device < nb_devices; device++) {
+			if ((config.devices_mask & (1 << device)) != 0 && nat_device_reta_size(device) != config.rss_reta_size) {
+				rte_exit(EXIT_FAILURE, "All devices must have the same RSS redirection table size.\n");
+			}
+		}
+
+		if (config.rss_reta_size == 0) {
+			NAT_INFO("Devices do not support RSS; both directions of a flow must be sent to the same queue.");
+		}
+	}
+
+	nat_print_config(&config);
+
+	// Cores need the rings to set up their TX buffers
+	if (config.pipeline_rx_lcores != 0) {
+		nat_pipeline_init(&config);
+	}
+
+	// Before anything that may read the clock, such as the replication thread
+	nat_clock_init();
+
+	// Needs the RSS table size, which the snapshot must match
+	nat_snapshot_load(&config);
+	if (config.repl_path != NULL) {
+		nat_repl_init(&config);
+	}
+
+	// From now on, lcores use the published config, which can change at runtime; this one stays as it was at startup
+	nat_control_init(&config);
+
+	nat_stats_init();
+	NAT_PROFILE_INIT();
+
+	// The stats thread is the last config reader, see nat_control.h
+	pthread_t stats_thread;
+	if (pthread_create(&stats_thread, NULL, &nat_stats_main, (void*) (uintptr_t) (nat_control_nb_readers(&config) - 1)) != 0) {
+		rte_exit(EXIT_FAILURE, "Cannot create the stats thread\n");
+	}
+	if (!nat_thread_avoid_lcores(stats_thread)) {
+		NAT_INFO("Stats: no CPU is free of lcores, sharing the master lcore's.");
+	}
+	if (config.slow_path) {
+		nat_slow_path_init(&config);
+	}
+
+	// Stop cleanly on SIGTERM, e.g. to restart without losing flows
+	signal(SIGTERM, nat_signal_handler);
+
 	// Run!
-	// ...in single-threaded mode, that is.
-	lcore_main(&config);
+	// One core per queue, on the lcores chosen above; the master lcore runs its core itself, if it has one.
+	if (config.slow_path) {
+		rte_eal_remote_launch(slow_path_lcore_main, nat_control_config, slow_path_lcore);
+	}
+
+	static struct lcore_args stage_args[RTE_MAX_LCORE];
+	for (unsigned stage = 0; stage < (unsigned) config.pipeline_rx_lcores + config.pipeline_tx_lcores; stage++) {
+		bool is_rx = stage < config.pipeline_rx_lcores;
+		stage_args[stage].config = nat_control_config;
+		stage_args[stage].core_id = is_rx ? stage : stage - config.pipeline_rx_lcores;
+		rte_eal_remote_launch(is_rx ? pipeline_rx_lcore_main : pipeline_tx_lcore_main, &stage_args[stage], stage_lcores[stage]);
+	}
+
+	static struct lcore_args args[RTE_MAX_LCORE];
+	for (unsigned core_id = 0; core_id < config.nb_cores; core_id++) {
+		args[core_id].config = nat_control_config;
+		args[core_id].core_id = core_id;
+		if (core_lcores[core_id] != rte_get_master_lcore()) {
+			rte_eal_remote_launch(lcore_main, &args[core_id], core_lcores[core_id]);
+		}
+	}
+
+	if (core_lcores[0] == rte_get_master_lcore()) {
+		lcore_main(&args[0]);
+	}
+
+	rte_eal_mp_wait_lcore();
+
+	// All cores have returned, thus their flows are not changing any more;
+	// the startup config is enough, since what snapshots depend on cannot change at runtime
+	nat_snapshot_save(&config);
+
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config.devices_mask & (1 << device)) != 0) {
+			rte_eth_dev_stop(device);
+		}
+	}
 
 	return 0;
 }
@@ -0,0 +1,125 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+// DPDK uses these but doesn't include them. :|
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <rte_common.h>
+#include <rte_debug.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#include "nat_config.h"
+#include "nat_log.h"
+#include "nat_pipeline.h"
+#include "nat_stats.h"
+
+
+struct rte_ring** nat_pipeline_rx_rings;
+struct rte_ring** nat_pipeline_tx_rings;
+
+
+static struct rte_ring*
+nat_pipeline_ring_create(const char* name, unsigned socket)
+{
+	struct rte_ring* ring = rte_ring_create(name, NAT_PIPELINE_RING_SIZE, socket, RING_F_SP_ENQ | RING_F_SC_DEQ);
+	if (ring == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot create pipeline ring %s\n", name);
+	}
+	return ring;
+}
+
+// Packets in every stride-th ring, as a percentage of their capacity; NULL rings, i.e. of disabled devices, are skipped
+static double
+nat_pipeline_rings_fill(struct rte_ring** rings, unsigned nb_rings, unsigned stride)
+{
+	uint64_t count = 0;
+	uint64_t capacity = 0;
+	for (unsigned n = 0; n < nb_rings; n++) {
+		struct rte_ring* ring = rings[n * stride];
+		if (ring != NULL) {
+			unsigned ring_count = rte_ring_count(ring);
+			count += ring_count;
+			capacity += ring_count + rte_ring_free_count(ring);
+		}
+	}
+	return capacity == 0 ? 0.0 : 100.0 * count / capacity;
+}
+
+
+void
+nat_pipeline_init(struct nat_config* config)
+{
+	unsigned nb_devices = rte_eth_dev_count();
+	unsigned nb_rx_rings = config->pipeline_rx_lcores * RTE_MAX_ETHPORTS * config->nb_cores;
+	unsigned nb_tx_rings = config->nb_cores * RTE_MAX_ETHPORTS;
+	nat_pipeline_rx_rings = (struct rte_ring**) rte_zmalloc("nat_pipeline_rx_rings", nb_rx_rings * sizeof(struct rte_ring*), 0);
+	nat_pipeline_tx_rings = (struct rte_ring**) rte_zmalloc("nat_pipeline_tx_rings", nb_tx_rings * sizeof(struct rte_ring*), 0);
+	if (nat_pipeline_rx_rings == NULL || nat_pipeline_tx_rings == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_pipeline_init\n");
+	}
+
+	// Rings hold packets of one device, thus they are on its socket
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config->devices_mask & (1 << device)) == 0) {
+			continue;
+		}
+
+		int socket = rte_eth_dev_socket_id(device);
+		socket = socket < 0 ? (int) rte_socket_id() : socket;
+		for (unsigned worker = 0; worker < config->nb_cores; worker++) {
+			char name[RTE_RING_NAMESIZE];
+			for (unsigned rx = 0; rx < config->pipeline_rx_lcores; rx++) {
+				snprintf(name, sizeof(name), "nat_rx_%u_%" PRIu8 "_%u", rx, device, worker);
+				nat_pipeline_rx_rings[nat_pipeline_rx_ring_index(config, rx, device, worker)] = nat_pipeline_ring_create(name, socket);
+			}
+			snprintf(name, sizeof(name), "nat_tx_%u_%" PRIu8, worker, device);
+			nat_pipeline_tx_rings[nat_pipeline_tx_ring_index(device, worker)] = nat_pipeline_ring_create(name, socket);
+		}
+	}
+}
+
+void
+nat_pipeline_print_stats(struct nat_config* config)
+{
+	// Counters are concurrently written by their lcores, thus they must actually be read every time
+	volatile struct nat_core_stats* lcores = nat_stats->cores;
+
+	// RX lcores feed the rings of every device and worker, which workers take from
+	for (unsigned rx = 0; rx < config->pipeline_rx_lcores; rx++) {
+		unsigned id = nat_pipeline_rx_id(config, rx);
+		NAT_INFO("Pipeline RX %u: %" PRIu64 " packets, dropped (workers full): %" PRIu64 ", rings %.1f%% full",
+			 rx, lcores[id].pipeline_packets, lcores[id].pipeline_dropped,
+			 nat_pipeline_rings_fill(&nat_pipeline_rx_rings[nat_pipeline_rx_ring_index(config, rx, 0, 0)],
+						 RTE_MAX_ETHPORTS * config->nb_cores, 1));
+	}
+
+	// Workers take from one ring per RX lcore and device, and feed one per device;
+	// averages are over sets of rings of the same devices, thus of the same capacity
+	for (unsigned worker = 0; worker < config->nb_cores; worker++) {
+		double input_fill = 0.0;
+		for (unsigned rx = 0; rx < config->pipeline_rx_lcores; rx++) {
+			input_fill += nat_pipeline_rings_fill(&nat_pipeline_rx_rings[nat_pipeline_rx_ring_index(config, rx, 0, worker)],
+							      RTE_MAX_ETHPORTS, config->nb_cores);
+		}
+		NAT_INFO("Pipeline worker %u: input rings %.1f%% full, output rings %.1f%% full", worker,
+			 input_fill / config->pipeline_rx_lcores,
+			 nat_pipeline_rings_fill(&nat_pipeline_tx_rings[nat_pipeline_tx_ring_index(0, worker)], RTE_MAX_ETHPORTS, 1));
+	}
+
+	// TX lcores take from the rings of their workers
+	for (unsigned tx = 0; tx < config->pipeline_tx_lcores; tx++) {
+		unsigned id = nat_pipeline_tx_id(config, tx);
+		double fill = 0.0;
+		unsigned nb_workers = 0;
+		for (unsigned worker = tx; worker < config->nb_cores; worker += config->pipeline_tx_lcores) {
+			fill += nat_pipeline_rings_fill(&nat_pipeline_tx_rings[nat_pipeline_tx_ring_index(0, worker)], RTE_MAX_ETHPORTS, 1);
+			nb_workers++;
+		}
+		NAT_INFO("Pipeline TX %u: %" PRIu64 " packets, dropped (TX full): %" PRIu64 ", rings %.1f%% full",
+			 tx, lcores[id].pipeline_packets, lcores[id].pipeline_dropped, nb_workers == 0 ? 0.0 : fill / nb_workers);
+	}
+}
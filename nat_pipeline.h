@@ -0,0 +1,114 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include "nat_config.h"
+#include "nat_rss.h"
+#include "nat_util.h"
+
+
+// Pipeline mode, for devices that cannot do symmetric RSS, thus cannot have each core poll the packets of its own flows.
+// RX lcores each poll one RX queue of every device, and hand packets to the worker that owns their flow, see nat_pipeline_worker;
+// workers are the usual cores, with their own flows and port slices, which take packets from rings instead of RX queues.
+// Workers hand the packets they send to TX lcores, see nat_tx.h; TX lcore t serves the workers w such that
+// w mod config->pipeline_tx_lcores = t, and sends their packets for a device together, through its TX queue t.
+//
+// Stages are connected by single-producer single-consumer rings: one per RX lcore, device and worker,
+// and one per worker and device, so that workers still know which device packets came from and go to.
+// RX lcores emulate the NICs' symmetric RSS, with a redirection table of NAT_PIPELINE_RETA_SIZE entries,
+// so that flows are spread and their ports chosen as with RSS, see nat_core_port_bucket.
+
+#define NAT_PIPELINE_RETA_SIZE 512
+
+// Packets per ring
+#define NAT_PIPELINE_RING_SIZE 1024
+
+
+// Indexed by nat_pipeline_rx_ring_index and nat_pipeline_tx_ring_index; NULL when not in pipeline mode
+extern struct rte_ring** nat_pipeline_rx_rings;
+extern struct rte_ring** nat_pipeline_tx_rings;
+
+
+// Creates the rings of all devices enabled at startup; must be called once, before any lcore starts, in pipeline mode only
+void
+nat_pipeline_init(struct nat_config* config);
+
+// Prints the packets and drops of RX and TX lcores, and how full the rings of every stage are
+void
+nat_pipeline_print_stats(struct nat_config* config);
+
+
+// IDs of RX and TX lcores, see config->pipeline_rx_lcores
+static unsigned
+nat_pipeline_rx_id(struct nat_config* config, unsigned rx)
+{
+	return config->nb_cores + config->slow_path + rx;
+}
+
+static unsigned
+nat_pipeline_tx_id(struct nat_config* config, unsigned tx)
+{
+	return config->nb_cores + config->slow_path + config->pipeline_rx_lcores + tx;
+}
+
+static unsigned
+nat_pipeline_rx_ring_index(struct nat_config* config, unsigned rx, uint8_t device, unsigned worker)
+{
+	return (rx * RTE_MAX_ETHPORTS + device) * config->nb_cores + worker;
+}
+
+static unsigned
+nat_pipeline_tx_ring_index(uint8_t device, unsigned worker)
+{
+	return worker * RTE_MAX_ETHPORTS + device;
+}
+
+// Ring through which the worker sends packets to the device, or NULL if it sends them itself, e.g. if it is the slow path
+static struct rte_ring*
+nat_pipeline_tx_ring(struct nat_config* config, unsigned worker, uint8_t device)
+{
+	if (nat_pipeline_tx_rings == NULL || worker >= config->nb_cores) {
+		return NULL;
+	}
+	return nat_pipeline_tx_rings[nat_pipeline_tx_ring_index(device, worker)];
+}
+
+// Worker that owns the flow of a packet, as the NICs' symmetric RSS would choose it; WAN packets thus go to the worker
+// whose port slice has their destination port, see nat_config_external_port_core.
+// Other packets, which are exceptions for the slow path anyway, are spread by address, or go to the first worker.
+static unsigned
+nat_pipeline_worker(struct nat_config* config, struct rte_mbuf* mbuf)
+{
+	// Headers are read whatever the packet length, which is fine since buffers are much larger than them
+	struct ether_hdr* ether_header = nat_get_mbuf_ether_header(mbuf);
+	if (config->nb_cores == 1 || ether_header->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+		return 0;
+	}
+
+	struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(mbuf);
+	bool is_fragment = (ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG | IPV4_HDR_OFFSET_MASK)) != 0;
+	bool is_tcpudp = ipv4_header->next_proto_id == IPPROTO_TCP || ipv4_header->next_proto_id == IPPROTO_UDP;
+	uint16_t fold;
+	if (is_tcpudp && !is_fragment) {
+		struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(ipv4_header);
+		if (mbuf->port == config->wan_device) {
+			int32_t core = nat_config_external_port_core(config, tcpudp_header->dst_port);
+			return core < 0 ? 0 : core;
+		}
+		fold = nat_rss_fold(ipv4_header->src_addr, ipv4_header->dst_addr, tcpudp_header->src_port, tcpudp_header->dst_port);
+	} else {
+		fold = nat_rss_fold(ipv4_header->src_addr, ipv4_header->dst_addr, 0, 0);
+	}
+
+	// Redirection table entry i goes to worker i mod nb_cores, as with devices, see nat_init_device
+	return nat_rss_reta_index(fold, config->rss_reta_size) % config->nb_cores;
+}
@@ -0,0 +1,71 @@
+#ifdef NAT_PROFILE
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+
+#include "nat_log.h"
+#include "nat_profile.h"
+
+
+struct nat_profile nat_profiles[RTE_MAX_LCORE];
+
+volatile int nat_profile_dump_requested;
+
+static const char* NAT_PROFILE_STAGE_NAMES[NAT_PROFILE_STAGES_COUNT] = {
+	"expiry",
+	"parse",
+	"lookup",
+	"create",
+	"rewrite",
+	"checksum",
+	"tx"
+};
+
+
+static void
+nat_profile_signal_handler(int signal)
+{
+	(void) signal;
+	nat_profile_dump_requested = 1;
+}
+
+void
+nat_profile_init(void)
+{
+	signal(SIGUSR1, nat_profile_signal_handler);
+	atexit(nat_profile_dump);
+}
+
+void
+nat_profile_dump(void)
+{
+	NAT_INFO("\n--- NAT Profile (cycles per stage call) ---\n");
+
+	for (unsigned core = 0; core < RTE_MAX_LCORE; core++) {
+		for (unsigned stage = 0; stage < NAT_PROFILE_STAGES_COUNT; stage++) {
+			uint64_t count = 0;
+			for (unsigned bucket = 0; bucket < 64; bucket++) {
+				count += nat_profiles[core].histograms[stage][bucket];
+			}
+			if (count == 0) {
+				continue;
+			}
+
+			NAT_INFO("Core %u, %s: %" PRIu64 " calls, %" PRIu64 " cycles on average",
+				 core, NAT_PROFILE_STAGE_NAMES[stage], count, nat_profiles[core].total_cycles[stage] / count);
+			for (unsigned bucket = 0; bucket < 64; bucket++) {
+				if (nat_profiles[core].histograms[stage][bucket] != 0) {
+					NAT_INFO("  [2^%u, 2^%u): %" PRIu64, bucket, bucket + 1, nat_profiles[core].histograms[stage][bucket]);
+				}
+			}
+		}
+	}
+
+	NAT_INFO("\n--- --- ------- ---\n");
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+// Stage profiler: records TSC cycle counts of the stages of packet processing, per core, as log2 histograms.
+// Only enabled when compiled with NAT_PROFILE defined (e.g. `make NAT_PROFILE=1`), otherwise it compiles to nothing.
+// Histograms are printed on SIGUSR1 (by core 0, at its next drain) and at exit.
+//
+// Usage, within a function that has a core_id:
+//   NAT_PROFILE_BEGIN(start);
+//   ... stage ...
+//   NAT_PROFILE_END(start, core_id, NAT_PROFILE_STAGE_xxx);
+
+#ifdef NAT_PROFILE
+
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+
+
+enum nat_profile_stage {
+	NAT_PROFILE_STAGE_EXPIRY,
+	NAT_PROFILE_STAGE_PARSE,
+	NAT_PROFILE_STAGE_LOOKUP,
+	NAT_PROFILE_STAGE_CREATE,
+	NAT_PROFILE_STAGE_REWRITE,
+	NAT_PROFILE_STAGE_CHECKSUM,
+	NAT_PROFILE_STAGE_TX,
+	NAT_PROFILE_STAGES_COUNT
+};
+
+struct nat_profile {
+	// Bucket i counts the measurements in [2^i, 2^(i+1)) cycles
+	uint64_t histograms[NAT_PROFILE_STAGES_COUNT][64];
+	uint64_t total_cycles[NAT_PROFILE_STAGES_COUNT];
+} __rte_cache_aligned;
+
+extern struct nat_profile nat_profiles[RTE_MAX_LCORE];
+
+// Set by SIGUSR1
+extern volatile int nat_profile_dump_requested;
+
+
+static void
+nat_profile_add(unsigned core_id, enum nat_profile_stage stage, uint64_t cycles)
+{
+	nat_profiles[core_id].histograms[stage][63 - __builtin_clzll(cycles | 1)]++;
+	nat_profiles[core_id].total_cycles[stage] += cycles;
+}
+
+void
+nat_profile_init(void);
+
+void
+nat_profile_dump(void);
+
+
+#define NAT_PROFILE_BEGIN(var) uint64_t var = rte_rdtsc()
+#define NAT_PROFILE_END(var, core_id, stage) nat_profile_add(core_id, stage, rte_rdtsc() - var)
+
+#define NAT_PROFILE_INIT() nat_profile_init()
+// Dumps if requested by a signal
+#define NAT_PROFILE_POLL() \
+		do { \
+			if (unlikely(nat_profile_dump_requested)) { \
+				nat_profile_dump_requested = 0; \
+				nat_profile_dump(); \
+			} \
+		} while (0)
+
+#else
+
+#define NAT_PROFILE_BEGIN(var)
+#define NAT_PROFILE_END(var, core_id, stage)
+#define NAT_PROFILE_INIT()
+#define NAT_PROFILE_POLL()
+
+#endif
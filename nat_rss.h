@@ -0,0 +1,49 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_byteorder.h>
+
+
+// Symmetric RSS key, i.e. 0x6d5a repeated; long enough for all NICs we know of (40 or 52 bytes).
+// With this key, every 32-bit window of the key starting at bit i only depends on i mod 16,
+// thus the Toeplitz hash of a packet is the hash of the XOR of all 16-bit words of its hashed fields.
+// This means swapping source and destination does not change the hash (so both directions of a connection
+// end up on the same queue), and it also lets the NAT predict which queue a reply will end up on.
+static uint8_t NAT_RSS_KEY[] = {
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a
+};
+
+
+// XORs the 16-bit words of a TCP/UDP 4-tuple, given in network order (as they are in packets).
+// Fields that should not be part of the fold can be 0.
+static uint16_t
+nat_rss_fold(uint32_t src_addr, uint32_t dst_addr, uint16_t src_port, uint16_t dst_port)
+{
+	uint32_t addrs = src_addr ^ dst_addr;
+	return rte_be_to_cpu_16((uint16_t) (addrs ^ (addrs >> 16) ^ src_port ^ dst_port));
+}
+
+// Index in the redirection table of a packet whose fields fold to the given value,
+// i.e. low bits of the Toeplitz hash with the symmetric key.
+// reta_size must be a power of 2.
+static uint16_t
+nat_rss_reta_index(uint16_t fold, uint16_t reta_size)
+{
+	const uint64_t key = 0x6d5a6d5a6d5a6d5aULL;
+
+	uint32_t hash = 0;
+	for (uint8_t bit = 0; bit < 16; bit++) {
+		if (fold & (0x8000 >> bit)) {
+			hash ^= (uint32_t) ((key << bit) >> 32);
+		}
+	}
+
+	return hash & (reta_size - 1);
+}
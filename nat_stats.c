@@ -0,0 +1,131 @@
+#include <inttypes.h>
+
+// DPDK uses these but doesn't include them. :|
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_memzone.h>
+
+#include "nat_config.h"
+#include "nat_log.h"
+#include "nat_stats.h"
+
+
+struct nat_stats* nat_stats;
+
+
+void
+nat_stats_init(void)
+{
+	const struct rte_memzone* memzone = rte_memzone_reserve(NAT_STATS_MEMZONE, sizeof(struct nat_stats), rte_socket_id(), 0);
+	if (memzone == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot reserve memory for statistics\n");
+	}
+
+	nat_stats = (struct nat_stats*) memzone->addr;
+	memset(nat_stats, 0, sizeof(struct nat_stats));
+}
+
+void
+nat_stats_print(struct nat_config* config)
+{
+	// Counters are concurrently written by their cores, thus they must actually be read every time
+	volatile struct nat_core_stats* cores = nat_stats->cores;
+
+	NAT_INFO("\n--- NAT Stats ---\n");
+
+	uint8_t nb_devices = rte_eth_dev_count();
+	for (uint8_t device = 0; device < nb_devices; device++) {
+		if ((config->devices_mask & (1 << device)) == 0) {
+			continue;
+		}
+
+		uint64_t rx_packets = 0;
+		uint64_t tx_packets = 0;
+		for (uint16_t core = 0; core < config->nb_cores + config->slow_path; core++) {
+			rx_packets += cores[core].rx_packets[device];
+			tx_packets += cores[core].tx_packets[device];
+		}
+
+		// Device drops, as opposed to NAT drops
+		struct rte_eth_stats device_stats;
+		rte_eth_stats_get(device, &device_stats);
+
+		NAT_INFO("Device %" PRIu8 " RX: %" PRIu64 ", TX: %" PRIu64 ", missed: %" PRIu64 ", no mbuf: %" PRIu64
+			 ", RX errors: %" PRIu64 ", TX errors: %" PRIu64,
+			 device, rx_packets, tx_packets, device_stats.imissed, device_stats.rx_nombuf,
+			 device_stats.ierrors, device_stats.oerrors);
+	}
+
+	uint64_t dropped_not_tcpudp = 0;
+	uint64_t dropped_unknown_flow = 0;
+	uint64_t dropped_no_port = 0;
+	uint64_t dropped_table_full = 0;
+	uint64_t dropped_tx_full = 0;
+	uint64_t dropped_slow_path_full = 0;
+	uint64_t dropped_fragment = 0;
+	uint64_t flows_created = 0;
+	uint64_t flows_expired = 0;
+	uint64_t flows_capacity = 0;
+	uint64_t map_keys = 0;
+	uint64_t map_collided_keys = 0;
+	uint64_t map_max_chain_length = 0;
+	uint64_t idle_tsc = 0;
+	uint64_t run_tsc = 0;
+	uint64_t idle_sleeps = 0;
+	uint64_t intr_wakeups = 0;
+	uint64_t oversleeps = 0;
+	uint64_t oversleep_tsc = 0;
+	uint64_t oversleep_max_tsc = 0;
+	uint64_t repl_records = 0;
+	uint64_t repl_dropped = 0;
+	for (uint16_t core = 0; core < config->nb_cores + config->slow_path; core++) {
+		dropped_not_tcpudp += cores[core].dropped_not_tcpudp;
+		dropped_unknown_flow += cores[core].dropped_unknown_flow;
+		dropped_no_port += cores[core].dropped_no_port;
+		dropped_table_full += cores[core].dropped_table_full;
+		dropped_tx_full += cores[core].dropped_tx_full;
+		dropped_slow_path_full += cores[core].dropped_slow_path_full;
+		dropped_fragment += cores[core].dropped_fragment;
+		flows_created += cores[core].flows_created;
+		flows_expired += cores[core].flows_expired;
+		flows_capacity += cores[core].flows_capacity;
+		map_keys += cores[core].map_keys;
+		map_collided_keys += cores[core].map_collided_keys;
+		map_max_chain_length = RTE_MAX(map_max_chain_length, cores[core].map_max_chain_length);
+		idle_tsc += cores[core].idle_tsc;
+		run_tsc += cores[core].run_tsc;
+		idle_sleeps += cores[core].idle_sleeps;
+		intr_wakeups += cores[core].intr_wakeups;
+		oversleeps += cores[core].oversleeps;
+		oversleep_tsc += cores[core].oversleep_tsc;
+		oversleep_max_tsc = RTE_MAX(oversleep_max_tsc, cores[core].oversleep_max_tsc);
+		repl_records += cores[core].repl_records;
+		repl_dropped += cores[core].repl_dropped;
+	}
+
+	NAT_INFO("Dropped not TCP/UDP: %" PRIu64 ", unknown flow: %" PRIu64 ", no port: %" PRIu64 ", table full: %" PRIu64
+		 ", TX full: %" PRIu64 ", slow path full: %" PRIu64 ", fragment: %" PRIu64,
+		 dropped_not_tcpudp, dropped_unknown_flow, dropped_no_port, dropped_table_full, dropped_tx_full,
+		 dropped_slow_path_full, dropped_fragment);
+	NAT_INFO("Flows created: %" PRIu64 ", expired: %" PRIu64 ", current: %" PRIu64 " / %" PRIu64,
+		 flows_created, flows_expired, flows_created - flows_expired, flows_capacity);
+	NAT_INFO("Flow map keys: %" PRIu64 ", collided: %" PRIu64 ", longest chain: %" PRIu64,
+		 map_keys, map_collided_keys, map_max_chain_length);
+
+	// Idle time is roughly the share of core power saved compared to busy-polling
+	const double tsc_per_us = rte_get_tsc_hz() / 1e6;
+	NAT_INFO("Idle: %.1f%% of core time, sleeps: %" PRIu64 ", woken by RX interrupts: %" PRIu64
+		 ", back-off oversleep: %.1f us average, %.1f us max",
+		 run_tsc == 0 ? 0.0 : 100.0 * idle_tsc / run_tsc, idle_sleeps, intr_wakeups,
+		 oversleeps == 0 ? 0.0 : oversleep_tsc / tsc_per_us / oversleeps, oversleep_max_tsc / tsc_per_us);
+	if (config->repl_path != NULL) {
+		NAT_INFO("Replication records %s: %" PRIu64 ", dropped: %" PRIu64,
+			 config->repl_standby ? "applied" : "sent", repl_records, repl_dropped);
+	}
+
+	NAT_INFO("\n--- --- ----- ---\n");
+}
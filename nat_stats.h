@@ -0,0 +1,82 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_ethdev.h>
+
+#include "nat_config.h"
+
+
+// Datapath counters.
+// Every core, including the slow path core if any, only writes its own counters, in their own cache lines, without locks or atomics;
+// readers sum them up, and may thus see values that are slightly out of date, which is fine for statistics.
+// The counters live in a memzone named NAT_STATS_MEMZONE, so that other DPDK processes (e.g. secondary processes)
+// can read them as well, using the layout in this file.
+
+#define NAT_STATS_MEMZONE "NAT_STATS"
+
+struct nat_core_stats {
+	uint64_t rx_packets[RTE_MAX_ETHPORTS];
+	uint64_t tx_packets[RTE_MAX_ETHPORTS];
+
+	// Drops, by reason
+	uint64_t dropped_not_tcpudp;
+	uint64_t dropped_unknown_flow;
+	uint64_t dropped_no_port;
+	uint64_t dropped_table_full;
+	uint64_t dropped_tx_full;
+	uint64_t dropped_slow_path_full;
+	uint64_t dropped_fragment;
+
+	// Table occupancy is the number of created flows minus the number of expired ones
+	uint64_t flows_created;
+	uint64_t flows_expired;
+	uint64_t flows_capacity;
+
+	// Spread of flow IDs in the core's flow maps, see nat_map_get_stats; only refreshed by nat_core_refresh_stats
+	uint64_t map_keys;
+	uint64_t map_collided_keys;
+	uint64_t map_max_chain_length;
+
+	// Time spent idle, out of the time the core has been running, in TSC cycles; run_tsc is refreshed at every TX drain
+	uint64_t idle_tsc;
+	uint64_t run_tsc;
+	uint64_t idle_sleeps;
+	// Sleeps on RX interrupts that packets ended, as opposed to the timeout
+	uint64_t intr_wakeups;
+	// Back-off sleeps, and how much longer than asked they took, in TSC cycles
+	uint64_t oversleeps;
+	uint64_t oversleep_tsc;
+	uint64_t oversleep_max_tsc;
+
+	// Replication records sent by an active instance, or applied by a standby one, and those that were dropped
+	uint64_t repl_records;
+	uint64_t repl_dropped;
+
+	// Pipeline RX and TX lcores only, see nat_pipeline.h: packets they passed on, and those the next stage had no room for
+	uint64_t pipeline_packets;
+	uint64_t pipeline_dropped;
+} __rte_cache_aligned;
+
+struct nat_stats {
+	struct nat_core_stats cores[RTE_MAX_LCORE];
+};
+
+
+extern struct nat_stats* nat_stats;
+
+static struct nat_core_stats*
+nat_core_stats_get(unsigned core_id)
+{
+	return &nat_stats->cores[core_id];
+}
+
+
+// Allocates and zeroes the counters; must be called before any core starts
+void
+nat_stats_init(void);
+
+// Prints the sum of all cores' counters, along with the devices' own counters
+void
+nat_stats_print(struct nat_config* config);
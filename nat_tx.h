@@ -0,0 +1,90 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include "nat_profile.h"
+#include "nat_stats.h"
+
+
+// Buffer of packets to send through a device's TX queue,
+// so that packets going to the same device are sent in batches even if they are processed one at a time.
+// Buffers are flushed when full, and must be flushed periodically so that packets are not held back under low traffic.
+
+#define NAT_TX_BUFFER_SIZE 32
+
+struct nat_tx_buffer {
+	uint8_t device;
+	uint16_t queue;
+	// In pipeline mode, ring to the TX lcore that sends the packets instead, see nat_pipeline.h
+	struct rte_ring* ring;
+	uint16_t len;
+	struct rte_mbuf* bufs[NAT_TX_BUFFER_SIZE];
+
+	// Stats of the core that owns the buffer
+	struct nat_core_stats* stats;
+};
+
+
+// Sends packets through the device's TX queue, or hands them to a TX lcore through the ring if there is one;
+// returns the number of packets taken, the caller still owns the others
+static uint16_t
+nat_tx_burst(uint8_t device, uint16_t queue, struct rte_ring* ring, struct rte_mbuf** bufs, uint16_t bufs_len)
+{
+	if (ring != NULL) {
+		return rte_ring_sp_enqueue_burst(ring, (void**) bufs, bufs_len, NULL);
+	}
+	return rte_eth_tx_burst(device, queue, bufs, bufs_len);
+}
+
+static void
+nat_tx_buffer_init(struct nat_tx_buffer* buffer, uint8_t device, uint16_t queue, struct rte_ring* ring, struct nat_core_stats* stats)
+{
+	buffer->device = device;
+	buffer->queue = queue;
+	buffer->ring = ring;
+	buffer->len = 0;
+	buffer->stats = stats;
+}
+
+// Sends all buffered packets, dropping those the device could not take; returns the number of dropped packets
+static uint16_t
+nat_tx_buffer_flush(struct nat_tx_buffer* buffer)
+{
+	if (buffer->len == 0) {
+		return 0;
+	}
+
+	NAT_PROFILE_BEGIN(profile_start);
+	uint16_t sent_len = nat_tx_burst(buffer->device, buffer->queue, buffer->ring, buffer->bufs, buffer->len);
+	// The queue is the core ID
+	NAT_PROFILE_END(profile_start, buffer->queue, NAT_PROFILE_STAGE_TX);
+	uint16_t dropped_len = buffer->len - sent_len;
+	buffer->stats->tx_packets[buffer->device] += sent_len;
+
+	if (unlikely(dropped_len != 0)) {
+		for (uint16_t buf = sent_len; buf < buffer->len; buf++) {
+			rte_pktmbuf_free(buffer->bufs[buf]);
+		}
+		buffer->stats->dropped_tx_full += dropped_len;
+	}
+
+	buffer->len = 0;
+	return dropped_len;
+}
+
+// Buffers a packet, sending the buffer if it is full; returns the number of dropped packets
+static uint16_t
+nat_tx_buffer_add(struct nat_tx_buffer* buffer, struct rte_mbuf* mbuf)
+{
+	buffer->bufs[buffer->len] = mbuf;
+	buffer->len++;
+
+	if (buffer->len == NAT_TX_BUFFER_SIZE) {
+		return nat_tx_buffer_flush(buffer);
+	}
+	return 0;
+}
@@ -1,15 +1,27 @@
 #pragma once
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <netinet/in.h>
 
 #include <rte_ether.h>
 #include <rte_ip.h>
+#include <rte_lcore.h>
 #include <rte_mbuf.h>
 #include <rte_tcp.h>
 #include <rte_udp.h>
 
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+#include "nat_config.h"
+
 
 // A header for TCP or UDP packets, containing common data.
 // (This is used to point into DPDK data structures!)
@@ -32,31 +44,102 @@ nat_get_mbuf_ipv4_header(struct rte_mbuf* mbuf)
 }
 
 
+// Sets the Ethernet addresses of a packet from its output device's template
+static void
+nat_l2_rewrite(struct ether_hdr* header, const struct nat_l2_template* l2_template)
+{
+#ifdef __SSE4_1__
+	// The last 4 bytes are the packet's own, i.e. its ethertype and the start of its L3 header,
+	// which are read whatever the packet length, as buffers are much larger than that
+	const __m128i mask = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0);
+	__m128i packet = _mm_loadu_si128((const __m128i*) header);
+	__m128i addrs = _mm_load_si128((const __m128i*) l2_template);
+	_mm_storeu_si128((__m128i*) header, _mm_blendv_epi8(packet, addrs, mask));
+#else
+	memcpy(header, l2_template, 2 * sizeof(struct ether_addr));
+#endif
+}
+
 static struct tcpudp_hdr*
 nat_get_ipv4_tcpudp_header(struct ipv4_hdr* header)
 {
-	uint8_t offset = header->version_ihl & IPV4_HDR_IHL_MASK;
-	// TODO use offset
-	return (struct tcpudp_hdr*)(header + 1);
+	// The header length is in 32-bit words, and includes options
+	uint8_t offset = (header->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	return (struct tcpudp_hdr*)((uint8_t*) header + offset);
 }
 
+// Makes the device compute the IPv4 and TCP/UDP checksums of a packet when sending it,
+// which requires the TCP/UDP checksum to be set to the checksum of the pseudo-header.
 static void
-nat_set_ipv4_checksum(struct ipv4_hdr* header)
+nat_offload_ipv4_checksum(struct rte_mbuf* mbuf, struct ipv4_hdr* header)
 {
-	// TODO: See if can be Offloaded to hardware
+	mbuf->l2_len = sizeof(struct ether_hdr);
+	mbuf->l3_len = (header->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	mbuf->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
 	header->hdr_checksum = 0;
 
 	if (header->next_proto_id == IPPROTO_TCP) {
-		struct tcp_hdr* tcp_header = (struct tcp_hdr*)(header + 1);
-		tcp_header->cksum = 0;
-		tcp_header->cksum = rte_ipv4_udptcp_cksum(header, tcp_header);
+		struct tcp_hdr* tcp_header = (struct tcp_hdr*) nat_get_ipv4_tcpudp_header(header);
+		mbuf->ol_flags |= PKT_TX_TCP_CKSUM;
+		tcp_header->cksum = rte_ipv4_phdr_cksum(header, mbuf->ol_flags);
 	} else if (header->next_proto_id == IPPROTO_UDP) {
-		struct udp_hdr * udp_header = (struct udp_hdr*)(header + 1);
-		udp_header->dgram_cksum = 0;
-		udp_header->dgram_cksum = rte_ipv4_udptcp_cksum(header, udp_header);
+		struct udp_hdr* udp_header = (struct udp_hdr*) nat_get_ipv4_tcpudp_header(header);
+		// A zero UDP checksum means there is none
+		if (udp_header->dgram_cksum != 0) {
+			mbuf->ol_flags |= PKT_TX_UDP_CKSUM;
+			udp_header->dgram_cksum = rte_ipv4_phdr_cksum(header, mbuf->ol_flags);
+		}
 	}
+}
 
-	header->hdr_checksum = rte_ipv4_cksum(header);
+// Difference between 32-bit values for the purpose of checksums,
+// i.e. the sum of the new 16-bit words and of the complements of the old ones
+static uint32_t
+nat_cksum_diff32(uint32_t old_value, uint32_t new_value)
+{
+	return (uint16_t) ~old_value + (uint16_t) ~(old_value >> 16) + (new_value & 0xFFFF) + (new_value >> 16);
+}
+
+static uint32_t
+nat_cksum_diff16(uint16_t old_value, uint16_t new_value)
+{
+	return (uint16_t) ~old_value + new_value;
+}
+
+// Incrementally updates a checksum given a difference, as per RFC 1624 (HC' = ~(~HC + ~m + m'))
+static uint16_t
+nat_cksum_adjust(uint16_t cksum, uint32_t diff)
+{
+	uint32_t sum = (uint16_t) ~cksum + diff;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t) ~sum;
+}
+
+// Updates the IPv4 and TCP/UDP checksums of a packet after one of its addresses and one of its ports were rewritten,
+// without reading the payload; all values are in network order.
+static void
+nat_update_ipv4_checksum(struct ipv4_hdr* header, uint32_t old_addr, uint32_t new_addr, uint16_t old_port, uint16_t new_port)
+{
+	uint32_t addr_diff = nat_cksum_diff32(old_addr, new_addr);
+	header->hdr_checksum = nat_cksum_adjust(header->hdr_checksum, addr_diff);
+
+	// The L4 checksum covers the address as part of the pseudo-header
+	uint32_t l4_diff = addr_diff + nat_cksum_diff16(old_port, new_port);
+
+	if (header->next_proto_id == IPPROTO_TCP) {
+		struct tcp_hdr* tcp_header = (struct tcp_hdr*) nat_get_ipv4_tcpudp_header(header);
+		tcp_header->cksum = nat_cksum_adjust(tcp_header->cksum, l4_diff);
+	} else if (header->next_proto_id == IPPROTO_UDP) {
+		struct udp_hdr* udp_header = (struct udp_hdr*) nat_get_ipv4_tcpudp_header(header);
+		// A zero UDP checksum means there is none, and a computed zero is thus sent as all ones
+		if (udp_header->dgram_cksum != 0) {
+			udp_header->dgram_cksum = nat_cksum_adjust(udp_header->dgram_cksum, l4_diff);
+			if (udp_header->dgram_cksum == 0) {
+				udp_header->dgram_cksum = 0xFFFF;
+			}
+		}
+	}
 }
 
 
@@ -92,3 +175,24 @@ nat_ipv4_to_str(uint32_t addr)
 	);
 	return buffer;
 }
+
+// Keeps a helper thread off the lcores' CPUs, assuming lcore IDs are CPU IDs, as with the -l and -c EAL options;
+// returns false if no CPU is free of lcores, in which case the thread keeps the CPUs of its creator, usually the master lcore's
+static bool
+nat_thread_avoid_lcores(pthread_t thread)
+{
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long cpu = 0; cpu < nb_cpus && cpu < CPU_SETSIZE; cpu++) {
+		if (cpu >= RTE_MAX_LCORE || !rte_lcore_is_enabled(cpu)) {
+			CPU_SET(cpu, &cpus);
+		}
+	}
+
+	if (CPU_COUNT(&cpus) == 0) {
+		return false;
+	}
+	pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+	return true;
+}
@@ -10,6 +10,10 @@
 
 #include "../nat_config.h"
 #include "../nat_forward.h"
+#include "../nat_pipeline.h"
+#include "../nat_profile.h"
+#include "../nat_stats.h"
+#include "../nat_tx.h"
 #include "../nat_util.h"
 
 void
@@ -23,9 +27,6 @@ nat_core_init(struct nat_config* config, unsigned core_id)
 void
 nat_core_process(struct nat_config* config, unsigned core_id, uint8_t device, struct rte_mbuf** bufs, uint16_t bufs_len)
 {
-	// Mark core_id as unused, since this is a single-threaded program
-	(void) core_id;
-
 	// This is a bit of a hack; the benchmarks are designed for a NAT, which knows where to forward packets,
 	// but for a plain forwarding app without any logic, we just send all packets from LAN to the WAN port,
 	// and all packets from WAN to the main LAN port, and let the recipient ignore the useless ones.
@@ -37,18 +38,93 @@ nat_core_process(struct nat_config* config, unsigned core_id, uint8_t device, st
 		dst_device = config->wan_device;
 	}
 
-	// L2 forwarding
+	// L2 forwarding; the template is copied since packet writes could otherwise alias it
+	NAT_PROFILE_BEGIN(rewrite_start);
+	const struct nat_l2_template l2_template = config->l2_templates[dst_device];
 	for (uint16_t buf = 0; buf < bufs_len; buf++) {
-		struct ether_hdr* ether_header = nat_get_mbuf_ether_header(bufs[buf]);
-		ether_header->s_addr = config->device_macs[dst_device];
-		ether_header->d_addr = config->endpoint_macs[dst_device];
+		nat_l2_rewrite(nat_get_mbuf_ether_header(bufs[buf]), &l2_template);
 	}
+	NAT_PROFILE_END(rewrite_start, core_id, NAT_PROFILE_STAGE_REWRITE);
 
-	uint16_t sent_count = rte_eth_tx_burst(dst_device, 0, bufs, bufs_len);
+	NAT_PROFILE_BEGIN(tx_start);
+	uint16_t sent_count = nat_tx_burst(dst_device, core_id, nat_pipeline_tx_ring(config, core_id, dst_device), bufs, bufs_len);
+	NAT_PROFILE_END(tx_start, core_id, NAT_PROFILE_STAGE_TX);
+
+	struct nat_core_stats* stats = nat_core_stats_get(core_id);
+	stats->tx_packets[dst_device] += sent_count;
 
 	if (unlikely(sent_count < bufs_len)) {
 		for (uint16_t buf = sent_count; buf < bufs_len; buf++) {
 			rte_pktmbuf_free(bufs[buf]);
 		}
+		stats->dropped_tx_full += bufs_len - sent_count;
 	}
 }
+
+void
+nat_core_refresh_stats(struct nat_config* config, unsigned core_id)
+{
+	// Nothing; there are no flows.
+	(void) config;
+	(void) core_id;
+}
+
+void
+nat_slow_path_init(struct nat_config* config)
+{
+	// Nothing; every packet is forwarded as is.
+	(void) config;
+}
+
+void
+nat_slow_path_process(struct nat_config* config)
+{
+	// Nothing; see above.
+	(void) config;
+}
+
+void
+nat_core_flush(struct nat_config* config, unsigned core_id)
+{
+	// Nothing; packets are sent as soon as they are processed.
+	(void) config;
+	(void) core_id;
+}
+
+void
+nat_snapshot_load(struct nat_config* config)
+{
+	// Nothing; there are no flows.
+	(void) config;
+}
+
+void
+nat_snapshot_save(struct nat_config* config)
+{
+	// Nothing; there are no flows.
+	(void) config;
+}
+
+void
+nat_repl_init(struct nat_config* config)
+{
+	// Nothing; there are no flows.
+	(void) config;
+}
+
+void
+nat_core_update_config(struct nat_config* config, unsigned core_id)
+{
+	// Nothing; the config is read for every packet.
+	(void) config;
+	(void) core_id;
+}
+
+bool
+nat_core_standby(struct nat_config* config, unsigned core_id)
+{
+	// Never; there are no flows to wait for.
+	(void) config;
+	(void) core_id;
+	return false;
+}
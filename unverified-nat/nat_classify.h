@@ -0,0 +1,149 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_prefetch.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "../nat_util.h"
+
+#include "nat_flow.h"
+
+// Packets on the fast path are Ethernet frames carrying IPv4 without options nor fragmentation, and TCP or UDP.
+// Everything else is an exception, handled separately so that the fast path needs no branches on packet contents.
+
+
+// Smallest fast path packet: Ethernet and IPv4 headers, and TCP/UDP ports
+#define NAT_CLASSIFY_MIN_LEN (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct tcpudp_hdr))
+
+// Whether the packet type set by a device is that of a fast path packet.
+// Devices do not always know whether IPv4 packets have options, so this still has to be checked.
+static bool
+nat_classify_packet_type(uint32_t packet_type)
+{
+	uint32_t l4_type = packet_type & RTE_PTYPE_L4_MASK;
+	return ((packet_type & RTE_PTYPE_L2_MASK) == RTE_PTYPE_L2_ETHER)
+	     & (RTE_ETH_IS_IPV4_HDR(packet_type) != 0)
+	     & ((l4_type == RTE_PTYPE_L4_TCP) | (l4_type == RTE_PTYPE_L4_UDP));
+}
+
+// Whether a packet is on the fast path, using its packet type if the device that received it sets it.
+// Its flow ID is extracted into *id even if it is not, which must thus have room for 16 bytes.
+static bool
+nat_classify_packet(struct rte_mbuf* mbuf, bool use_packet_type, struct nat_flow_id* id)
+{
+	// Headers are read whatever the packet length, which is fine since buffers are much larger than them
+	const uint8_t* packet = rte_pktmbuf_mtod(mbuf, const uint8_t*);
+	bool is_long_enough = mbuf->data_len >= NAT_CLASSIFY_MIN_LEN;
+
+#ifdef __SSSE3__
+	// Bytes 12 to 27 of the packet: ethertype at 0, IPv4 version and IHL at 2,
+	// flags and fragment offset at 8 (only DF may be set), protocol at 11
+	__m128i header = _mm_loadu_si128((const __m128i*) (packet + 12));
+	const __m128i full_mask = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0x3F, -1, 0, 0, 0, 0, 0, 0);
+	// Only the IHL needs checking when the packet type is known
+	const __m128i packet_type_mask = _mm_setr_epi8(0, 0, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i expected = _mm_setr_epi8(0x08, 0x00, 0x45, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	// Expected bytes are masked too, so that unchecked bytes compare equal
+	__m128i mask = use_packet_type ? packet_type_mask : full_mask;
+	__m128i masked = _mm_and_si128(header, mask);
+	bool is_header_ok = _mm_movemask_epi8(_mm_cmpeq_epi8(masked, _mm_and_si128(expected, mask))) == 0xFFFF;
+	uint8_t protocol = _mm_extract_epi16(header, 5) >> 8;
+
+	// Bytes 8 to 23 of the IPv4 header hold the protocol, addresses and ports (at 1, 4, 8 and 12),
+	// which are shuffled in the order of nat_flow_id
+	__m128i fields = _mm_loadu_si128((const __m128i*) (packet + sizeof(struct ether_hdr) + 8));
+	const __m128i id_shuffle = _mm_setr_epi8(4, 5, 6, 7, 12, 13, 8, 9, 10, 11, 14, 15, 1, -1, -1, -1);
+	_mm_storeu_si128((__m128i*) id, _mm_shuffle_epi8(fields, id_shuffle));
+#else
+	const struct ether_hdr* ether_header = (const struct ether_hdr*) packet;
+	const struct ipv4_hdr* ipv4_header = (const struct ipv4_hdr*) (ether_header + 1);
+	const struct tcpudp_hdr* tcpudp_header = (const struct tcpudp_hdr*) (ipv4_header + 1);
+	bool is_header_ok = (ipv4_header->version_ihl == 0x45)
+			  & (use_packet_type
+			     | ((ether_header->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+				& ((ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG | IPV4_HDR_OFFSET_MASK)) == 0)));
+	uint8_t protocol = ipv4_header->next_proto_id;
+
+	id->src_addr = ipv4_header->src_addr;
+	id->src_port = tcpudp_header->src_port;
+	id->dst_addr = ipv4_header->dst_addr;
+	id->dst_port = tcpudp_header->dst_port;
+	id->protocol = protocol;
+#endif
+
+	bool is_tcpudp = use_packet_type ? nat_classify_packet_type(mbuf->packet_type)
+					 : (protocol == IPPROTO_TCP) | (protocol == IPPROTO_UDP);
+	return is_long_enough & is_header_ok & is_tcpudp;
+}
+
+// Splits a burst into fast path packets, whose flow IDs are extracted, and exceptions.
+// ids must have room for bufs_len + 1 IDs, see nat_classify_packet.
+// Packet data is prefetched prefetch_distance packets ahead; returns the number of fast path packets.
+static uint16_t
+nat_classify_burst(struct rte_mbuf** bufs, uint16_t bufs_len, bool use_packet_type, uint16_t prefetch_distance,
+		   struct rte_mbuf** flow_bufs, struct nat_flow_id* ids,
+		   struct rte_mbuf** exception_bufs, uint16_t* exception_bufs_len)
+{
+	uint16_t flow_bufs_len = 0;
+	uint16_t exceptions_len = 0;
+
+	for (uint16_t buf = 0; buf < prefetch_distance && buf < bufs_len; buf++) {
+		rte_prefetch0(rte_pktmbuf_mtod(bufs[buf], void*));
+	}
+	for (uint16_t buf = 0; buf < bufs_len; buf++) {
+		if (buf + prefetch_distance < bufs_len) {
+			rte_prefetch0(rte_pktmbuf_mtod(bufs[buf + prefetch_distance], void*));
+		}
+
+		// Packets go to the end of both lists, but only the list they belong to grows
+		bool is_flow = nat_classify_packet(bufs[buf], use_packet_type, &ids[flow_bufs_len]);
+		flow_bufs[flow_bufs_len] = bufs[buf];
+		exception_bufs[exceptions_len] = bufs[buf];
+		flow_bufs_len += is_flow;
+		exceptions_len += !is_flow;
+	}
+
+	*exception_bufs_len = exceptions_len;
+	return flow_bufs_len;
+}
+
+// Whether an exception can be translated anyway, i.e. is a TCP/UDP packet whose IPv4 header has options;
+// extracts its flow ID if so.
+static bool
+nat_classify_exception(struct rte_mbuf* mbuf, struct nat_flow_id* id)
+{
+	struct ether_hdr* ether_header = nat_get_mbuf_ether_header(mbuf);
+	struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(mbuf);
+	if (mbuf->data_len < sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+	    || ether_header->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4)
+	    || (ipv4_header->version_ihl >> 4) != 4
+	    || (ipv4_header->next_proto_id != IPPROTO_TCP && ipv4_header->next_proto_id != IPPROTO_UDP)
+	    // Only the first fragment has ports, and fragments are not reassembled
+	    || (ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG | IPV4_HDR_OFFSET_MASK)) != 0) {
+		return false;
+	}
+
+	uint16_t ipv4_len = (ipv4_header->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	if (ipv4_len < sizeof(struct ipv4_hdr) || mbuf->data_len < sizeof(struct ether_hdr) + ipv4_len + sizeof(struct tcpudp_hdr)) {
+		return false;
+	}
+
+	struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(ipv4_header);
+	id->src_addr = ipv4_header->src_addr;
+	id->src_port = tcpudp_header->src_port;
+	id->dst_addr = ipv4_header->dst_addr;
+	id->dst_port = tcpudp_header->dst_port;
+	id->protocol = ipv4_header->next_proto_id;
+	return true;
+}
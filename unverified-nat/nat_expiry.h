@@ -0,0 +1,166 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "nat_flow.h"
+
+
+// Timing wheel to expire flows.
+// Each slot holds a doubly-linked list of the flows whose expiration time falls within its time span,
+// and the wheel spans more than the expiration time, so that inserting and removing flows is O(1).
+// A single level is enough since all flows have the same expiration time,
+// i.e. a flow never expires further than one expiration time in the future.
+//
+// Refreshing a flow only updates its timestamp, which is O(1) and does not touch any other flow;
+// when the wheel reaches the flow's slot, a refreshed flow is moved to the slot of its new expiration time.
+// Expiring is bounded by a budget per call, thus its cost does not depend on the number of flows.
+//
+// Times are in milliseconds of the clock in nat_clock.h; flows only store 32-bit truncations of them,
+// which the wheel extends relative to its current time, see nat_expiry_wheel_expiration.
+
+// Number of slots in the wheel; must be a power of 2, and fit in nat_flow's expiry_slot
+#define NAT_EXPIRY_WHEEL_SLOTS 256
+
+struct nat_expiry_wheel {
+	// Heads of the slots' lists, as indices in the flows
+	uint32_t slots[NAT_EXPIRY_WHEEL_SLOTS];
+
+	// Flows the indices refer to, i.e. the flow pool
+	struct nat_flow* flows;
+
+	// Time span of a slot
+	uint64_t slot_width;
+
+	// Flows expire once more than this has elapsed since their last packet
+	uint64_t expiration_time;
+
+	// Absolute index of the next slot to expire, i.e. its time span starts at cursor * slot_width
+	uint64_t cursor;
+
+	// Time of the last call to nat_expiry_wheel_expire, which is also the time of flows linked until the next call
+	uint64_t now;
+};
+
+
+static void
+nat_expiry_wheel_init(struct nat_expiry_wheel* wheel, struct nat_flow* flows, uint32_t expiration_time, uint64_t now)
+{
+	for (uint32_t slot = 0; slot < NAT_EXPIRY_WHEEL_SLOTS; slot++) {
+		wheel->slots[slot] = NAT_FLOW_NONE;
+	}
+
+	wheel->flows = flows;
+
+	// Keep a couple of slots as slack for the slot being expired and for rounding
+	wheel->slot_width = expiration_time / (NAT_EXPIRY_WHEEL_SLOTS - 2) + 1;
+	wheel->expiration_time = expiration_time;
+	wheel->cursor = now / wheel->slot_width;
+	wheel->now = now;
+}
+
+// Changes the expiration time of all flows, e.g. when the config changes at runtime; slots keep their width,
+// thus flows are visited late if it shrinks, or relinked at every turn if it grows past the wheel's span, as when expiring falls behind
+static void
+nat_expiry_wheel_set_expiration_time(struct nat_expiry_wheel* wheel, uint32_t expiration_time)
+{
+	wheel->expiration_time = expiration_time;
+}
+
+// A flow's timestamp cannot be in the future, thus its age is the 32-bit difference with the current time
+static uint64_t
+nat_expiry_wheel_expiration(struct nat_expiry_wheel* wheel, struct nat_flow* flow)
+{
+	uint32_t age = (uint32_t) wheel->now - flow->last_packet_timestamp;
+	return wheel->now - age + wheel->expiration_time + 1;
+}
+
+static void
+nat_expiry_wheel_link(struct nat_expiry_wheel* wheel, uint32_t index)
+{
+	struct nat_flow* flow = &wheel->flows[index];
+	uint64_t slot = nat_expiry_wheel_expiration(wheel, flow) / wheel->slot_width;
+	// If expiring fell behind, slots may be out of the wheel's span; flows are then visited early or late,
+	// which is fine since flows are only expired based on their timestamp
+	if (slot < wheel->cursor) {
+		slot = wheel->cursor;
+	} else if (slot >= wheel->cursor + NAT_EXPIRY_WHEEL_SLOTS) {
+		slot = wheel->cursor + NAT_EXPIRY_WHEEL_SLOTS - 1;
+	}
+
+	flow->expiry_slot = slot & (NAT_EXPIRY_WHEEL_SLOTS - 1);
+	flow->expiry_prev = NAT_FLOW_NONE;
+	flow->expiry_next = wheel->slots[flow->expiry_slot];
+	if (flow->expiry_next != NAT_FLOW_NONE) {
+		wheel->flows[flow->expiry_next].expiry_prev = index;
+	}
+	wheel->slots[flow->expiry_slot] = index;
+}
+
+static void
+nat_expiry_wheel_unlink(struct nat_expiry_wheel* wheel, uint32_t index)
+{
+	struct nat_flow* flow = &wheel->flows[index];
+
+	if (flow->expiry_prev == NAT_FLOW_NONE) {
+		wheel->slots[flow->expiry_slot] = flow->expiry_next;
+	} else {
+		wheel->flows[flow->expiry_prev].expiry_next = flow->expiry_next;
+	}
+
+	if (flow->expiry_next != NAT_FLOW_NONE) {
+		wheel->flows[flow->expiry_next].expiry_prev = flow->expiry_prev;
+	}
+}
+
+// Expires flows whose expiration time is before now, by calling expire_fn on each of their indices after unlinking them.
+// Flows refreshed since they were linked are linked again, and refresh_fn is called on their indices;
+// this happens at most once per expiration time per flow, however many packets refreshed it.
+// Processes at most 'budget' flows and empty slots; whatever is left is processed by the next calls.
+template<typename ExpireFn, typename RefreshFn>
+static void
+nat_expiry_wheel_expire(struct nat_expiry_wheel* wheel, uint64_t now, uint32_t budget, ExpireFn expire_fn, RefreshFn refresh_fn)
+{
+	wheel->now = now;
+
+	// If expiring fell behind by more than a full turn, there is no point in visiting the same slots twice
+	uint64_t now_slot = now / wheel->slot_width;
+	if (now_slot > wheel->cursor + NAT_EXPIRY_WHEEL_SLOTS) {
+		wheel->cursor = now_slot - NAT_EXPIRY_WHEEL_SLOTS;
+	}
+
+	// A slot can only be expired once its entire time span is over
+	while (budget > 0 && (wheel->cursor + 1) * wheel->slot_width <= now) {
+		uint32_t* head = &wheel->slots[wheel->cursor & (NAT_EXPIRY_WHEEL_SLOTS - 1)];
+		if (*head == NAT_FLOW_NONE) {
+			wheel->cursor++;
+			budget--;
+			continue;
+		}
+
+		while (budget > 0 && *head != NAT_FLOW_NONE) {
+			uint32_t index = *head;
+			nat_expiry_wheel_unlink(wheel, index);
+			budget--;
+
+			if (nat_expiry_wheel_expiration(wheel, &wheel->flows[index]) <= now) {
+				expire_fn(index);
+			} else {
+				// Refreshed since it was linked, its slot is now further in the future
+				nat_expiry_wheel_link(wheel, index);
+				refresh_fn(index);
+			}
+		}
+	}
+}
+
+// Calls fn on the index of every flow in the wheel, i.e. every live flow, in no particular order
+template<typename Fn>
+static void
+nat_expiry_wheel_for_each(struct nat_expiry_wheel* wheel, Fn fn)
+{
+	for (uint32_t slot = 0; slot < NAT_EXPIRY_WHEEL_SLOTS; slot++) {
+		for (uint32_t index = wheel->slots[slot]; index != NAT_FLOW_NONE; index = wheel->flows[index].expiry_next) {
+			fn(index);
+		}
+	}
+}
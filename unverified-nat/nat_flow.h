@@ -1,6 +1,7 @@
 #pragma once
 
-#include <time.h>
+#include <inttypes.h>
+#include <string.h>
 
 
 struct nat_flow_id {
@@ -8,9 +9,7 @@ struct nat_flow_id {
 	uint16_t src_port;
 	uint32_t dst_addr;
 	uint16_t dst_port;
-	// To use DPDK maps, this type must have a power of 2 size,
-	// so we make this 32-bit even though it only needs 8
-	uint32_t protocol;
+	uint8_t protocol;
 } __attribute__((__packed__));
 
 static uint64_t
@@ -28,13 +27,28 @@ nat_flow_id_hash(struct nat_flow_id id)
 static bool
 nat_flow_id_eq(struct nat_flow_id left, struct nat_flow_id right)
 {
-	return 1 - memcmp(&left, &right, sizeof(struct nat_flow_id));
+	return memcmp(&left, &right, sizeof(struct nat_flow_id)) == 0;
 }
 
 
+// Index of no flow, see nat_flow_pool.h
+#define NAT_FLOW_NONE UINT32_MAX
+
+// Flows are addressed by index in a pool, and packed so that two of them fit in a cache line.
 struct nat_flow {
 	struct nat_flow_id id;
-	uint8_t internal_device;
+	// Index in the config's external addresses
+	uint8_t external_addr_index;
 	uint16_t external_port;
-	time_t last_packet_timestamp;
+	uint8_t internal_device;
+
+	// Position in the expiry wheel, see nat_expiry.h
+	uint8_t expiry_slot;
+
+	// Truncated clock time in milliseconds, see nat_clock.h
+	uint32_t last_packet_timestamp;
+
+	// Neighbours in the expiry wheel, or in the free list of the pool
+	uint32_t expiry_prev;
+	uint32_t expiry_next;
 };
@@ -0,0 +1,81 @@
+// This file is a C++ file masquerading as a C file, see nat_forward_nat.c
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_debug.h>
+#include <rte_hash_crc.h>
+#include <rte_per_lcore.h>
+
+#include "nat_flow.h"
+#include "nat_flow_hash.h"
+
+
+static RTE_DEFINE_PER_LCORE(uint64_t, nat_flow_hash_seeds[3]);
+
+
+// Splits an ID into a 64-bit word and the remaining 40 bits
+static void
+nat_flow_hash_words(nat_flow_id* id, uint64_t* first, uint64_t* second)
+{
+	*second = 0;
+	memcpy(first, id, sizeof(uint64_t));
+	memcpy(second, (uint8_t*) id + sizeof(uint64_t), sizeof(nat_flow_id) - sizeof(uint64_t));
+}
+
+static uint64_t
+nat_flow_id_hash_crc32c(nat_flow_id id)
+{
+	uint64_t first, second;
+	nat_flow_hash_words(&id, &first, &second);
+
+	uint32_t crc = rte_hash_crc_8byte(first, (uint32_t) RTE_PER_LCORE(nat_flow_hash_seeds)[0]);
+	crc = rte_hash_crc_8byte(second, crc);
+	// Maps use both the low and high bits of hashes, multiplying spreads the CRC over all of them
+	return crc * 0x9E3779B97F4A7C15ULL;
+}
+
+// Folded 64x64 -> 128 bit multiplication, every bit of which depends on most bits of both operands
+static uint64_t
+nat_flow_hash_mum(uint64_t left, uint64_t right)
+{
+	__uint128_t product = (__uint128_t) left * right;
+	return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static uint64_t
+nat_flow_id_hash_mix(nat_flow_id id)
+{
+	uint64_t first, second;
+	nat_flow_hash_words(&id, &first, &second);
+
+	uint64_t* seeds = RTE_PER_LCORE(nat_flow_hash_seeds);
+	return nat_flow_hash_mum(nat_flow_hash_mum(first ^ seeds[0], second ^ seeds[1]), seeds[2]);
+}
+
+
+nat_map_hash_fn
+nat_flow_hash_init(enum nat_flow_hash_kind kind)
+{
+	FILE* random = fopen("/dev/urandom", "rb");
+	if (random == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot open /dev/urandom to seed flow hashes\n");
+	}
+	if (fread(RTE_PER_LCORE(nat_flow_hash_seeds), sizeof(uint64_t), 3, random) != 3) {
+		rte_exit(EXIT_FAILURE, "Cannot read /dev/urandom to seed flow hashes\n");
+	}
+	fclose(random);
+
+	switch (kind) {
+		case NAT_FLOW_HASH_CRC32C:
+			return &nat_flow_id_hash_crc32c;
+		case NAT_FLOW_HASH_MIX:
+			return &nat_flow_id_hash_mix;
+		case NAT_FLOW_HASH_POLY:
+			return &nat_flow_id_hash;
+	}
+	rte_exit(EXIT_FAILURE, "Unknown flow hash %d\n", (int) kind);
+}
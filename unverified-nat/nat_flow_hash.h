@@ -0,0 +1,18 @@
+#pragma once
+
+#include "../nat_config.h"
+
+#include "nat_map.h"
+
+// Hash functions of flow IDs.
+// Remote hosts choose part of the IDs, so a predictable hash lets them force collisions and make lookups slow;
+// the hashes are thus seeded randomly, with different seeds on each core since cores have their own maps.
+// - crc32c: CRC32C of the ID, from the seed, using SSE4.2 if available. Fastest, but since CRCs are linear,
+//           IDs that collide do so whatever the seed.
+// - mix: multiply-mix of the ID xored with the seed. Almost as fast, and collisions cannot be predicted.
+// - poly: the original unseeded polynomial, see nat_flow_id_hash, only for comparison.
+
+
+// Seeds the calling core's hashes, and returns the hash function of the given kind for its maps
+nat_map_hash_fn
+nat_flow_hash_init(enum nat_flow_hash_kind kind);
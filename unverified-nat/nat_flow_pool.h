@@ -0,0 +1,61 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_malloc.h>
+
+#include "nat_flow.h"
+
+
+// Fixed-capacity pool of flows, allocated once from hugepages on a given NUMA node.
+// Flows are addressed by their 32-bit index in the pool;
+// free flows are chained through their expiry_next index, so the pool needs no memory besides the flows.
+
+static_assert(sizeof(struct nat_flow) == 32, "Two flows must fit in a cache line");
+
+struct nat_flow_pool {
+	struct nat_flow* flows;
+
+	// Head of the free list, or NAT_FLOW_NONE if the pool is exhausted
+	uint32_t free_head;
+};
+
+
+static void
+nat_flow_pool_init(struct nat_flow_pool* pool, uint32_t capacity, int socket)
+{
+	pool->flows = (struct nat_flow*) rte_malloc_socket("nat_flows", capacity * sizeof(struct nat_flow), RTE_CACHE_LINE_SIZE, socket);
+	if (pool->flows == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_flow_pool_init\n");
+	}
+
+	for (uint32_t index = 0; index < capacity; index++) {
+		pool->flows[index].expiry_next = index + 1 == capacity ? NAT_FLOW_NONE : index + 1;
+	}
+	pool->free_head = capacity == 0 ? NAT_FLOW_NONE : 0;
+}
+
+static struct nat_flow*
+nat_flow_pool_get(struct nat_flow_pool* pool, uint32_t index)
+{
+	return &pool->flows[index];
+}
+
+// Returns NAT_FLOW_NONE if the pool is exhausted
+static uint32_t
+nat_flow_pool_alloc(struct nat_flow_pool* pool)
+{
+	uint32_t index = pool->free_head;
+	if (likely(index != NAT_FLOW_NONE)) {
+		pool->free_head = pool->flows[index].expiry_next;
+	}
+	return index;
+}
+
+static void
+nat_flow_pool_free(struct nat_flow_pool* pool, uint32_t index)
+{
+	pool->flows[index].expiry_next = pool->free_head;
+	pool->free_head = index;
+}
@@ -4,262 +4,1022 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
-#include <time.h>
 
 #include <netinet/in.h>
 
-#include <queue>
 #include <vector>
 
 #include <rte_ethdev.h>
+#include <rte_byteorder.h>
 #include <rte_ip.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_prefetch.h>
+#include <rte_ring.h>
 
+#include "../nat_clock.h"
 #include "../nat_config.h"
 #include "../nat_forward.h"
 #include "../nat_log.h"
+#include "../nat_pipeline.h"
+#include "../nat_profile.h"
+#include "../nat_rss.h"
+#include "../nat_stats.h"
+#include "../nat_tx.h"
 #include "../nat_util.h"
 
+#include "nat_classify.h"
+#include "nat_expiry.h"
 #include "nat_flow.h"
+#include "nat_flow_hash.h"
+#include "nat_flow_pool.h"
 #include "nat_map.h"
+#include "nat_repl.h"
+#include "nat_slow_path.h"
+#include "nat_snapshot.h"
 
-// ICMP support is not implemented, as this NAT only exists for benchmarking purposes;
-// since the protocol type has to be checked anyway, an ICMP check would not significantly
-// change performance.
+// ICMP and fragments are only supported with a slow path core, see nat_slow_path.h;
+// without one, they are dropped, and only TCP/UDP packets with IPv4 options are translated besides the fast path.
 
 
-static bool
-nat_flow_greater_timestamp(nat_flow* left, nat_flow* right)
-{
-	return left->last_packet_timestamp > right->last_packet_timestamp;
-}
+// Maximum number of flows to look at for expiration per call to nat_core_process
+static const uint32_t EXPIRY_BUDGET = 64;
+
+// Prefetch distance, in packets, see nat_core_process
+// Can be overriden at compile time
+#ifndef NAT_PREFETCH_DISTANCE
+#define NAT_PREFETCH_DISTANCE 8
+#endif
+
+// Maximum number of ports to try for a new flow when reusing ports, so that creating flows is O(1)
+static const uint32_t PORT_REUSE_ATTEMPTS = 8;
+
+
+// Each core has its own shard of the flows, and its own slice of the external port range.
+// Cores never touch each other's state, the NICs' symmetric RSS ensures they see all packets of their flows.
+struct nat_core_state {
+	// External ports of the core's slice of the port range, by RSS bucket (in network order, see nat_core_port_bucket).
+	// Ports are reused for flows with different remote endpoints, and handed out in turn from a cursor per
+	// external address and bucket (at index address * nb_buckets + bucket), skipping those that would conflict.
+	// In direct WAN lookup mode, ports cannot be reused, and these are instead the available ports
+	// of each external address and bucket, at the same indices.
+	std::vector<std::vector<uint16_t>> ports;
+	std::vector<uint32_t> port_cursors;
+	uint16_t nb_buckets;
+
+	// All flows of the core; maps and the expiry wheel refer to them by index
+	struct nat_flow_pool flows;
+
+	struct nat_map* flows_from_inside;
+	// Only in hash WAN lookup mode
+	struct nat_map* flows_from_outside;
+	// Copy of the config's, which cannot change at runtime, so that the outside map can rebuild keys, see nat_core_outside_key
+	uint32_t external_addrs[NAT_MAX_EXTERNAL_ADDRS];
 
+	// Only in direct WAN lookup mode: flow index by external address index * nb_ports + external port - first_port,
+	// or NAT_FLOW_NONE; the external address and port identify the flow, the rest of the ID only needs to be checked
+	uint32_t* flows_by_port;
+	uint32_t first_port;
+	uint32_t nb_ports;
 
-static std::vector<uint16_t> available_ports;
+	struct nat_expiry_wheel flows_by_time;
 
-static struct nat_map* flows_from_inside;
-static struct nat_map* flows_from_outside;
+	// Time of the current burst, truncated as in flows
+	uint32_t current_timestamp;
 
-static std::priority_queue<struct nat_flow*,
-				std::vector<struct nat_flow*>,
-				decltype(&nat_flow_greater_timestamp)> flows_by_time(nat_flow_greater_timestamp);
+	// Packets to send, per device
+	struct nat_tx_buffer tx_buffers[RTE_MAX_ETHPORTS];
 
-static time_t current_timestamp;
+	struct nat_core_stats* stats;
+	unsigned core_id;
+
+	// Replication, see nat_repl.h: batch being filled, if any, and on the active instance,
+	// the index of the next flow to resend to a standby that connected, or NAT_FLOW_NONE
+	struct nat_repl_batch* repl_batch;
+	uint32_t repl_resync_cursor;
+	// Whether the core is a standby, i.e. does not forward packets but applies the active instance's updates
+	bool standby;
+};
+
+static struct nat_core_state* core_states[RTE_MAX_LCORE];
+
+// Snapshot to restore flows from, if any, see nat_snapshot_load
+static const struct nat_snapshot_header* snapshot;
+
+
+// ID of a flow as seen from the outside, i.e. of its replies
+static struct nat_flow_id
+nat_flow_id_from_outside(const uint32_t* external_addrs, struct nat_flow_id* id, uint8_t external_addr_index, uint16_t external_port)
+{
+	struct nat_flow_id outside_id;
+	outside_id.src_addr = id->dst_addr;
+	outside_id.src_port = id->dst_port;
+	outside_id.dst_addr = external_addrs[external_addr_index];
+	outside_id.dst_port = external_port;
+	outside_id.protocol = id->protocol;
+	return outside_id;
+}
 
+// Keys of the flow maps, rebuilt from the flows, see nat_map_key_fn
+static struct nat_flow_id
+nat_core_inside_key(void* context, uint32_t index)
+{
+	struct nat_core_state* state = (struct nat_core_state*) context;
+	return nat_flow_pool_get(&state->flows, index)->id;
+}
 
 static struct nat_flow_id
-nat_flow_id_from_ipv4(struct ipv4_hdr* header)
+nat_core_outside_key(void* context, uint32_t index)
 {
-	struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(header);
-
-	nat_flow_id id;
-	id.src_addr = header->src_addr;
-	id.src_port = tcpudp_header->src_port;
-	id.dst_addr = header->dst_addr;
-	id.dst_port = tcpudp_header->dst_port;
-	id.protocol = header->next_proto_id;
-	return id;
+	struct nat_core_state* state = (struct nat_core_state*) context;
+	struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+	return nat_flow_id_from_outside(state->external_addrs, &flow->id, flow->external_addr_index, flow->external_port);
 }
 
 
+// Index of the available ports bucket a port belongs to.
+// Replies to a flow from an internal address and port are received by the same core as the flow's packets
+// if and only if the flow's external port is in the bucket of the fold of the internal address and port with the
+// external address, since the RSS hash of the reply is the hash of the flow's packets XORed with the hash of that fold.
+// The fold argument is thus either the external port or that fold, in network order.
+static uint16_t
+nat_core_port_bucket(struct nat_config* config, uint16_t fold)
+{
+	if (config->nb_cores == 1 || config->rss_reta_size == 0) {
+		return 0;
+	}
+
+	return nat_rss_reta_index(fold, config->rss_reta_size);
+}
+
+// Index in flows_by_port, for a port in the core's range
+static uint32_t
+nat_core_port_slot(struct nat_core_state* state, uint8_t external_addr_index, uint16_t external_port)
+{
+	return external_addr_index * state->nb_ports + rte_be_to_cpu_16(external_port) - state->first_port;
+}
+
+// Same contract as nat_map_get_bulk, for WAN packets in direct lookup mode
 static void
-nat_flows_by_time_refresh(void)
+nat_core_lookup_by_port(struct nat_config* config, struct nat_core_state* state,
+			struct nat_flow_id* ids, uint16_t ids_len, uint64_t* hit_mask, uint32_t* indices)
 {
-	// This only works because the default container of priority_queue is a vector.
-	std::make_heap(
-		const_cast<nat_flow**>(&flows_by_time.top()),
-		const_cast<nat_flow**>(&flows_by_time.top()) + flows_by_time.size(),
-		nat_flow_greater_timestamp
-	);
+	// First find candidate flows and prefetch them, then check them, so that flow loads overlap
+	uint64_t candidate_mask = 0;
+	for (uint16_t n = 0; n < ids_len; n++) {
+		int32_t addr_index = nat_config_external_addr_index(config, ids[n].dst_addr);
+		// Ports below the core's range wrap around to large values
+		uint32_t port_offset = (uint32_t) rte_be_to_cpu_16(ids[n].dst_port) - state->first_port;
+		if (addr_index < 0 || port_offset >= state->nb_ports) {
+			continue;
+		}
+
+		indices[n] = state->flows_by_port[addr_index * state->nb_ports + port_offset];
+		if (indices[n] != NAT_FLOW_NONE) {
+			rte_prefetch0(nat_flow_pool_get(&state->flows, indices[n]));
+			candidate_mask |= 1ULL << n;
+		}
+	}
+
+	*hit_mask = 0;
+	while (candidate_mask != 0) {
+		uint16_t n = __builtin_ctzll(candidate_mask);
+		candidate_mask &= candidate_mask - 1;
+
+		struct nat_flow* flow = nat_flow_pool_get(&state->flows, indices[n]);
+		if (flow->id.dst_addr == ids[n].src_addr && flow->id.dst_port == ids[n].src_port && flow->id.protocol == ids[n].protocol) {
+			*hit_mask |= 1ULL << n;
+		}
+	}
 }
 
+// Starts loading what looking up the flow ID will need, see nat_map_prefetch
+static void
+nat_core_prefetch_lookup(struct nat_config* config, struct nat_core_state* state, uint8_t device, struct nat_flow_id* id)
+{
+	if (device != config->wan_device) {
+		nat_map_prefetch(state->flows_from_inside, *id);
+	} else if (config->wan_lookup_direct) {
+		int32_t addr_index = nat_config_external_addr_index(config, id->dst_addr);
+		uint32_t port_offset = (uint32_t) rte_be_to_cpu_16(id->dst_port) - state->first_port;
+		if (addr_index >= 0 && port_offset < state->nb_ports) {
+			rte_prefetch0(&state->flows_by_port[addr_index * state->nb_ports + port_offset]);
+		}
+	} else {
+		nat_map_prefetch(state->flows_from_outside, *id);
+	}
+}
 
-void
-nat_core_init(struct nat_config* config, unsigned core_id)
+// Prefetches the flow of the given packet, if it has one
+static void
+nat_core_prefetch_flow(struct nat_core_state* state, uint64_t hit_mask, uint32_t* flow_indices, uint16_t buf, uint16_t bufs_len)
 {
-	// Single-threaded program, no use for the core ID
-	(void) core_id;
+	if (buf < bufs_len && (hit_mask & (1ULL << buf)) != 0) {
+		rte_prefetch0(nat_flow_pool_get(&state->flows, flow_indices[buf]));
+	}
+}
 
-	nat_map_set_fns(&nat_flow_id_hash, &nat_flow_id_eq);
-	flows_from_inside = nat_map_create(config->max_flows);
-	flows_from_outside = nat_map_create(config->max_flows);
+// Chooses the external address and port of a new flow, such that replies come back to this core;
+// returns false if there are none left.
+static bool
+nat_core_allocate_port(struct nat_config* config, struct nat_core_state* state, struct nat_flow_id* id,
+		       uint8_t* external_addr_index, uint16_t* external_port)
+{
+	// Internal hosts get the same external address for all their flows whenever possible,
+	// since some applications expect it
+	uint32_t preferred_addr_index = (rte_be_to_cpu_32(id->src_addr) * 0x9E3779B1u >> 16) % config->nb_external_addrs;
 
-	// uint32_t for the port as max_flows is 1-based and thus may be 2^16.
-	for (uint32_t port = 0; port < config->max_flows; port++) {
-		available_ports.push_back((uint16_t) port + config->start_port);
+	if (config->wan_lookup_direct) {
+		// No reuse, the external address and port identify the flow
+		for (uint32_t n = 0; n < config->nb_external_addrs; n++) {
+			uint32_t addr_index = (preferred_addr_index + n) % config->nb_external_addrs;
+			uint16_t bucket = nat_core_port_bucket(config, nat_rss_fold(id->src_addr, config->external_addrs[addr_index], id->src_port, 0));
+			std::vector<uint16_t>& available = state->ports[addr_index * state->nb_buckets + bucket];
+			if (!available.empty()) {
+				*external_addr_index = addr_index;
+				*external_port = available.back();
+				available.pop_back();
+				return true;
+			}
+		}
+		return false;
 	}
 
-	current_timestamp = 0;
+	// Any port of the right bucket will do, as long as no flow to the same remote endpoint uses it
+	uint16_t bucket = nat_core_port_bucket(config, nat_rss_fold(id->src_addr, config->external_addrs[preferred_addr_index], id->src_port, 0));
+	std::vector<uint16_t>& candidates = state->ports[bucket];
+	if (candidates.empty()) {
+		return false;
+	}
+
+	uint32_t* cursor = &state->port_cursors[preferred_addr_index * state->nb_buckets + bucket];
+	for (uint32_t attempt = 0; attempt < PORT_REUSE_ATTEMPTS; attempt++) {
+		uint16_t candidate = candidates[*cursor];
+		*cursor = *cursor + 1 == candidates.size() ? 0 : *cursor + 1;
 
-	NAT_DEBUG("Initialized");
+		struct nat_flow_id outside_id = nat_flow_id_from_outside(config->external_addrs, id, preferred_addr_index, candidate);
+		uint32_t unused_index;
+		if (!nat_map_get(state->flows_from_outside, outside_id, &unused_index)) {
+			*external_addr_index = preferred_addr_index;
+			*external_port = candidate;
+			return true;
+		}
+	}
+	return false;
 }
 
-void
-nat_core_process(struct nat_config* config, unsigned core_id, uint8_t device, struct rte_mbuf** bufs, uint16_t bufs_len)
+// Makes a flow's external address and port available again, if they are not shared
+static void
+nat_core_release_port(struct nat_config* config, struct nat_core_state* state, struct nat_flow* flow)
 {
-	// Set this iteration's time
-	time_t new_timestamp = time(NULL);
-	NAT_DEBUG("It is %ld", current_timestamp);
+	if (config->wan_lookup_direct) {
+		uint16_t bucket = nat_core_port_bucket(config, nat_rss_fold(0, 0, flow->external_port, 0));
+		state->ports[flow->external_addr_index * state->nb_buckets + bucket].push_back(flow->external_port);
+	}
+}
 
-	// Expire flows if needed
-	if (new_timestamp > current_timestamp && !flows_by_time.empty()) {
-		nat_flows_by_time_refresh();
 
-		nat_flow* expired_flow = flows_by_time.top();
-		while ((current_timestamp - expired_flow->last_packet_timestamp) > config->expiration_time) {
-			struct nat_flow_id expired_from_outside;
-			expired_from_outside.src_addr = expired_flow->id.dst_addr;
-			expired_from_outside.src_port = expired_flow->id.dst_port;
-			expired_from_outside.dst_addr = config->external_addr;
-			expired_from_outside.dst_port = expired_flow->external_port;
-			expired_from_outside.protocol = expired_flow->id.protocol;
+// Hands the core's batch of replication records, if it has one, to the replication thread
+static void
+nat_core_repl_send(struct nat_core_state* state)
+{
+	if (state->repl_batch != NULL && state->repl_batch->nb_records != 0) {
+		// Cannot fail, the ring has room for all batches
+		rte_ring_sp_enqueue(nat_repl_full[state->core_id], state->repl_batch);
+		state->repl_batch = NULL;
+	}
+}
 
-			available_ports.push_back(expired_flow->external_port);
-			nat_map_remove(flows_from_inside, expired_flow->id);
-			nat_map_remove(flows_from_outside, expired_from_outside);
-			flows_by_time.pop();
+// Records a change to the flow, for the standby instance, if this is an active one;
+// dropped, and counted, if the core has no batch left
+static void
+nat_core_replicate(struct nat_config* config, struct nat_core_state* state, uint8_t type, struct nat_flow* flow)
+{
+	if (config->repl_path == NULL || config->repl_standby) {
+		return;
+	}
 
-			NAT_DEBUG("Expiring %" PRIu16 " -> %" PRIu16 "\n", expired_flow->id.src_port, expired_flow->id.dst_port);
+	if (state->repl_batch == NULL) {
+		if (rte_ring_sc_dequeue(nat_repl_free[state->core_id], (void**) &state->repl_batch) != 0) {
+			state->repl_batch = NULL;
+			state->stats->repl_dropped++;
+			return;
+		}
+		state->repl_batch->core_id = state->core_id;
+		state->repl_batch->nb_records = 0;
+	}
+
+	struct nat_repl_record* record = &state->repl_batch->records[state->repl_batch->nb_records];
+	record->id = flow->id;
+	record->type = type;
+	record->internal_device = flow->internal_device;
+	record->external_addr_index = flow->external_addr_index;
+	record->external_port = flow->external_port;
+	record->timestamp = flow->last_packet_timestamp;
+	state->repl_batch->nb_records++;
+	state->stats->repl_records++;
 
-			free(expired_flow);
+	if (state->repl_batch->nb_records == NAT_REPL_BATCH_RECORDS) {
+		nat_core_repl_send(state);
+	}
+}
+
+// Resends some of the core's flows if a standby connected, then hands the current batch over, on an active instance
+static void
+nat_core_repl_flush(struct nat_config* config, struct nat_core_state* state)
+{
+	if (unlikely(nat_repl_resync[state->core_id])) {
+		nat_repl_resync[state->core_id] = 0;
+		state->repl_resync_cursor = 0;
+	}
 
-			expired_flow = flows_by_time.top();
+	if (state->repl_resync_cursor != NAT_FLOW_NONE) {
+		// Flows are live if they are in the map; free ones are not, or another flow with the same stale ID is
+		uint32_t capacity = state->stats->flows_capacity;
+		uint32_t end = RTE_MIN(state->repl_resync_cursor + NAT_REPL_RESYNC_BUDGET, capacity);
+		for (uint32_t index = state->repl_resync_cursor; index < end; index++) {
+			struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+			uint32_t found_index;
+			if (nat_map_get(state->flows_from_inside, flow->id, &found_index) && found_index == index) {
+				nat_core_replicate(config, state, NAT_REPL_CREATE, flow);
+			}
 		}
+		state->repl_resync_cursor = end == capacity ? NAT_FLOW_NONE : end;
 	}
 
-	current_timestamp = new_timestamp;
+	nat_core_repl_send(state);
+}
 
-	// Redirect packets
-	if (device == config->wan_device) {
-		NAT_DEBUG("External packets");
+// Removes a flow from the maps and frees it; it must already be unlinked from the expiry wheel
+static void
+nat_core_remove_flow(struct nat_config* config, struct nat_core_state* state, uint32_t index)
+{
+	struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
 
-		for (uint16_t buf = 0; buf < bufs_len; buf++) {
-			struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(bufs[buf]);
-			if(ipv4_header->next_proto_id != IPPROTO_TCP && ipv4_header->next_proto_id != IPPROTO_UDP) {
-				NAT_DEBUG("Not TCP/UDP, dropping");
-				rte_pktmbuf_free(bufs[buf]);
+	nat_map_remove(state->flows_from_inside, flow->id);
+	if (config->wan_lookup_direct) {
+		state->flows_by_port[nat_core_port_slot(state, flow->external_addr_index, flow->external_port)] = NAT_FLOW_NONE;
+	} else {
+		nat_map_remove(state->flows_from_outside,
+			       nat_flow_id_from_outside(config->external_addrs, &flow->id, flow->external_addr_index, flow->external_port));
+	}
+
+	nat_flow_pool_free(&state->flows, index);
+}
+
+// Creates a flow for a packet from the inside, received on the given device;
+// returns false, counting the drop, if there is no room for it
+static bool
+nat_core_create_flow(struct nat_config* config, struct nat_core_state* state, uint8_t device, struct nat_flow_id* id,
+		     uint32_t* flow_index)
+{
+	uint32_t index = nat_flow_pool_alloc(&state->flows);
+	if (index == NAT_FLOW_NONE) {
+		NAT_DEBUG("Flow table full, dropping");
+		state->stats->dropped_table_full++;
+		return false;
+	}
+
+	uint8_t flow_addr_index;
+	uint16_t flow_port;
+	if (!nat_core_allocate_port(config, state, id, &flow_addr_index, &flow_port)) {
+		NAT_DEBUG("No available ports, dropping");
+		nat_flow_pool_free(&state->flows, index);
+		state->stats->dropped_no_port++;
+		return false;
+	}
+
+	struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+
+	flow->id = *id;
+	flow->external_addr_index = flow_addr_index;
+	flow->external_port = flow_port;
+	flow->internal_device = device;
+	flow->last_packet_timestamp = state->current_timestamp;
+
+	NAT_DEBUG("Creating flow");
+
+	nat_map_insert(state->flows_from_inside, *id, index);
+	if (config->wan_lookup_direct) {
+		state->flows_by_port[nat_core_port_slot(state, flow_addr_index, flow_port)] = index;
+	} else {
+		nat_map_insert(state->flows_from_outside, nat_flow_id_from_outside(config->external_addrs, id, flow_addr_index, flow_port), index);
+	}
+	nat_expiry_wheel_link(&state->flows_by_time, index);
+	state->stats->flows_created++;
+	nat_core_replicate(config, state, NAT_REPL_CREATE, flow);
+
+	*flow_index = index;
+	return true;
+}
+
+// Applies a batch from the active instance, on a standby core; flows are only ever created,
+// refreshed and expired as the active instance says, since the standby does not expire flows on its own
+static void
+nat_core_repl_apply(struct nat_config* config, struct nat_core_state* state, struct nat_repl_batch* batch)
+{
+	for (uint16_t n = 0; n < batch->nb_records; n++) {
+		struct nat_repl_record record = batch->records[n];
+
+		// Clocks may be slightly off, but flows cannot be from the future, see nat_expiry_wheel_expiration
+		uint32_t timestamp = record.timestamp + (uint32_t) nat_repl_clock_offset;
+		if ((int32_t) (timestamp - state->current_timestamp) > 0) {
+			timestamp = state->current_timestamp;
+		}
+
+		uint32_t index;
+		bool found = nat_map_get(state->flows_from_inside, record.id, &index);
+		if (found && record.type == NAT_REPL_EXPIRE) {
+			nat_expiry_wheel_unlink(&state->flows_by_time, index);
+			nat_core_remove_flow(config, state, index);
+			state->stats->flows_expired++;
+		} else if (found) {
+			// Creations of existing flows are resent ones
+			nat_flow_pool_get(&state->flows, index)->last_packet_timestamp = timestamp;
+		} else if (record.type == NAT_REPL_CREATE) {
+			uint32_t port_offset = (uint32_t) rte_be_to_cpu_16(record.external_port) - state->first_port;
+			if (record.external_addr_index >= config->nb_external_addrs || port_offset >= state->nb_ports
+			    || (config->wan_lookup_direct
+				&& state->flows_by_port[nat_core_port_slot(state, record.external_addr_index, record.external_port)] != NAT_FLOW_NONE)) {
+				state->stats->repl_dropped++;
 				continue;
 			}
 
-			struct nat_flow_id flow_id = nat_flow_id_from_ipv4(ipv4_header);
-			NAT_DEBUG("Flow: %" PRIu16 " -> %" PRIu16, flow_id.src_port, flow_id.dst_port);
-
-			struct nat_flow* flow;
-			if (!nat_map_get(flows_from_outside, flow_id, &flow)) {
-				NAT_DEBUG("Unknown flow, dropping");
-				rte_pktmbuf_free(bufs[buf]);
+			index = nat_flow_pool_alloc(&state->flows);
+			if (index == NAT_FLOW_NONE) {
+				state->stats->repl_dropped++;
 				continue;
 			}
 
-			// Refresh
-			flow->last_packet_timestamp = current_timestamp;
+			struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+			flow->id = record.id;
+			flow->external_addr_index = record.external_addr_index;
+			flow->external_port = record.external_port;
+			flow->internal_device = record.internal_device;
+			flow->last_packet_timestamp = timestamp;
 
-			// L2 forwarding
-			struct ether_hdr* ether_header = nat_get_mbuf_ether_header(bufs[buf]);
-			ether_header->s_addr = config->device_macs[flow->internal_device];
-			ether_header->d_addr = config->endpoint_macs[flow->internal_device];
+			nat_map_insert(state->flows_from_inside, record.id, index);
+			if (config->wan_lookup_direct) {
+				state->flows_by_port[nat_core_port_slot(state, record.external_addr_index, record.external_port)] = index;
+			} else {
+				nat_map_insert(state->flows_from_outside,
+					       nat_flow_id_from_outside(config->external_addrs, &record.id, record.external_addr_index, record.external_port), index);
+			}
+			nat_expiry_wheel_link(&state->flows_by_time, index);
+			state->stats->flows_created++;
+		}
+		state->stats->repl_records++;
+	}
+}
 
-			// L3 forwarding
-			struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(ipv4_header);
-			ipv4_header->dst_addr = flow->id.src_addr;
-			tcpudp_header->dst_port = flow->id.src_port;
+// Looks up the flows the slow path core asks for, see nat_slow_path.h
+static void
+nat_core_resolve_requests(struct nat_config* config, unsigned core_id, struct nat_core_state* state)
+{
+	struct nat_slow_request* requests[NAT_MAP_BULK_MAX];
+	uint16_t requests_len = rte_ring_dequeue_burst(nat_slow_path_requests[core_id], (void**) requests, NAT_MAP_BULK_MAX, NULL);
+	if (requests_len == 0) {
+		return;
+	}
 
-			// Checksum
-			nat_set_ipv4_checksum(ipv4_header);
+	state->current_timestamp = (uint32_t) nat_clock_now();
+	for (uint16_t n = 0; n < requests_len; n++) {
+		struct nat_slow_request* request = requests[n];
 
-			NAT_DEBUG("Sending packets");
-			uint16_t actual_sent_len = rte_eth_tx_burst(flow->internal_device, 0, bufs + buf, 1);
+		uint32_t flow_index;
+		bool found;
+		if (!request->from_outside) {
+			found = nat_map_get(state->flows_from_inside, request->id, &flow_index)
+			     || (request->create && nat_core_create_flow(config, state, request->device, &request->id, &flow_index));
+		} else if (config->wan_lookup_direct) {
+			uint64_t hit_mask;
+			nat_core_lookup_by_port(config, state, &request->id, 1, &hit_mask, &flow_index);
+			found = hit_mask != 0;
+		} else {
+			found = nat_map_get(state->flows_from_outside, request->id, &flow_index);
+		}
 
-			if (unlikely(actual_sent_len == 0)) {
-				NAT_DEBUG("Could not send, freeing");
-				rte_pktmbuf_free(bufs[buf]);
+		request->found = found;
+		if (!found) {
+			// Creation failures count their own drops
+			if (!request->create) {
+				state->stats->dropped_unknown_flow++;
 			}
+			continue;
 		}
-	} else {
-		NAT_DEBUG("Internal packets");
 
-		// Batch the packets, as they'll all be sent via the WAN device.
-		struct rte_mbuf* bufs_to_send[bufs_len];
-		uint16_t bufs_to_send_len = 0;
+		struct nat_flow* flow = nat_flow_pool_get(&state->flows, flow_index);
+		if (request->refresh) {
+			flow->last_packet_timestamp = state->current_timestamp;
+		}
+		request->internal_device = flow->internal_device;
+		request->internal_addr = flow->id.src_addr;
+		request->internal_port = flow->id.src_port;
+		request->external_addr = config->external_addrs[flow->external_addr_index];
+		request->external_port = flow->external_port;
+	}
+
+	// Cannot fail, the ring has room for all requests
+	rte_ring_enqueue_burst(nat_slow_path_responses, (void**) requests, requests_len, NULL);
+}
 
-		for (uint16_t buf = 0; buf < bufs_len; buf++) {
-			struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(bufs[buf]);
-			if(ipv4_header->next_proto_id != IPPROTO_TCP && ipv4_header->next_proto_id != IPPROTO_UDP) {
-				NAT_DEBUG("Not TCP/UDP, dropping");
-				rte_pktmbuf_free(bufs[buf]);
+// Restores the core's flows from the snapshot, in bulk: flows are allocated in order, and the map entries of upcoming flows
+// are prefetched, as in nat_core_process. Must be called before the core's ports are made available,
+// since in direct WAN lookup mode, the ports of restored flows are not.
+static void
+nat_core_restore(struct nat_config* config, unsigned core_id, struct nat_core_state* state)
+{
+	const struct nat_snapshot_core* core = (const struct nat_snapshot_core*) (snapshot + 1) + core_id;
+	const struct nat_snapshot_flow* saved_flows = (const struct nat_snapshot_flow*) ((const uint8_t*) snapshot + core->flows_offset);
+
+	// Flows aged while the NAT was down
+	uint64_t restore_time = nat_snapshot_time();
+	uint64_t downtime = restore_time > snapshot->saved_time ? restore_time - snapshot->saved_time : 0;
+
+	uint32_t nb_restored = 0;
+	for (uint32_t n = 0; n < core->nb_flows; n++) {
+		if (n + NAT_PREFETCH_DISTANCE < core->nb_flows) {
+			const struct nat_snapshot_flow* next = &saved_flows[n + NAT_PREFETCH_DISTANCE];
+			nat_map_prefetch(state->flows_from_inside, next->id);
+			if (!config->wan_lookup_direct && next->external_addr_index < config->nb_external_addrs) {
+				struct nat_flow_id next_id = next->id;
+				nat_map_prefetch(state->flows_from_outside,
+						 nat_flow_id_from_outside(config->external_addrs, &next_id, next->external_addr_index, next->external_port));
+			}
+		}
+
+		struct nat_snapshot_flow saved = saved_flows[n];
+		uint64_t age = saved.age + downtime;
+		// Ports below the core's range wrap around to large values
+		uint32_t port_offset = (uint32_t) rte_be_to_cpu_16(saved.external_port) - state->first_port;
+		if (age > config->expiration_time || saved.external_addr_index >= config->nb_external_addrs
+		    || port_offset >= state->nb_ports || (config->devices_mask & (1 << saved.internal_device)) == 0) {
+			continue;
+		}
+		if (config->wan_lookup_direct
+		    && state->flows_by_port[nat_core_port_slot(state, saved.external_addr_index, saved.external_port)] != NAT_FLOW_NONE) {
+			continue;
+		}
+
+		uint32_t index = nat_flow_pool_alloc(&state->flows);
+		if (index == NAT_FLOW_NONE) {
+			break;
+		}
+
+		struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+		flow->id = saved.id;
+		flow->external_addr_index = saved.external_addr_index;
+		flow->external_port = saved.external_port;
+		flow->internal_device = saved.internal_device;
+		flow->last_packet_timestamp = state->current_timestamp - (uint32_t) age;
+
+		nat_map_insert(state->flows_from_inside, saved.id, index);
+		if (config->wan_lookup_direct) {
+			state->flows_by_port[nat_core_port_slot(state, saved.external_addr_index, saved.external_port)] = index;
+		} else {
+			nat_map_insert(state->flows_from_outside,
+				       nat_flow_id_from_outside(config->external_addrs, &saved.id, saved.external_addr_index, saved.external_port), index);
+		}
+		nat_expiry_wheel_link(&state->flows_by_time, index);
+		nb_restored++;
+	}
+	state->stats->flows_created += nb_restored;
+
+	if (core->nb_port_cursors == state->port_cursors.size()) {
+		const uint32_t* saved_cursors = (const uint32_t*) ((const uint8_t*) snapshot + core->port_cursors_offset);
+		state->port_cursors.assign(saved_cursors, saved_cursors + core->nb_port_cursors);
+	}
+
+	NAT_INFO("Core %u: restored %" PRIu32 " of %" PRIu32 " flows from the snapshot.", core_id, nb_restored, core->nb_flows);
+}
+
+// Makes the core's ports available, except those of existing flows in direct WAN lookup mode
+static void
+nat_core_fill_ports(struct nat_config* config, struct nat_core_state* state)
+{
+	uint16_t nb_port_sets = config->wan_lookup_direct ? config->nb_external_addrs : 1;
+	state->ports.clear();
+	state->ports.resize(nb_port_sets * state->nb_buckets);
+	for (uint16_t port_set = 0; port_set < nb_port_sets; port_set++) {
+		for (uint32_t port = state->first_port; port < state->first_port + state->nb_ports; port++) {
+			uint16_t network_port = rte_cpu_to_be_16((uint16_t) port);
+			if (config->wan_lookup_direct && state->flows_by_port[nat_core_port_slot(state, port_set, network_port)] != NAT_FLOW_NONE) {
 				continue;
 			}
+			uint16_t bucket = nat_core_port_bucket(config, nat_rss_fold(0, 0, network_port, 0));
+			state->ports[port_set * state->nb_buckets + bucket].push_back(network_port);
+		}
+	}
+}
 
-			struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(ipv4_header);
-			struct nat_flow_id flow_id = nat_flow_id_from_ipv4(ipv4_header);
-			NAT_DEBUG("Flow: %" PRIu16 " -> %" PRIu16, flow_id.src_port, flow_id.dst_port);
 
-			struct nat_flow* flow;
-			if (!nat_map_get(flows_from_inside, flow_id, &flow)) {
-				if (available_ports.empty()) {
-					NAT_DEBUG("No available ports, dropping");
-					rte_pktmbuf_free(bufs[buf]);
-					continue;
-				}
+void
+nat_core_init(struct nat_config* config, unsigned core_id)
+{
+	// Allocated on the core itself, thus on its NUMA node
+	struct nat_core_state* state = new nat_core_state();
 
-				uint16_t flow_port = available_ports.back();
-				available_ports.pop_back();
+	// Every core gets an equal slice of the port range and of the flow table, the last one also gets the remainders
+	// (see nat_config_external_port_core); uint32_t for ports as the range ends at 2^16.
+	uint32_t ports_per_core = (65536 - config->start_port) / config->nb_cores;
+	uint32_t first_port = config->start_port + core_id * ports_per_core;
+	uint32_t last_port = core_id == config->nb_cores - 1u ? 65536 : first_port + ports_per_core;
 
-				flow = (nat_flow*) malloc(sizeof(nat_flow));
-				if (flow == NULL) {
-					rte_exit(EXIT_FAILURE, "Out of memory, can't create a flow!");
-				}
+	uint32_t flows_per_core = config->max_flows / config->nb_cores;
+	uint32_t capacity = core_id == config->nb_cores - 1u ? config->max_flows - core_id * flows_per_core : flows_per_core;
+	// Without port reuse, there cannot be more flows than external addresses and ports
+	if (config->wan_lookup_direct && capacity > config->nb_external_addrs * (last_port - first_port)) {
+		capacity = config->nb_external_addrs * (last_port - first_port);
+		NAT_INFO("Core %u: flow table limited to %" PRIu32 " flows, the number of external addresses and ports", core_id, capacity);
+	}
 
-				flow->id = flow_id;
-				flow->external_port = flow_port;
-				flow->internal_device = device;
-				flow->last_packet_timestamp = 0;
+	nat_flow_pool_init(&state->flows, capacity, rte_socket_id());
 
-				struct nat_flow_id flow_from_outside;
-				flow_from_outside.src_addr = ipv4_header->dst_addr;
-				flow_from_outside.src_port = tcpudp_header->dst_port;
-				flow_from_outside.dst_addr = config->external_addr;
-				flow_from_outside.dst_port = flow_port;
-				flow_from_outside.protocol = ipv4_header->next_proto_id;
+	nat_map_set_fns(nat_flow_hash_init(config->flow_hash), &nat_flow_id_eq);
+	state->flows_from_inside = nat_map_create(capacity, rte_socket_id(), &nat_core_inside_key, state);
+	state->first_port = first_port;
+	state->nb_ports = last_port - first_port;
+	if (config->wan_lookup_direct) {
+		uint32_t nb_slots = config->nb_external_addrs * state->nb_ports;
+		state->flows_from_outside = NULL;
+		state->flows_by_port = (uint32_t*) rte_malloc_socket("nat_flows_by_port", nb_slots * sizeof(uint32_t),
+								   RTE_CACHE_LINE_SIZE, rte_socket_id());
+		if (state->flows_by_port == NULL) {
+			rte_exit(EXIT_FAILURE, "Cannot allocate the flows by port of core %u\n", core_id);
+		}
+		for (uint32_t slot = 0; slot < nb_slots; slot++) {
+			state->flows_by_port[slot] = NAT_FLOW_NONE;
+		}
+	} else {
+		memcpy(state->external_addrs, config->external_addrs, sizeof(state->external_addrs));
+		state->flows_from_outside = nat_map_create(capacity, rte_socket_id(), &nat_core_outside_key, state);
+		state->flows_by_port = NULL;
+	}
+
+	state->current_timestamp = (uint32_t) nat_clock_now();
+	nat_expiry_wheel_init(&state->flows_by_time, state->flows.flows, config->expiration_time, nat_clock_now());
+
+	state->stats = nat_core_stats_get(core_id);
+	state->stats->flows_capacity = capacity;
+
+	state->nb_buckets = config->nb_cores == 1 || config->rss_reta_size == 0 ? 1 : config->rss_reta_size;
+	state->port_cursors.resize(config->nb_external_addrs * state->nb_buckets, 0);
+	if (snapshot != NULL) {
+		nat_core_restore(config, core_id, state);
+	}
+
+	nat_core_fill_ports(config, state);
 
-				NAT_DEBUG("Creating flow");
+	state->core_id = core_id;
+	state->repl_batch = NULL;
+	state->repl_resync_cursor = NAT_FLOW_NONE;
+	state->standby = config->repl_path != NULL && config->repl_standby;
+
+	for (uint8_t device = 0; device < RTE_MAX_ETHPORTS; device++) {
+		nat_tx_buffer_init(&state->tx_buffers[device], device, core_id, nat_pipeline_tx_ring(config, core_id, device), state->stats);
+	}
 
-				nat_map_insert(flows_from_inside, flow_id, flow);
-				nat_map_insert(flows_from_outside, flow_from_outside, flow);
-				flows_by_time.push(flow);
+	core_states[core_id] = state;
+
+	NAT_DEBUG("Initialized core %u with ports [%" PRIu32 ", %" PRIu32 ")", core_id, first_port, last_port);
+}
+
+// Translates and buffers packets received on the given side, once their flows have been looked up.
+// Specialized by direction, so that what only depends on it is out of the loop and in registers:
+// the WAN device's L2 template, offloads and TX buffer for internal packets, and the external addresses.
+template<bool FromOutside>
+static void
+nat_core_translate(struct nat_config* config, unsigned core_id, struct nat_core_state* state, uint8_t device,
+		   struct rte_mbuf** flow_bufs, struct nat_flow_id* flow_ids, uint16_t flow_bufs_len,
+		   uint64_t hit_mask, uint32_t* flow_indices)
+{
+	// Copied, since packet writes could otherwise alias them
+	const struct nat_l2_template wan_l2_template = config->l2_templates[config->wan_device];
+	const bool wan_tx_cksum_offload = config->device_tx_cksum_offload[config->wan_device];
+	struct nat_tx_buffer* const wan_tx_buffer = &state->tx_buffers[config->wan_device];
+	const uint32_t* const external_addrs = config->external_addrs;
+	const uint32_t timestamp = state->current_timestamp;
+
+	for (uint16_t buf = 0; buf < NAT_PREFETCH_DISTANCE / 2; buf++) {
+		nat_core_prefetch_flow(state, hit_mask, flow_indices, buf, flow_bufs_len);
+	}
+	for (uint16_t buf = 0; buf < flow_bufs_len; buf++) {
+		nat_core_prefetch_flow(state, hit_mask, flow_indices, buf + NAT_PREFETCH_DISTANCE / 2, flow_bufs_len);
+
+		uint32_t flow_index = flow_indices[buf];
+		if ((hit_mask & (1ULL << buf)) == 0) {
+			if (FromOutside) {
+				NAT_DEBUG("Unknown flow, dropping");
+				rte_pktmbuf_free(flow_bufs[buf]);
+				state->stats->dropped_unknown_flow++;
+				continue;
 			}
 
-			// Refresh
-			flow->last_packet_timestamp = current_timestamp;
+			// Misses must be looked up again, the flow may have been created by an earlier packet of the same burst
+			if (!nat_map_get(state->flows_from_inside, flow_ids[buf], &flow_index)) {
+				NAT_PROFILE_BEGIN(create_start);
+				struct nat_flow_id flow_id = flow_ids[buf];
+				bool created = nat_core_create_flow(config, state, device, &flow_id, &flow_index);
+				NAT_PROFILE_END(create_start, core_id, NAT_PROFILE_STAGE_CREATE);
+				if (!created) {
+					rte_pktmbuf_free(flow_bufs[buf]);
+					continue;
+				}
+			}
+		}
 
-			// L2 forwarding
-			struct ether_hdr* ether_header = nat_get_mbuf_ether_header(bufs[buf]);
-			ether_header->s_addr = config->device_macs[config->wan_device];
-			ether_header->d_addr = config->endpoint_macs[config->wan_device];
+		struct nat_flow* flow = nat_flow_pool_get(&state->flows, flow_index);
 
-			// L3 forwarding
-			ipv4_header->src_addr = config->external_addr;
-			tcpudp_header->src_port = flow->external_port;
+		// Refresh
+		flow->last_packet_timestamp = timestamp;
 
-			// Checksum
-			nat_set_ipv4_checksum(ipv4_header);
+		// L2 forwarding
+		NAT_PROFILE_BEGIN(rewrite_start);
+		uint8_t out_device = FromOutside ? flow->internal_device : config->wan_device;
+		nat_l2_rewrite(nat_get_mbuf_ether_header(flow_bufs[buf]),
+			       FromOutside ? &config->l2_templates[out_device] : &wan_l2_template);
 
-			NAT_DEBUG("Buffering packet");
-			bufs_to_send[bufs_to_send_len] = bufs[buf];
-			bufs_to_send_len++;
+		// L3 forwarding: the destination of external packets, the source of internal ones
+		struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(flow_bufs[buf]);
+		struct tcpudp_hdr* tcpudp_header = nat_get_ipv4_tcpudp_header(ipv4_header);
+		uint32_t old_addr;
+		uint16_t old_port;
+		uint32_t new_addr;
+		uint16_t new_port;
+		if (FromOutside) {
+			old_addr = ipv4_header->dst_addr;
+			old_port = tcpudp_header->dst_port;
+			new_addr = flow->id.src_addr;
+			new_port = flow->id.src_port;
+			ipv4_header->dst_addr = new_addr;
+			tcpudp_header->dst_port = new_port;
+		} else {
+			old_addr = ipv4_header->src_addr;
+			old_port = tcpudp_header->src_port;
+			new_addr = external_addrs[flow->external_addr_index];
+			new_port = flow->external_port;
+			ipv4_header->src_addr = new_addr;
+			tcpudp_header->src_port = new_port;
 		}
+		NAT_PROFILE_END(rewrite_start, core_id, NAT_PROFILE_STAGE_REWRITE);
 
-		if (likely(bufs_to_send_len > 0)) {
-			NAT_DEBUG("Sending packets");
-			uint16_t actual_sent_len = rte_eth_tx_burst(config->wan_device, 0, bufs_to_send, bufs_to_send_len);
+		// Checksum
+		NAT_PROFILE_BEGIN(checksum_start);
+		if (FromOutside ? config->device_tx_cksum_offload[out_device] : wan_tx_cksum_offload) {
+			nat_offload_ipv4_checksum(flow_bufs[buf], ipv4_header);
+		} else {
+			nat_update_ipv4_checksum(ipv4_header, old_addr, new_addr, old_port, new_port);
+		}
+		NAT_PROFILE_END(checksum_start, core_id, NAT_PROFILE_STAGE_CHECKSUM);
 
-			if (unlikely(actual_sent_len < bufs_to_send_len)) {
-				NAT_DEBUG("Freeing %" PRIu16 " unsent packets", actual_sent_len);
+		NAT_DEBUG("Buffering packet");
+		nat_tx_buffer_add(FromOutside ? &state->tx_buffers[out_device] : wan_tx_buffer, flow_bufs[buf]);
+	}
+}
 
-				for (uint16_t buf = actual_sent_len; buf < bufs_to_send_len; buf++) {
-					rte_pktmbuf_free(bufs_to_send[buf]);
-				}
+void
+nat_core_process(struct nat_config* config, unsigned core_id, uint8_t device, struct rte_mbuf** bufs, uint16_t bufs_len)
+{
+	// Bulk lookups are limited in size
+	if (unlikely(bufs_len > NAT_MAP_BULK_MAX)) {
+		nat_core_process(config, core_id, device, bufs, NAT_MAP_BULK_MAX);
+		nat_core_process(config, core_id, device, bufs + NAT_MAP_BULK_MAX, bufs_len - NAT_MAP_BULK_MAX);
+		return;
+	}
+
+	struct nat_core_state* state = core_states[core_id];
+
+	// Set this iteration's time, from the clock the poll loop keeps up to date
+	uint64_t now = nat_clock_now();
+	state->current_timestamp = (uint32_t) now;
+	NAT_DEBUG("It is %" PRIu64, now);
+
+	// Expire flows, a bounded number at a time
+	NAT_PROFILE_BEGIN(expiry_start);
+	// Refreshes are only replicated when the wheel notices them, i.e. at most once per expiration time per flow
+	nat_expiry_wheel_expire(&state->flows_by_time, now, EXPIRY_BUDGET, [&](uint32_t expired_index) {
+		struct nat_flow* expired_flow = nat_flow_pool_get(&state->flows, expired_index);
+
+		NAT_DEBUG("Expiring %" PRIu16 " -> %" PRIu16 "\n", expired_flow->id.src_port, expired_flow->id.dst_port);
+
+		nat_core_replicate(config, state, NAT_REPL_EXPIRE, expired_flow);
+		nat_core_release_port(config, state, expired_flow);
+		nat_core_remove_flow(config, state, expired_index);
+		state->stats->flows_expired++;
+	}, [&](uint32_t refreshed_index) {
+		nat_core_replicate(config, state, NAT_REPL_REFRESH, nat_flow_pool_get(&state->flows, refreshed_index));
+	});
+	NAT_PROFILE_END(expiry_start, core_id, NAT_PROFILE_STAGE_EXPIRY);
+
+	// Keep TCP/UDP packets only, and gather their flow IDs to look them all up at once
+	struct rte_mbuf* flow_bufs[bufs_len];
+	// One more ID, see nat_classify_burst
+	struct nat_flow_id flow_ids[bufs_len + 1];
+	struct rte_mbuf* exception_bufs[bufs_len];
+	uint16_t exception_bufs_len;
+
+	// Processing is pipelined so that memory loads overlap, as in DPDK's l3fwd:
+	// packet data is prefetched NAT_PREFETCH_DISTANCE packets ahead of parsing, lookup data as soon as a flow ID is known
+	// (i.e. a whole burst ahead of the lookups), and flows NAT_PREFETCH_DISTANCE / 2 packets ahead of translation.
+	NAT_PROFILE_BEGIN(parse_start);
+	uint16_t flow_bufs_len = nat_classify_burst(bufs, bufs_len, config->device_rx_packet_type[device], NAT_PREFETCH_DISTANCE,
+						    flow_bufs, flow_ids, exception_bufs, &exception_bufs_len);
+
+	// Exceptions are rare; they go to the slow path core if there is one.
+	// Otherwise, those with IPv4 options are translated after the others, and the rest are dropped.
+	if (config->slow_path) {
+		uint16_t enqueued_len = rte_ring_enqueue_burst(nat_slow_path_exceptions, (void**) exception_bufs, exception_bufs_len, NULL);
+		for (uint16_t buf = enqueued_len; buf < exception_bufs_len; buf++) {
+			rte_pktmbuf_free(exception_bufs[buf]);
+		}
+		state->stats->dropped_slow_path_full += exception_bufs_len - enqueued_len;
+	} else {
+		for (uint16_t buf = 0; buf < exception_bufs_len; buf++) {
+			if (nat_classify_exception(exception_bufs[buf], &flow_ids[flow_bufs_len])) {
+				flow_bufs[flow_bufs_len] = exception_bufs[buf];
+				flow_bufs_len++;
+			} else {
+				NAT_DEBUG("Not TCP/UDP, dropping");
+				rte_pktmbuf_free(exception_bufs[buf]);
+				state->stats->dropped_not_tcpudp++;
 			}
 		}
 	}
+
+	for (uint16_t buf = 0; buf < flow_bufs_len; buf++) {
+		nat_core_prefetch_lookup(config, state, device, &flow_ids[buf]);
+		NAT_DEBUG("Flow: %" PRIu16 " -> %" PRIu16, flow_ids[buf].src_port, flow_ids[buf].dst_port);
+	}
+	NAT_PROFILE_END(parse_start, core_id, NAT_PROFILE_STAGE_PARSE);
+
+	if (unlikely(flow_bufs_len == 0)) {
+		return;
+	}
+
+	uint32_t flow_indices[bufs_len];
+	uint64_t hit_mask;
+	NAT_PROFILE_BEGIN(lookup_start);
+	if (device != config->wan_device) {
+		nat_map_get_bulk(state->flows_from_inside, flow_ids, flow_bufs_len, &hit_mask, flow_indices);
+	} else if (config->wan_lookup_direct) {
+		nat_core_lookup_by_port(config, state, flow_ids, flow_bufs_len, &hit_mask, flow_indices);
+	} else {
+		nat_map_get_bulk(state->flows_from_outside, flow_ids, flow_bufs_len, &hit_mask, flow_indices);
+	}
+	NAT_PROFILE_END(lookup_start, core_id, NAT_PROFILE_STAGE_LOOKUP);
+
+	if (device == config->wan_device) {
+		NAT_DEBUG("External packets");
+		nat_core_translate<true>(config, core_id, state, device, flow_bufs, flow_ids, flow_bufs_len, hit_mask, flow_indices);
+	} else {
+		NAT_DEBUG("Internal packets");
+		nat_core_translate<false>(config, core_id, state, device, flow_bufs, flow_ids, flow_bufs_len, hit_mask, flow_indices);
+	}
+}
+
+void
+nat_core_refresh_stats(struct nat_config* config, unsigned core_id)
+{
+	struct nat_core_state* state = core_states[core_id];
+
+	// The direct lookup table of WAN packets has no collisions
+	struct nat_map_stats map_stats;
+	nat_map_get_stats(state->flows_from_inside, &map_stats);
+	state->stats->map_keys = map_stats.nb_keys;
+	state->stats->map_collided_keys = map_stats.nb_collided_keys;
+	state->stats->map_max_chain_length = map_stats.max_chain_length;
+
+	if (!config->wan_lookup_direct) {
+		nat_map_get_stats(state->flows_from_outside, &map_stats);
+		state->stats->map_keys += map_stats.nb_keys;
+		state->stats->map_collided_keys += map_stats.nb_collided_keys;
+		state->stats->map_max_chain_length = RTE_MAX(state->stats->map_max_chain_length, (uint64_t) map_stats.max_chain_length);
+	}
+}
+
+void
+nat_core_flush(struct nat_config* config, unsigned core_id)
+{
+	struct nat_core_state* state = core_states[core_id];
+
+	if (config->slow_path) {
+		nat_core_resolve_requests(config, core_id, state);
+	}
+
+	if (config->repl_path != NULL && !config->repl_standby) {
+		nat_core_repl_flush(config, state);
+	}
+
+	// Devices disabled at runtime still get the packets of their flows, see nat_config_set_option
+	for (uint8_t device = 0; device < RTE_MAX_ETHPORTS; device++) {
+		nat_tx_buffer_flush(&state->tx_buffers[device]);
+	}
+}
+
+void
+nat_core_update_config(struct nat_config* config, unsigned core_id)
+{
+	struct nat_core_state* state = core_states[core_id];
+	nat_expiry_wheel_set_expiration_time(&state->flows_by_time, config->expiration_time);
+}
+
+void
+nat_snapshot_load(struct nat_config* config)
+{
+	if (config->snapshot_path != NULL) {
+		snapshot = nat_snapshot_map(config->snapshot_path, config);
+	}
+}
+
+void
+nat_snapshot_save(struct nat_config* config)
+{
+	if (config->snapshot_path == NULL) {
+		return;
+	}
+
+	nat_clock_update(rte_rdtsc());
+	uint32_t now = (uint32_t) nat_clock_now();
+
+	// All live flows are linked in their core's expiry wheel
+	struct nat_snapshot_core cores[RTE_MAX_LCORE];
+	uint64_t size = sizeof(struct nat_snapshot_header) + config->nb_cores * sizeof(struct nat_snapshot_core);
+	for (unsigned core_id = 0; core_id < config->nb_cores; core_id++) {
+		struct nat_core_state* state = core_states[core_id];
+		uint32_t nb_flows = 0;
+		nat_expiry_wheel_for_each(&state->flows_by_time, [&](uint32_t) { nb_flows++; });
+
+		cores[core_id].flows_offset = size;
+		cores[core_id].nb_flows = nb_flows;
+		size += nb_flows * sizeof(struct nat_snapshot_flow);
+		cores[core_id].port_cursors_offset = size;
+		cores[core_id].nb_port_cursors = state->port_cursors.size();
+		size += state->port_cursors.size() * sizeof(uint32_t);
+	}
+
+	uint8_t* data = (uint8_t*) nat_snapshot_create(config->snapshot_path, size);
+	if (data == NULL) {
+		return;
+	}
+
+	struct nat_snapshot_header* header = (struct nat_snapshot_header*) data;
+	nat_snapshot_header_init(header, config);
+	header->file_size = size;
+	memcpy(header + 1, cores, config->nb_cores * sizeof(struct nat_snapshot_core));
+
+	uint64_t nb_saved = 0;
+	for (unsigned core_id = 0; core_id < config->nb_cores; core_id++) {
+		struct nat_core_state* state = core_states[core_id];
+		struct nat_snapshot_flow* saved = (struct nat_snapshot_flow*) (data + cores[core_id].flows_offset);
+		nat_expiry_wheel_for_each(&state->flows_by_time, [&](uint32_t index) {
+			struct nat_flow* flow = nat_flow_pool_get(&state->flows, index);
+			saved->id = flow->id;
+			saved->internal_device = flow->internal_device;
+			saved->external_addr_index = flow->external_addr_index;
+			saved->external_port = flow->external_port;
+			saved->age = now - flow->last_packet_timestamp;
+			saved++;
+		});
+		nb_saved += cores[core_id].nb_flows;
+
+		memcpy(data + cores[core_id].port_cursors_offset, state->port_cursors.data(), state->port_cursors.size() * sizeof(uint32_t));
+	}
+
+	if (nat_snapshot_commit(config->snapshot_path, data, size)) {
+		NAT_INFO("Saved %" PRIu64 " flows to snapshot %s.", nb_saved, config->snapshot_path);
+	}
+}
+
+bool
+nat_core_standby(struct nat_config* config, unsigned core_id)
+{
+	struct nat_core_state* state = core_states[core_id];
+	if (!state->standby) {
+		return false;
+	}
+
+	uint64_t now = nat_clock_now();
+	state->current_timestamp = (uint32_t) now;
+	state->flows_by_time.now = now;
+
+	// The replication thread hands over all batches before taking over, and there are fewer batches than room in the ring,
+	// thus once it has taken over, a single dequeue gets all remaining batches
+	bool takeover = nat_repl_takeover;
+	struct nat_repl_batch* batches[NAT_REPL_BATCHES];
+	unsigned nb_batches = rte_ring_sc_dequeue_burst(nat_repl_full[core_id], (void**) batches, NAT_REPL_BATCHES, NULL);
+	for (unsigned n = 0; n < nb_batches; n++) {
+		nat_core_repl_apply(config, state, batches[n]);
+	}
+	// Cannot fail, the ring has room for all batches
+	rte_ring_sp_enqueue_burst(nat_repl_free[core_id], (void**) batches, nb_batches, NULL);
+
+	if (takeover) {
+		nat_core_fill_ports(config, state);
+		state->standby = false;
+		NAT_INFO("Core %u taking over with %" PRIu64 " flows.", core_id, state->stats->flows_created - state->stats->flows_expired);
+		return false;
+	}
+
+	return true;
 }
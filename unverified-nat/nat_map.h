@@ -2,25 +2,86 @@
 
 #include <stdbool.h>
 
+#include <rte_common.h>
+
 #include "nat_flow.h"
 
+// Maps from flow IDs to flow indices, see nat_flow_pool.h
 struct nat_map;
 
+// Maximum number of keys in a bulk lookup
+#define NAT_MAP_BULK_MAX 64
+
 typedef uint64_t (*nat_map_hash_fn)(nat_flow_id key);
 typedef bool (*nat_map_eq_fn)(nat_flow_id left, nat_flow_id right);
+// Key of a value, given the map's context; values are flow indices, thus keys can be rebuilt from flows
+typedef nat_flow_id (*nat_map_key_fn)(void* context, uint32_t value);
 
 
 void
 nat_map_set_fns(nat_map_hash_fn hash_fn, nat_map_eq_fn eq_fn);
 
+// Maps are allocated on the given NUMA socket, if the backend controls its allocations;
+// backends that can may use key_fn instead of storing keys, which must then stay valid while their values are in the map
 struct nat_map*
-nat_map_create(uint32_t capacity);
+nat_map_create(uint32_t capacity, int socket, nat_map_key_fn key_fn, void* key_context);
 
 void
-nat_map_insert(struct nat_map* map, nat_flow_id key, nat_flow* value);
+nat_map_insert(struct nat_map* map, nat_flow_id key, uint32_t value);
 
 void
 nat_map_remove(struct nat_map* map, nat_flow_id key);
 
 bool
-nat_map_get(struct nat_map* map, nat_flow_id key, nat_flow** value);
+nat_map_get(struct nat_map* map, nat_flow_id key, uint32_t* value);
+
+// Hints that the key will soon be looked up, so that the map can start loading the memory the lookup needs;
+// implementations may do nothing.
+void
+nat_map_prefetch(struct nat_map* map, nat_flow_id key);
+
+// Looks up keys_len keys at once, with keys_len <= NAT_MAP_BULK_MAX;
+// bit i of hit_mask is set if keys[i] was found, in which case values[i] is its value.
+void
+nat_map_get_bulk(struct nat_map* map, nat_flow_id* keys, uint16_t keys_len, uint64_t* hit_mask, uint32_t* values);
+
+// How keys are spread in a map, to compare hash functions
+struct nat_map_stats {
+	uint32_t nb_keys;
+	uint32_t nb_buckets;
+	// Keys that are not where lookups look first, because of collisions
+	uint32_t nb_collided_keys;
+	// Most buckets (or nodes) read to find a key, i.e. the worst-case cost of a successful lookup
+	uint32_t max_chain_length;
+};
+
+// Maps keep their stats up to date as keys come and go, thus this does not walk the map
+void
+nat_map_get_stats(struct nat_map* map, struct nat_map_stats* stats);
+
+
+// For implementations: numbers of buckets with chains of each length, so that the longest one is known after removals too;
+// longer chains count as NAT_MAP_CHAINS_MAX long
+#define NAT_MAP_CHAINS_MAX 64
+
+struct nat_map_chains {
+	uint32_t counts[NAT_MAP_CHAINS_MAX + 1];
+};
+
+// A bucket's chain went from old_length to new_length
+static inline void
+nat_map_chains_update(struct nat_map_chains* chains, uint32_t old_length, uint32_t new_length)
+{
+	chains->counts[RTE_MIN(old_length, (uint32_t) NAT_MAP_CHAINS_MAX)]--;
+	chains->counts[RTE_MIN(new_length, (uint32_t) NAT_MAP_CHAINS_MAX)]++;
+}
+
+static inline uint32_t
+nat_map_chains_max(struct nat_map_chains* chains)
+{
+	uint32_t length = NAT_MAP_CHAINS_MAX;
+	while (length > 0 && chains->counts[length] == 0) {
+		length--;
+	}
+	return length;
+}
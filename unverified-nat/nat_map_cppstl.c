@@ -1,18 +1,38 @@
 #include <stdbool.h>
+#include <string.h>
 
 #include <unordered_map>
 
 #include "nat_flow.h"
 #include "nat_map.h"
 
+// Buckets are linked lists of keys, the first of which is free of collisions
 struct nat_map {
-	std::unordered_map<nat_flow_id, nat_flow*, nat_map_hash_fn, nat_map_eq_fn>* value;
+	std::unordered_map<nat_flow_id, uint32_t, nat_map_hash_fn, nat_map_eq_fn>* value;
+	uint32_t nb_collided_keys;
+	struct nat_map_chains chains;
 };
 
 static nat_map_hash_fn map_hash_fn;
 static nat_map_eq_fn map_eq_fn;
 
 
+// Recomputes the stats from scratch, for when the map rehashes, which already walks all keys
+static void
+nat_map_cppstl_count(struct nat_map* map)
+{
+	map->nb_collided_keys = 0;
+	memset(&map->chains, 0, sizeof(struct nat_map_chains));
+	for (size_t bucket = 0; bucket < map->value->bucket_count(); bucket++) {
+		uint32_t bucket_size = map->value->bucket_size(bucket);
+		if (bucket_size > 1) {
+			map->nb_collided_keys += bucket_size - 1;
+		}
+		map->chains.counts[RTE_MIN(bucket_size, (uint32_t) NAT_MAP_CHAINS_MAX)]++;
+	}
+}
+
+
 void
 nat_map_set_fns(nat_map_hash_fn hash_fn, nat_map_eq_fn eq_fn)
 {
@@ -21,29 +41,59 @@ nat_map_set_fns(nat_map_hash_fn hash_fn, nat_map_eq_fn eq_fn)
 }
 
 struct nat_map*
-nat_map_create(uint32_t capacity)
+nat_map_create(uint32_t capacity, int socket, nat_map_key_fn key_fn, void* key_context)
 {
+	// The STL stores its keys
+	(void) key_fn;
+	(void) key_context;
+
+	// The standard allocator ignores sockets, but pages land on the socket of the core that first touches them, i.e. the caller's
 	struct nat_map* map = (nat_map*) malloc(sizeof(nat_map));
-	map->value = new std::unordered_map<nat_flow_id, nat_flow*, nat_map_hash_fn, nat_map_eq_fn>(
+	map->value = new std::unordered_map<nat_flow_id, uint32_t, nat_map_hash_fn, nat_map_eq_fn>(
 		(size_t) capacity, map_hash_fn, map_eq_fn
 	);
+	nat_map_cppstl_count(map);
 	return map;
 }
 
 void
-nat_map_insert(struct nat_map* map, nat_flow_id key, nat_flow* value)
+nat_map_insert(struct nat_map* map, nat_flow_id key, uint32_t value)
 {
-	map->value->insert(std::make_pair(key, value));
+	size_t bucket_count = map->value->bucket_count();
+	if (!map->value->insert(std::make_pair(key, value)).second) {
+		return;
+	}
+
+	if (map->value->bucket_count() != bucket_count) {
+		nat_map_cppstl_count(map);
+		return;
+	}
+
+	uint32_t bucket_size = map->value->bucket_size(map->value->bucket(key));
+	if (bucket_size > 1) {
+		map->nb_collided_keys++;
+	}
+	nat_map_chains_update(&map->chains, bucket_size - 1, bucket_size);
 }
 
 void
 nat_map_remove(struct nat_map* map, nat_flow_id key)
 {
-	map->value->erase(key);
+	auto iter = map->value->find(key);
+	if (iter == map->value->end()) {
+		return;
+	}
+
+	uint32_t bucket_size = map->value->bucket_size(map->value->bucket(key));
+	map->value->erase(iter);
+	if (bucket_size > 1) {
+		map->nb_collided_keys--;
+	}
+	nat_map_chains_update(&map->chains, bucket_size, bucket_size - 1);
 }
 
 bool
-nat_map_get(struct nat_map* map, nat_flow_id key, nat_flow** value)
+nat_map_get(struct nat_map* map, nat_flow_id key, uint32_t* value)
 {
 	auto iter = map->value->find(key);
 	if (iter == map->value->end()) {
@@ -53,3 +103,32 @@ nat_map_get(struct nat_map* map, nat_flow_id key, nat_flow** value)
 	*value = iter->second;
 	return true;
 }
+
+void
+nat_map_prefetch(struct nat_map* map, nat_flow_id key)
+{
+	// The STL does not expose bucket memory
+	(void) map;
+	(void) key;
+}
+
+void
+nat_map_get_bulk(struct nat_map* map, nat_flow_id* keys, uint16_t keys_len, uint64_t* hit_mask, uint32_t* values)
+{
+	// No bulk API in the STL, it's the same as individual lookups
+	*hit_mask = 0;
+	for (uint16_t n = 0; n < keys_len; n++) {
+		if (nat_map_get(map, keys[n], &values[n])) {
+			*hit_mask |= 1ULL << n;
+		}
+	}
+}
+
+void
+nat_map_get_stats(struct nat_map* map, struct nat_map_stats* stats)
+{
+	stats->nb_keys = map->value->size();
+	stats->nb_buckets = map->value->bucket_count();
+	stats->nb_collided_keys = map->nb_collided_keys;
+	stats->max_chain_length = nat_map_chains_max(&map->chains);
+}
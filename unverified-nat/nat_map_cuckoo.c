@@ -0,0 +1,323 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <rte_common.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "nat_flow.h"
+#include "nat_map.h"
+
+// Map using a bucketized cuckoo hash table, made for flow IDs.
+//
+// Every key has two candidate buckets; a bucket is one cache line holding 8 entries,
+// each of which is a 16-bit signature of its key and its value.
+// Keys themselves are not stored: values are flow indices, and keys are rebuilt from the flows, see nat_map_key_fn,
+// only when signatures match; since signatures are 16 bits, this is almost only ever for the right key.
+// Flow IDs are thus only stored once, in the flow pool, which both maps of a core index.
+// Insertion puts keys in their primary bucket if possible, thus most lookups only need one bucket,
+// even at high load factors; otherwise, entries are moved to their other bucket to make room.
+//
+// The alternative bucket of an entry only depends on its current bucket and its signature,
+// so that entries can be moved without reading or rehashing their key.
+//
+// The 8 signatures of a bucket fit in one SSE register, and are compared with the looked up one at once.
+
+#define NAT_MAP_CUCKOO_BUCKET_ENTRIES 8
+
+// Signature of empty entries; signatures of keys are never 0
+#define NAT_MAP_CUCKOO_EMPTY 0
+
+// Maximum number of buckets visited while looking for room to insert a key
+#define NAT_MAP_CUCKOO_SEARCH_MAX 512
+
+struct nat_map_cuckoo_bucket {
+	uint16_t sigs[NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+	uint32_t values[NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+	// Bit i is set if entry i is in its key's alternative bucket, i.e. collided; fits in the cache line's spare bytes
+	uint8_t alt_mask;
+} __rte_cache_aligned;
+
+struct nat_map {
+	struct nat_map_cuckoo_bucket* buckets;
+	nat_map_key_fn key_fn;
+	void* key_context;
+	uint32_t buckets_mask;
+	uint32_t nb_keys;
+	uint32_t nb_collided_keys;
+};
+
+static nat_map_hash_fn map_hash_fn;
+static nat_map_eq_fn map_eq_fn;
+
+
+// The user hash may have poor high bits, which are used for signatures; mix it (MurmurHash3's finalizer)
+static uint64_t
+nat_map_cuckoo_hash(nat_flow_id key)
+{
+	uint64_t hash = (*map_hash_fn)(key);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static uint16_t
+nat_map_cuckoo_sig(uint64_t hash)
+{
+	uint16_t sig = hash >> 48;
+	return sig == NAT_MAP_CUCKOO_EMPTY ? 1 : sig;
+}
+
+// Involution, i.e. the alternative bucket of the alternative bucket is the original one
+static uint32_t
+nat_map_cuckoo_alt_bucket(struct nat_map* map, uint32_t bucket, uint16_t sig)
+{
+	uint32_t mix = sig * 0x9E3779B1u;
+	mix ^= mix >> 15;
+	return (bucket ^ mix) & map->buckets_mask;
+}
+
+// Bit i is set if entry i of the bucket has the signature
+static uint32_t
+nat_map_cuckoo_match(struct nat_map_cuckoo_bucket* bucket, uint16_t sig)
+{
+#ifdef __SSE2__
+	__m128i sigs = _mm_load_si128((__m128i*) bucket->sigs);
+	__m128i matches = _mm_cmpeq_epi16(sigs, _mm_set1_epi16(sig));
+	// Matches are 0xFFFF or 0, packing them to bytes keeps them as 0xFF or 0
+	return _mm_movemask_epi8(_mm_packs_epi16(matches, _mm_setzero_si128()));
+#else
+	uint32_t mask = 0;
+	for (uint32_t entry = 0; entry < NAT_MAP_CUCKOO_BUCKET_ENTRIES; entry++) {
+		mask |= (uint32_t) (bucket->sigs[entry] == sig) << entry;
+	}
+	return mask;
+#endif
+}
+
+// Returns the index of the key's entry, i.e. bucket * NAT_MAP_CUCKOO_BUCKET_ENTRIES + entry, or UINT32_MAX
+static uint32_t
+nat_map_cuckoo_find_in(struct nat_map* map, uint32_t bucket, uint16_t sig, nat_flow_id* key)
+{
+	uint32_t mask = nat_map_cuckoo_match(&map->buckets[bucket], sig);
+	while (mask != 0) {
+		uint32_t entry = __builtin_ctz(mask);
+		if ((*map_eq_fn)((*map->key_fn)(map->key_context, map->buckets[bucket].values[entry]), *key)) {
+			return bucket * NAT_MAP_CUCKOO_BUCKET_ENTRIES + entry;
+		}
+		mask &= mask - 1;
+	}
+	return UINT32_MAX;
+}
+
+static uint32_t
+nat_map_cuckoo_find(struct nat_map* map, uint64_t hash, nat_flow_id* key)
+{
+	uint16_t sig = nat_map_cuckoo_sig(hash);
+	uint32_t bucket = hash & map->buckets_mask;
+
+	uint32_t index = nat_map_cuckoo_find_in(map, bucket, sig, key);
+	if (index == UINT32_MAX) {
+		index = nat_map_cuckoo_find_in(map, nat_map_cuckoo_alt_bucket(map, bucket, sig), sig, key);
+	}
+	return index;
+}
+
+static void
+nat_map_cuckoo_set(struct nat_map* map, uint32_t index, uint16_t sig, uint32_t value, bool alternative)
+{
+	struct nat_map_cuckoo_bucket* bucket = &map->buckets[index / NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+	uint32_t entry = index % NAT_MAP_CUCKOO_BUCKET_ENTRIES;
+	bucket->sigs[entry] = sig;
+	bucket->values[entry] = value;
+	bucket->alt_mask = (bucket->alt_mask & ~(1u << entry)) | ((uint32_t) alternative << entry);
+}
+
+
+void
+nat_map_set_fns(nat_map_hash_fn hash_fn, nat_map_eq_fn eq_fn)
+{
+	map_hash_fn = hash_fn;
+	map_eq_fn = eq_fn;
+}
+
+struct nat_map*
+nat_map_create(uint32_t capacity, int socket, nat_map_key_fn key_fn, void* key_context)
+{
+	// Power of 2 number of buckets, with room to spare so that the table is at most 7/8 full
+	uint32_t nb_buckets = rte_align32pow2((capacity + NAT_MAP_CUCKOO_BUCKET_ENTRIES - 2) / (NAT_MAP_CUCKOO_BUCKET_ENTRIES - 1));
+	if (nb_buckets < 2) {
+		nb_buckets = 2;
+	}
+
+	struct nat_map* map = (nat_map*) malloc(sizeof(nat_map));
+	if (map == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_map_create for nat_map\n");
+	}
+
+	// Zeroed memory means all entries are empty
+	map->buckets = (struct nat_map_cuckoo_bucket*) rte_zmalloc_socket("nat_map_buckets",
+			nb_buckets * sizeof(struct nat_map_cuckoo_bucket), RTE_CACHE_LINE_SIZE, socket);
+	if (map->buckets == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_map_create for buckets\n");
+	}
+
+	map->key_fn = key_fn;
+	map->key_context = key_context;
+	map->buckets_mask = nb_buckets - 1;
+	map->nb_keys = 0;
+	map->nb_collided_keys = 0;
+	return map;
+}
+
+void
+nat_map_insert(struct nat_map* map, nat_flow_id key, uint32_t value)
+{
+	uint64_t hash = nat_map_cuckoo_hash(key);
+	uint16_t sig = nat_map_cuckoo_sig(hash);
+
+	uint32_t index = nat_map_cuckoo_find(map, hash, &key);
+	if (index != UINT32_MAX) {
+		map->buckets[index / NAT_MAP_CUCKOO_BUCKET_ENTRIES].values[index % NAT_MAP_CUCKOO_BUCKET_ENTRIES] = value;
+		return;
+	}
+
+	// Breadth-first search for an empty entry, starting from the key's two buckets;
+	// each visited bucket is the alternative bucket of one entry of its parent, which can thus be moved there.
+	struct {
+		uint32_t bucket;
+		// Index in 'path' of the parent, -1 for the key's own buckets
+		int32_t parent;
+		// Entry of the parent bucket that can move to this bucket
+		uint32_t parent_entry;
+	} path[NAT_MAP_CUCKOO_SEARCH_MAX];
+
+	uint32_t primary_bucket = hash & map->buckets_mask;
+	path[0].bucket = primary_bucket;
+	path[0].parent = -1;
+	path[1].bucket = nat_map_cuckoo_alt_bucket(map, primary_bucket, sig);
+	path[1].parent = -1;
+	uint32_t path_len = 2;
+
+	for (uint32_t node = 0; node < path_len; node++) {
+		uint32_t empty_mask = nat_map_cuckoo_match(&map->buckets[path[node].bucket], NAT_MAP_CUCKOO_EMPTY);
+		if (empty_mask == 0) {
+			for (uint32_t entry = 0; entry < NAT_MAP_CUCKOO_BUCKET_ENTRIES && path_len < NAT_MAP_CUCKOO_SEARCH_MAX; entry++) {
+				uint32_t alt_bucket = nat_map_cuckoo_alt_bucket(map, path[node].bucket,
+										map->buckets[path[node].bucket].sigs[entry]);
+
+				// Buckets must not appear twice on a path, otherwise moves would overwrite each other
+				bool cycle = false;
+				for (int32_t ancestor = node; ancestor != -1; ancestor = path[ancestor].parent) {
+					cycle |= path[ancestor].bucket == alt_bucket;
+				}
+				if (cycle) {
+					continue;
+				}
+
+				path[path_len].bucket = alt_bucket;
+				path[path_len].parent = node;
+				path[path_len].parent_entry = entry;
+				path_len++;
+			}
+			continue;
+		}
+
+		// Move entries down the path, from the empty entry back to one of the key's buckets;
+		// moved entries go from one of their buckets to the other, thus collide if and only if they did not
+		uint32_t free_index = path[node].bucket * NAT_MAP_CUCKOO_BUCKET_ENTRIES + __builtin_ctz(empty_mask);
+		uint32_t current = node;
+		while (path[current].parent != -1) {
+			uint32_t parent = path[current].parent;
+			uint32_t moved_entry = path[current].parent_entry;
+			uint32_t moved_index = path[parent].bucket * NAT_MAP_CUCKOO_BUCKET_ENTRIES + moved_entry;
+			struct nat_map_cuckoo_bucket* moved_bucket = &map->buckets[path[parent].bucket];
+			bool was_alternative = (moved_bucket->alt_mask & (1u << moved_entry)) != 0;
+			nat_map_cuckoo_set(map, free_index, moved_bucket->sigs[moved_entry], moved_bucket->values[moved_entry],
+					   !was_alternative);
+			map->nb_collided_keys += was_alternative ? -1 : 1;
+			free_index = moved_index;
+			current = parent;
+		}
+
+		// The path starts from the key's primary bucket, node 0, or its alternative one, node 1, unless both are the same
+		bool alternative = current == 1 && path[1].bucket != path[0].bucket;
+		nat_map_cuckoo_set(map, free_index, sig, value, alternative);
+		map->nb_keys++;
+		map->nb_collided_keys += alternative;
+		return;
+	}
+
+	rte_exit(EXIT_FAILURE, "Error in nat_map_insert, table is full\n");
+}
+
+void
+nat_map_remove(struct nat_map* map, nat_flow_id key)
+{
+	uint32_t index = nat_map_cuckoo_find(map, nat_map_cuckoo_hash(key), &key);
+	if (index != UINT32_MAX) {
+		struct nat_map_cuckoo_bucket* bucket = &map->buckets[index / NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+		uint32_t entry = index % NAT_MAP_CUCKOO_BUCKET_ENTRIES;
+		bucket->sigs[entry] = NAT_MAP_CUCKOO_EMPTY;
+		map->nb_keys--;
+		if ((bucket->alt_mask & (1u << entry)) != 0) {
+			map->nb_collided_keys--;
+			bucket->alt_mask &= ~(1u << entry);
+		}
+	}
+}
+
+bool
+nat_map_get(struct nat_map* map, nat_flow_id key, uint32_t* value)
+{
+	uint32_t index = nat_map_cuckoo_find(map, nat_map_cuckoo_hash(key), &key);
+	if (index == UINT32_MAX) {
+		return false;
+	}
+
+	*value = map->buckets[index / NAT_MAP_CUCKOO_BUCKET_ENTRIES].values[index % NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+	return true;
+}
+
+void
+nat_map_prefetch(struct nat_map* map, nat_flow_id key)
+{
+	rte_prefetch0(&map->buckets[nat_map_cuckoo_hash(key) & map->buckets_mask]);
+}
+
+void
+nat_map_get_bulk(struct nat_map* map, nat_flow_id* keys, uint16_t keys_len, uint64_t* hit_mask, uint32_t* values)
+{
+	// Hash everything and prefetch primary buckets first, so that bucket loads overlap even without nat_map_prefetch
+	uint64_t hashes[NAT_MAP_BULK_MAX];
+	for (uint16_t n = 0; n < keys_len; n++) {
+		hashes[n] = nat_map_cuckoo_hash(keys[n]);
+		rte_prefetch0(&map->buckets[hashes[n] & map->buckets_mask]);
+	}
+
+	*hit_mask = 0;
+	for (uint16_t n = 0; n < keys_len; n++) {
+		uint32_t index = nat_map_cuckoo_find(map, hashes[n], &keys[n]);
+		if (index != UINT32_MAX) {
+			values[n] = map->buckets[index / NAT_MAP_CUCKOO_BUCKET_ENTRIES].values[index % NAT_MAP_CUCKOO_BUCKET_ENTRIES];
+			*hit_mask |= 1ULL << n;
+		}
+	}
+}
+
+void
+nat_map_get_stats(struct nat_map* map, struct nat_map_stats* stats)
+{
+	// Keys are in their primary or alternative bucket, the latter only because of collisions
+	stats->nb_keys = map->nb_keys;
+	stats->nb_buckets = map->buckets_mask + 1;
+	stats->nb_collided_keys = map->nb_collided_keys;
+	stats->max_chain_length = map->nb_collided_keys != 0 ? 2 : map->nb_keys != 0 ? 1 : 0;
+}
@@ -7,24 +7,77 @@
 #include "nat_map.h"
 
 // Map using DPDK table.
-// Keys must be structs whose size is a power of 2.
+// DPDK keys must have a power of 2 size, thus flow IDs are copied into zero-padded keys.
 
 // DPDK's "table" structure is meant to use packets, i.e. rte_mbufs, as keys.
 // However, it never actually accesses the packet-specific things,
 // they're opaque (modulo an user-configured offset, which we force to be 0).
 // Since this is C, well... a pointer is a pointer is a pointer.
 
+// rte_table does not expose its buckets either, so the number of keys in each is tracked here, for nat_map_get_stats;
+// like rte_table, keys go in the bucket given by the low bits of their hash, which holds 4 of them and chains
+// extension buckets for the others.
+// Chains can be longer than tracked after removals, since rte_table only frees extension buckets once they are empty.
+#define NAT_MAP_DPDK_BUCKET_KEYS 4
+
 
 struct nat_map {
 	void* value;
+	uint16_t* bucket_sizes;
+	uint32_t buckets_mask;
+	// Keys that do not fit in their bucket, thus are in extension buckets, which lookups then have to walk
+	uint32_t nb_keys;
+	uint32_t nb_collided_keys;
+	struct nat_map_chains chains;
+};
+
+struct nat_map_dpdk_key {
+	nat_flow_id id;
+	uint8_t padding[16 - sizeof(nat_flow_id)];
 };
 
+static struct nat_map_dpdk_key
+nat_map_dpdk_key_from_id(nat_flow_id id)
+{
+	struct nat_map_dpdk_key key;
+	key.id = id;
+	memset(key.padding, 0, sizeof(key.padding));
+	return key;
+}
+
 static nat_map_hash_fn map_hash_fn;
 
 static uint64_t
 nat_map_hash_fn_dpdk(void* key, uint32_t key_size, uint64_t seed)
 {
-	return (*map_hash_fn)(*((nat_flow_id*) key));
+	return (*map_hash_fn)(((struct nat_map_dpdk_key*) key)->id);
+}
+
+static uint16_t*
+nat_map_dpdk_bucket_size(struct nat_map* map, struct nat_map_dpdk_key* key)
+{
+	return &map->bucket_sizes[nat_map_hash_fn_dpdk(key, sizeof(struct nat_map_dpdk_key), 0) & map->buckets_mask];
+}
+
+static uint32_t
+nat_map_dpdk_chain_length(uint32_t bucket_size)
+{
+	return (bucket_size + NAT_MAP_DPDK_BUCKET_KEYS - 1) / NAT_MAP_DPDK_BUCKET_KEYS;
+}
+
+// Updates the stats of a bucket whose size changes by delta, i.e. 1 or -1
+static void
+nat_map_dpdk_resize_bucket(struct nat_map* map, uint16_t* bucket_size, int delta)
+{
+	uint32_t old_size = *bucket_size;
+	uint32_t new_size = old_size + delta;
+	*bucket_size = new_size;
+
+	map->nb_keys += delta;
+	if (RTE_MAX(old_size, new_size) > NAT_MAP_DPDK_BUCKET_KEYS) {
+		map->nb_collided_keys += delta;
+	}
+	nat_map_chains_update(&map->chains, nat_map_dpdk_chain_length(old_size), nat_map_dpdk_chain_length(new_size));
 }
 
 
@@ -37,10 +90,18 @@ nat_map_set_fns(nat_map_hash_fn hash_fn, nat_map_eq_fn eq_fn)
 }
 
 struct nat_map*
-nat_map_create(uint32_t capacity)
+nat_map_create(uint32_t capacity, int socket, nat_map_key_fn key_fn, void* key_context)
 {
+	// rte_table stores its keys
+	(void) key_fn;
+	(void) key_context;
+
+	// DPDK tables need a power of 2 number of buckets,
+	// and capacities are not powers of 2 when the flow table is split among cores
+	capacity = rte_align32pow2(capacity);
+
 	rte_table_hash_ext_params table_params;
-	table_params.key_size = sizeof(nat_flow_id);
+	table_params.key_size = sizeof(struct nat_map_dpdk_key);
 	table_params.n_keys = capacity;
 	table_params.n_buckets = capacity >> 2;
 	table_params.n_buckets_ext = capacity >> 2;
@@ -49,8 +110,7 @@ nat_map_create(uint32_t capacity)
 	table_params.signature_offset = 0; // unused
 	table_params.key_offset = 0; // MUST be 0, see remark at top of file
 
-	// 2nd param is socket ID, we don't really need it
-	void* dpdk_table = rte_table_hash_ext_dosig_ops.f_create(&table_params, 0, sizeof(nat_flow*));
+	void* dpdk_table = rte_table_hash_ext_dosig_ops.f_create(&table_params, socket, sizeof(uint32_t));
 	if (dpdk_table == NULL) {
 		rte_exit(EXIT_FAILURE, "Out of memory in nat_map_create for rte_table\n");
 	}
@@ -60,40 +120,63 @@ nat_map_create(uint32_t capacity)
 		rte_exit(EXIT_FAILURE, "Out of memory in nat_map_create for nat_map\n");
 	}
 
+	map->bucket_sizes = (uint16_t*) calloc(table_params.n_buckets, sizeof(uint16_t));
+	if (map->bucket_sizes == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_map_create for bucket sizes\n");
+	}
+
 	map->value = dpdk_table;
+	map->buckets_mask = table_params.n_buckets - 1;
+	map->nb_keys = 0;
+	map->nb_collided_keys = 0;
+	memset(&map->chains, 0, sizeof(struct nat_map_chains));
+	map->chains.counts[0] = table_params.n_buckets;
 	return map;
 }
 
 void
-nat_map_insert(struct nat_map* map, nat_flow_id key, nat_flow* value)
+nat_map_insert(struct nat_map* map, nat_flow_id id, uint32_t value)
 {
+	struct nat_map_dpdk_key key = nat_map_dpdk_key_from_id(id);
+
 	// The add function allows to both check if the value was already there, and get a handle to the entry.
-	// We care about neither.
-	int unused_key_found;
+	// We only care about the former.
+	int key_found;
 	void* unused_entry_ptr;
 
-	int ret = rte_table_hash_ext_dosig_ops.f_add(map->value, &key, &value, &unused_key_found, &unused_entry_ptr);
+	int ret = rte_table_hash_ext_dosig_ops.f_add(map->value, &key, &value, &key_found, &unused_entry_ptr);
 	if (ret != 0) {
 		rte_exit(ret, "Error in nat_map_insert\n");
 	}
+
+	if (!key_found) {
+		nat_map_dpdk_resize_bucket(map, nat_map_dpdk_bucket_size(map, &key), 1);
+	}
 }
 
 void
-nat_map_remove(struct nat_map* map, nat_flow_id key)
+nat_map_remove(struct nat_map* map, nat_flow_id id)
 {
+	struct nat_map_dpdk_key key = nat_map_dpdk_key_from_id(id);
+
 	// Same remark as insert
-	int unused_key_found;
+	int key_found;
 	void* unused_entry_ptr;
 
-	int ret = rte_table_hash_ext_dosig_ops.f_delete(map->value, &key, &unused_key_found, &unused_entry_ptr);
+	int ret = rte_table_hash_ext_dosig_ops.f_delete(map->value, &key, &key_found, &unused_entry_ptr);
 	if (ret != 0) {
 		rte_exit(ret, "Error in nat_map_remove\n");
 	}
+
+	if (key_found) {
+		nat_map_dpdk_resize_bucket(map, nat_map_dpdk_bucket_size(map, &key), -1);
+	}
 }
 
 bool
-nat_map_get(struct nat_map* map, nat_flow_id key, nat_flow** value)
+nat_map_get(struct nat_map* map, nat_flow_id id, uint32_t* value)
 {
+	struct nat_map_dpdk_key key = nat_map_dpdk_key_from_id(id);
 	uint64_t lookup_hit_mask;
 	void* keys = &key;
 	// rte_table requires values to be a fully valid 64-entry array
@@ -114,6 +197,60 @@ nat_map_get(struct nat_map* map, nat_flow_id key, nat_flow** value)
 		return false;
 	}
 
-	*value = *((nat_flow**) values[0]);
+	*value = *((uint32_t*) values[0]);
 	return true;
 }
+
+void
+nat_map_prefetch(struct nat_map* map, nat_flow_id id)
+{
+	// rte_table hides its layout, but its bulk lookup prefetches on its own
+	(void) map;
+	(void) id;
+}
+
+void
+nat_map_get_bulk(struct nat_map* map, nat_flow_id* keys, uint16_t keys_len, uint64_t* hit_mask, uint32_t* values)
+{
+	*hit_mask = 0;
+	if (keys_len == 0) {
+		return;
+	}
+
+	struct nat_map_dpdk_key padded_keys[NAT_MAP_BULK_MAX];
+	void* keys_ptrs[NAT_MAP_BULK_MAX];
+	for (uint16_t n = 0; n < keys_len; n++) {
+		padded_keys[n] = nat_map_dpdk_key_from_id(keys[n]);
+		keys_ptrs[n] = &padded_keys[n];
+	}
+
+	// Same remark as get
+	void* entries[64];
+
+	int ret = rte_table_hash_ext_dosig_ops.f_lookup(
+		map->value,
+		(struct rte_mbuf**) keys_ptrs, // keys: pseudo-array of pseudo-mbufs
+		RTE_LEN2MASK(keys_len, uint64_t), // bitmask of valid keys
+		hit_mask,
+		entries
+	);
+	if (ret != 0) {
+		rte_exit(ret, "Error in nat_map_get_bulk\n");
+	}
+
+	uint64_t remaining_mask = *hit_mask;
+	while (remaining_mask != 0) {
+		uint16_t n = __builtin_ctzll(remaining_mask);
+		values[n] = *((uint32_t*) entries[n]);
+		remaining_mask &= remaining_mask - 1;
+	}
+}
+
+void
+nat_map_get_stats(struct nat_map* map, struct nat_map_stats* stats)
+{
+	stats->nb_keys = map->nb_keys;
+	stats->nb_buckets = map->buckets_mask + 1;
+	stats->nb_collided_keys = map->nb_collided_keys;
+	stats->max_chain_length = nat_map_chains_max(&map->chains);
+}
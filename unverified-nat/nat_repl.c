@@ -0,0 +1,232 @@
+// This file is a C++ file masquerading as a C file, see nat_forward_nat.c
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_debug.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#include "../nat_clock.h"
+#include "../nat_config.h"
+#include "../nat_forward.h"
+#include "../nat_log.h"
+#include "../nat_util.h"
+
+#include "nat_repl.h"
+#include "nat_snapshot.h"
+
+
+struct rte_ring* nat_repl_full[RTE_MAX_LCORE];
+struct rte_ring* nat_repl_free[RTE_MAX_LCORE];
+volatile uint8_t nat_repl_resync[RTE_MAX_LCORE];
+int64_t nat_repl_clock_offset;
+volatile uint8_t nat_repl_takeover;
+
+// How long the replication thread waits when it has nothing to do, in microseconds
+static const unsigned REPL_IDLE_US = 100;
+
+// How long the active instance waits before connecting to the standby again, in microseconds
+static const unsigned REPL_RECONNECT_US = 100000;
+
+
+static bool
+nat_repl_address(const char* path, struct sockaddr_un* address)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		return false;
+	}
+	strcpy(address->sun_path, path);
+	return true;
+}
+
+static size_t
+nat_repl_batch_size(uint16_t nb_records)
+{
+	return offsetof(struct nat_repl_batch, records) + nb_records * sizeof(struct nat_repl_record);
+}
+
+
+// Active instance: connects to the standby, and sends it the batches of all cores, in order per core
+static void*
+nat_repl_active_main(void* arg)
+{
+	struct nat_config* config = (struct nat_config*) arg;
+
+	struct sockaddr_un address;
+	nat_repl_address(config->repl_path, &address);
+
+	int fd = -1;
+	uint64_t next_connect_tsc = 0;
+	while (1) {
+		if (fd < 0 && rte_rdtsc() >= next_connect_tsc) {
+			fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+			if (fd >= 0 && connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+				struct nat_repl_hello hello;
+				nat_snapshot_header_init(&hello.config, config);
+				nat_clock_update(rte_rdtsc());
+				hello.clock = nat_clock_now();
+				if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) == (ssize_t) sizeof(hello)) {
+					NAT_INFO("Replication: connected to standby %s.", config->repl_path);
+					for (unsigned core_id = 0; core_id < config->nb_cores; core_id++) {
+						nat_repl_resync[core_id] = 1;
+					}
+				} else {
+					close(fd);
+					fd = -1;
+				}
+			} else if (fd >= 0) {
+				close(fd);
+				fd = -1;
+			}
+			next_connect_tsc = rte_rdtsc() + rte_get_tsc_hz() / US_PER_S * REPL_RECONNECT_US;
+		}
+
+		// Batches are dropped while there is no standby, which resyncs when it connects
+		bool busy = false;
+		for (unsigned core_id = 0; core_id < config->nb_cores; core_id++) {
+			struct nat_repl_batch* batches[NAT_REPL_BATCHES];
+			unsigned nb_batches = rte_ring_sc_dequeue_burst(nat_repl_full[core_id], (void**) batches, NAT_REPL_BATCHES, NULL);
+			for (unsigned n = 0; n < nb_batches; n++) {
+				size_t size = nat_repl_batch_size(batches[n]->nb_records);
+				if (fd >= 0 && send(fd, batches[n], size, MSG_NOSIGNAL) != (ssize_t) size) {
+					NAT_INFO("Replication: lost standby %s (%s).", config->repl_path, strerror(errno));
+					close(fd);
+					fd = -1;
+				}
+			}
+			// Cannot fail, the ring has room for all batches
+			rte_ring_sp_enqueue_burst(nat_repl_free[core_id], (void**) batches, nb_batches, NULL);
+			busy |= nb_batches != 0;
+		}
+
+		if (!busy) {
+			usleep(REPL_IDLE_US);
+		}
+	}
+
+	return NULL;
+}
+
+// Standby instance: receives batches from the active instance and hands them to their cores, then takes over once it is gone
+static void*
+nat_repl_standby_main(void* arg)
+{
+	struct nat_config* config = (struct nat_config*) arg;
+
+	struct sockaddr_un address;
+	nat_repl_address(config->repl_path, &address);
+	unlink(config->repl_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listen_fd, 1) != 0) {
+		rte_exit(EXIT_FAILURE, "Replication: cannot listen on %s (%s)\n", config->repl_path, strerror(errno));
+	}
+
+	// Wait for an active instance with the same config
+	int fd;
+	while (1) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+
+		struct nat_repl_hello hello;
+		if (recv(fd, &hello, sizeof(hello), 0) == (ssize_t) sizeof(hello)
+		    && hello.config.magic == NAT_SNAPSHOT_MAGIC && hello.config.version == NAT_SNAPSHOT_VERSION
+		    && nat_snapshot_header_matches(&hello.config, config)) {
+			nat_clock_update(rte_rdtsc());
+			nat_repl_clock_offset = (int64_t) (nat_clock_now() - hello.clock);
+			break;
+		}
+
+		NAT_INFO("Replication: rejected an active instance with another configuration.");
+		close(fd);
+	}
+	close(listen_fd);
+	NAT_INFO("Replication: standby of the active instance, through %s.", config->repl_path);
+
+	// Messages are received in one buffer, then copied to a batch of their core
+	struct nat_repl_batch received;
+	while (1) {
+		ssize_t size = recv(fd, &received, sizeof(received), 0);
+		if (size <= 0) {
+			break;
+		}
+		if ((size_t) size < offsetof(struct nat_repl_batch, records) || received.core_id >= config->nb_cores
+		    || received.nb_records > NAT_REPL_BATCH_RECORDS || (size_t) size != nat_repl_batch_size(received.nb_records)) {
+			NAT_INFO("Replication: ignoring a malformed batch.");
+			continue;
+		}
+
+		// Cores apply batches as they get them; if they lag, so does the socket, and thus the active instance's thread
+		struct nat_repl_batch* batch;
+		while (rte_ring_sc_dequeue(nat_repl_free[received.core_id], (void**) &batch) != 0) {
+			usleep(REPL_IDLE_US);
+		}
+		memcpy(batch, &received, size);
+		rte_ring_sp_enqueue(nat_repl_full[received.core_id], batch);
+	}
+	close(fd);
+
+	NAT_INFO("Replication: the active instance is gone, taking over.");
+	nat_repl_takeover = 1;
+	return NULL;
+}
+
+
+void
+nat_repl_init(struct nat_config* config)
+{
+	struct sockaddr_un address;
+	if (!nat_repl_address(config->repl_path, &address)) {
+		rte_exit(EXIT_FAILURE, "Replication socket path is too long: %s\n", config->repl_path);
+	}
+
+	// Cores own the producer end of one ring and the consumer end of the other, the replication thread the opposite ends
+	for (unsigned core_id = 0; core_id < config->nb_cores; core_id++) {
+		char name[RTE_RING_NAMESIZE];
+		snprintf(name, sizeof(name), "nat_repl_full_%u", core_id);
+		nat_repl_full[core_id] = rte_ring_create(name, NAT_REPL_BATCHES * 2, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		snprintf(name, sizeof(name), "nat_repl_free_%u", core_id);
+		nat_repl_free[core_id] = rte_ring_create(name, NAT_REPL_BATCHES * 2, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (nat_repl_full[core_id] == NULL || nat_repl_free[core_id] == NULL) {
+			rte_exit(EXIT_FAILURE, "Cannot create the replication rings of core %u\n", core_id);
+		}
+
+		struct nat_repl_batch* batches = (struct nat_repl_batch*) rte_malloc("nat_repl_batches",
+				NAT_REPL_BATCHES * sizeof(struct nat_repl_batch), RTE_CACHE_LINE_SIZE);
+		if (batches == NULL) {
+			rte_exit(EXIT_FAILURE, "Out of memory in nat_repl_init\n");
+		}
+		for (unsigned n = 0; n < NAT_REPL_BATCHES; n++) {
+			rte_ring_sp_enqueue(nat_repl_free[core_id], &batches[n]);
+		}
+
+		nat_repl_resync[core_id] = 0;
+	}
+	nat_repl_takeover = 0;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, config->repl_standby ? &nat_repl_standby_main : &nat_repl_active_main, config) != 0) {
+		rte_exit(EXIT_FAILURE, "Cannot create the replication thread\n");
+	}
+	if (!nat_thread_avoid_lcores(thread)) {
+		NAT_INFO("Replication: no CPU is free of lcores, sharing the master lcore's.");
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_lcore.h>
+#include <rte_ring.h>
+
+#include "nat_flow.h"
+#include "nat_snapshot.h"
+
+
+// Replication of flows from an active instance to a hot standby one, over a UNIX seqpacket socket.
+//
+// On the active instance, cores append a record to a batch whenever they create or expire a flow,
+// and whenever the expiry wheel finds that a flow was refreshed (see nat_expiry_wheel_expire),
+// so that replication traffic grows with the number of flows created and expired, not with the packet rate.
+// Cores hand full batches, and partial ones whenever they flush, to a replication thread through their nat_repl_full ring,
+// and take empty ones from their nat_repl_free ring; that thread does all socket I/O, off the forwarding cores.
+// When a standby connects, the thread first sends a hello, then asks cores to resend all of their flows, a few at a time.
+//
+// On the standby instance, the replication thread receives batches and hands them to the cores they came from,
+// which apply them to their own flows; cores do not forward packets until the active instance disconnects,
+// at which point the standby takes over with the flows it has.
+// Both instances must have the same config, as flows are replicated core by core, see nat_snapshot_header_matches.
+//
+// Two instances can run on one machine, with different --file-prefix EAL options and their own vdevs, e.g.
+//   nat --file-prefix active --vdev net_pcap0,iface=veth0 --vdev net_pcap1,iface=veth1 -- ... --replicate-to /tmp/nat.sock
+//   nat --file-prefix standby --vdev net_pcap0,iface=veth2 --vdev net_pcap1,iface=veth3 -- ... --standby /tmp/nat.sock
+// then killing the active instance makes the standby take over.
+
+// Records per batch, and batches per core
+#define NAT_REPL_BATCH_RECORDS 128
+#define NAT_REPL_BATCHES 64
+
+// Flows resent per core flush after a standby connects
+#define NAT_REPL_RESYNC_BUDGET 256
+
+enum nat_repl_record_type {
+	NAT_REPL_CREATE,
+	NAT_REPL_REFRESH,
+	NAT_REPL_EXPIRE
+};
+
+struct nat_repl_record {
+	struct nat_flow_id id;
+	uint8_t type;
+	// Only for creations
+	uint8_t internal_device;
+	uint8_t external_addr_index;
+	uint16_t external_port;
+	// Time of the flow's last packet, on the active instance's clock; not for expirations
+	uint32_t timestamp;
+} __attribute__((__packed__));
+
+// Sent as one message, of only the used records
+struct nat_repl_batch {
+	uint16_t core_id;
+	uint16_t nb_records;
+	struct nat_repl_record records[NAT_REPL_BATCH_RECORDS];
+} __attribute__((__packed__));
+
+// First message of a connection
+struct nat_repl_hello {
+	struct nat_snapshot_header config;
+	// Active instance's clock when sending, see nat_clock.h
+	uint64_t clock;
+};
+
+
+extern struct rte_ring* nat_repl_full[RTE_MAX_LCORE];
+extern struct rte_ring* nat_repl_free[RTE_MAX_LCORE];
+
+// Active instance: set by the replication thread when a standby connects, cleared by the core once it starts resending
+extern volatile uint8_t nat_repl_resync[RTE_MAX_LCORE];
+
+// Standby instance: difference between the standby's and the active's clocks, set before any batch is handed to cores
+extern int64_t nat_repl_clock_offset;
+
+// Standby instance: set by the replication thread once the active instance is gone, after its last batch
+extern volatile uint8_t nat_repl_takeover;
@@ -0,0 +1,622 @@
+// This file is a C++ file masquerading as a C file, see nat_forward_nat.c
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include <rte_common.h>
+#include <rte_debug.h>
+#include <rte_ether.h>
+#include <rte_hash_crc.h>
+#include <rte_icmp.h>
+#include <rte_ip.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_random.h>
+#include <rte_ring.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+
+#include "../nat_clock.h"
+#include "../nat_config.h"
+#include "../nat_forward.h"
+#include "../nat_log.h"
+#include "../nat_rss.h"
+#include "../nat_stats.h"
+#include "../nat_tx.h"
+#include "../nat_util.h"
+
+#include "nat_flow.h"
+#include "nat_slow_path.h"
+
+// ICMP echo is translated like TCP/UDP, its identifier taking the place of the port of the host that sent the request;
+// ICMP errors are translated like the packet they embed, which belongs to an existing flow.
+// Non-first fragments have no L4 header, they are translated like the first fragment of their datagram,
+// and held until it is if they come first.
+
+// ICMP errors that embed the packet that caused them; DPDK only defines echo types
+#define NAT_ICMP_DEST_UNREACHABLE 3
+#define NAT_ICMP_TIME_EXCEEDED 11
+#define NAT_ICMP_PARAMETER_PROBLEM 12
+
+// Maximum number of packets and responses handled per call to nat_slow_path_process
+#define NAT_SLOW_PATH_BURST 32
+
+// Fragmented datagrams being translated, in an open-addressing table;
+// datagrams that find no free slot within NAT_SLOW_PATH_FRAGMENT_PROBES slots are dropped.
+#define NAT_SLOW_PATH_FRAGMENT_SLOTS 4096
+#define NAT_SLOW_PATH_FRAGMENT_PROBES 8
+// Maximum number of fragments of a datagram held while its first fragment is being translated
+#define NAT_SLOW_PATH_FRAGMENT_PENDING 8
+// Time after which a datagram is forgotten, in milliseconds, since its last fragment
+#define NAT_SLOW_PATH_FRAGMENT_TIMEOUT 2000
+// Number of slots checked for expired datagrams per call to nat_slow_path_process, so that held fragments are freed
+#define NAT_SLOW_PATH_FRAGMENT_SWEEP 8
+
+
+struct rte_ring* nat_slow_path_exceptions;
+struct rte_ring* nat_slow_path_requests[RTE_MAX_LCORE];
+struct rte_ring* nat_slow_path_responses;
+
+
+enum nat_slow_path_kind {
+	// TCP, UDP or ICMP echo, possibly the first fragment of a datagram
+	NAT_SLOW_PATH_KIND_FLOW,
+	// ICMP error about a packet of a flow
+	NAT_SLOW_PATH_KIND_ERROR,
+	// Fragment of a datagram other than the first one
+	NAT_SLOW_PATH_KIND_FRAGMENT
+};
+
+struct nat_slow_path_packet {
+	struct rte_mbuf* mbuf;
+	enum nat_slow_path_kind kind;
+	bool from_outside;
+
+	struct ipv4_hdr* ipv4_header;
+	// Not for fragments: the L4 header, and its length within the packet, which is at least 8
+	uint8_t* l4_header;
+	uint16_t l4_len;
+
+	// Only for errors: the embedded IPv4 and L4 headers, the latter also being at least 8 bytes long
+	struct ipv4_hdr* inner_ipv4_header;
+	uint8_t* inner_l4_header;
+	uint16_t inner_l4_len;
+};
+
+// Requests in flight, with the packets they are for
+struct nat_slow_path_slot {
+	// First, since rings carry pointers to requests
+	struct nat_slow_request request;
+	struct nat_slow_path_packet packet;
+	struct nat_slow_path_slot* next_free;
+};
+
+// Identifies a datagram, before translation
+struct nat_slow_path_datagram_id {
+	uint32_t src_addr;
+	uint32_t dst_addr;
+	uint16_t packet_id;
+	uint8_t protocol;
+	uint8_t from_outside;
+};
+
+struct nat_slow_path_datagram {
+	struct nat_slow_path_datagram_id id;
+	uint8_t used;
+	// Whether the first fragment was translated, and thus the rest of the datagram can be
+	uint8_t resolved;
+	uint8_t output_device;
+	uint8_t pending_len;
+	// Source address of the translated datagram if it is from the inside, destination address otherwise
+	uint32_t translated_addr;
+	// Truncated clock time of the last fragment, see nat_clock.h
+	uint32_t timestamp;
+	struct rte_mbuf* pending[NAT_SLOW_PATH_FRAGMENT_PENDING];
+};
+
+struct nat_slow_path_state {
+	struct nat_slow_path_slot slots[NAT_SLOW_PATH_REQUESTS];
+	struct nat_slow_path_slot* free_slots;
+
+	struct nat_slow_path_datagram* datagrams;
+	uint32_t datagrams_seed;
+	uint32_t sweep_cursor;
+
+	struct nat_tx_buffer tx_buffers[RTE_MAX_ETHPORTS];
+
+	struct nat_core_stats* stats;
+};
+
+static struct nat_slow_path_state* slow_path_state;
+
+
+// Ports of a TCP/UDP header, or the identifier of an ICMP echo request as its source port,
+// or of an ICMP echo reply as its destination port; returns false for other protocols and ICMP messages.
+// The header must be at least 8 bytes long.
+static bool
+nat_slow_path_get_ports(uint8_t protocol, uint8_t* l4_header, uint16_t* src_port, uint16_t* dst_port)
+{
+	if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) {
+		struct tcpudp_hdr* tcpudp_header = (struct tcpudp_hdr*) l4_header;
+		*src_port = tcpudp_header->src_port;
+		*dst_port = tcpudp_header->dst_port;
+		return true;
+	}
+
+	if (protocol == IPPROTO_ICMP) {
+		struct icmp_hdr* icmp_header = (struct icmp_hdr*) l4_header;
+		if (icmp_header->icmp_type == IP_ICMP_ECHO_REQUEST) {
+			*src_port = icmp_header->icmp_ident;
+			*dst_port = 0;
+			return true;
+		}
+		if (icmp_header->icmp_type == IP_ICMP_ECHO_REPLY) {
+			*src_port = 0;
+			*dst_port = icmp_header->icmp_ident;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Sets a port as defined by nat_slow_path_get_ports, and updates the L4 checksum if it is within the l4_len bytes;
+// addr_diff is the checksum difference of the address that was rewritten, which TCP/UDP checksums cover.
+static void
+nat_slow_path_set_port(uint8_t protocol, uint8_t* l4_header, uint16_t l4_len, bool is_src, uint16_t port, uint32_t addr_diff)
+{
+	if (protocol == IPPROTO_ICMP) {
+		// Echo checksums do not cover addresses
+		struct icmp_hdr* icmp_header = (struct icmp_hdr*) l4_header;
+		uint32_t diff = nat_cksum_diff16(icmp_header->icmp_ident, port);
+		icmp_header->icmp_ident = port;
+		icmp_header->icmp_cksum = nat_cksum_adjust(icmp_header->icmp_cksum, diff);
+		return;
+	}
+
+	struct tcpudp_hdr* tcpudp_header = (struct tcpudp_hdr*) l4_header;
+	uint32_t diff = addr_diff;
+	if (is_src) {
+		diff += nat_cksum_diff16(tcpudp_header->src_port, port);
+		tcpudp_header->src_port = port;
+	} else {
+		diff += nat_cksum_diff16(tcpudp_header->dst_port, port);
+		tcpudp_header->dst_port = port;
+	}
+
+	if (protocol == IPPROTO_TCP && l4_len >= offsetof(struct tcp_hdr, cksum) + sizeof(uint16_t)) {
+		struct tcp_hdr* tcp_header = (struct tcp_hdr*) l4_header;
+		tcp_header->cksum = nat_cksum_adjust(tcp_header->cksum, diff);
+	} else if (protocol == IPPROTO_UDP) {
+		// A zero UDP checksum means there is none, and a computed zero is thus sent as all ones
+		struct udp_hdr* udp_header = (struct udp_hdr*) l4_header;
+		if (udp_header->dgram_cksum != 0) {
+			udp_header->dgram_cksum = nat_cksum_adjust(udp_header->dgram_cksum, diff);
+			if (udp_header->dgram_cksum == 0) {
+				udp_header->dgram_cksum = 0xFFFF;
+			}
+		}
+	}
+}
+
+// Sets the source or destination address of an IPv4 header, updating its checksum;
+// returns the checksum difference, for L4 checksums
+static uint32_t
+nat_slow_path_set_addr(struct ipv4_hdr* header, bool is_src, uint32_t addr)
+{
+	uint32_t diff;
+	if (is_src) {
+		diff = nat_cksum_diff32(header->src_addr, addr);
+		header->src_addr = addr;
+	} else {
+		diff = nat_cksum_diff32(header->dst_addr, addr);
+		header->dst_addr = addr;
+	}
+	header->hdr_checksum = nat_cksum_adjust(header->hdr_checksum, diff);
+	return diff;
+}
+
+
+// Parses a packet, and sets the ID of the flow it belongs to, as seen from its side;
+// returns false if it cannot be translated.
+static bool
+nat_slow_path_parse(struct nat_config* config, struct rte_mbuf* mbuf, struct nat_slow_path_packet* packet, struct nat_flow_id* id)
+{
+	packet->mbuf = mbuf;
+	packet->from_outside = mbuf->port == config->wan_device;
+
+	struct ether_hdr* ether_header = nat_get_mbuf_ether_header(mbuf);
+	struct ipv4_hdr* ipv4_header = nat_get_mbuf_ipv4_header(mbuf);
+	if (mbuf->data_len < sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+	    || ether_header->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4)
+	    || (ipv4_header->version_ihl >> 4) != 4) {
+		return false;
+	}
+
+	uint16_t ipv4_len = (ipv4_header->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	uint16_t total_len = rte_be_to_cpu_16(ipv4_header->total_length);
+	if (ipv4_len < sizeof(struct ipv4_hdr) || total_len < ipv4_len || mbuf->data_len < sizeof(struct ether_hdr) + total_len) {
+		return false;
+	}
+	packet->ipv4_header = ipv4_header;
+
+	if ((ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)) != 0) {
+		packet->kind = NAT_SLOW_PATH_KIND_FRAGMENT;
+		return true;
+	}
+
+	// Ports, and the ICMP type and identifier, are within the first 8 bytes
+	packet->l4_header = (uint8_t*) ipv4_header + ipv4_len;
+	packet->l4_len = total_len - ipv4_len;
+	if (packet->l4_len < 8) {
+		return false;
+	}
+
+	uint16_t src_port, dst_port;
+	if (nat_slow_path_get_ports(ipv4_header->next_proto_id, packet->l4_header, &src_port, &dst_port)) {
+		// Only echo requests start flows, and only replies come back
+		struct icmp_hdr* icmp_header = (struct icmp_hdr*) packet->l4_header;
+		if (ipv4_header->next_proto_id == IPPROTO_ICMP && packet->from_outside != (icmp_header->icmp_type == IP_ICMP_ECHO_REPLY)) {
+			return false;
+		}
+
+		packet->kind = NAT_SLOW_PATH_KIND_FLOW;
+		id->src_addr = ipv4_header->src_addr;
+		id->src_port = src_port;
+		id->dst_addr = ipv4_header->dst_addr;
+		id->dst_port = dst_port;
+		id->protocol = ipv4_header->next_proto_id;
+		return true;
+	}
+
+	struct icmp_hdr* icmp_header = (struct icmp_hdr*) packet->l4_header;
+	if (ipv4_header->next_proto_id != IPPROTO_ICMP
+	    || (icmp_header->icmp_type != NAT_ICMP_DEST_UNREACHABLE
+		&& icmp_header->icmp_type != NAT_ICMP_TIME_EXCEEDED
+		&& icmp_header->icmp_type != NAT_ICMP_PARAMETER_PROBLEM)
+	    // Errors are translated as a whole, since their checksum is recomputed
+	    || (ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG)) != 0) {
+		return false;
+	}
+
+	// Errors embed the IPv4 header and at least 8 bytes of the packet that caused them;
+	// only the first fragment of that packet has its ports
+	struct ipv4_hdr* inner_ipv4_header = (struct ipv4_hdr*) (packet->l4_header + sizeof(struct icmp_hdr));
+	uint16_t inner_len = packet->l4_len - sizeof(struct icmp_hdr);
+	if (inner_len < sizeof(struct ipv4_hdr) || (inner_ipv4_header->version_ihl >> 4) != 4) {
+		return false;
+	}
+	uint16_t inner_ipv4_len = (inner_ipv4_header->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	if (inner_ipv4_len < sizeof(struct ipv4_hdr) || inner_len < inner_ipv4_len + 8
+	    || (inner_ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)) != 0) {
+		return false;
+	}
+
+	packet->inner_ipv4_header = inner_ipv4_header;
+	packet->inner_l4_header = (uint8_t*) inner_ipv4_header + inner_ipv4_len;
+	packet->inner_l4_len = inner_len - inner_ipv4_len;
+	if (!nat_slow_path_get_ports(inner_ipv4_header->next_proto_id, packet->inner_l4_header, &src_port, &dst_port)) {
+		return false;
+	}
+
+	// The embedded packet went the other way, the flow is that of its replies
+	packet->kind = NAT_SLOW_PATH_KIND_ERROR;
+	id->src_addr = inner_ipv4_header->dst_addr;
+	id->src_port = dst_port;
+	id->dst_addr = inner_ipv4_header->src_addr;
+	id->dst_port = src_port;
+	id->protocol = inner_ipv4_header->next_proto_id;
+	return true;
+}
+
+// Core that owns the flow with the given ID, as seen from the given side, or -1 if there cannot be such a flow
+static int32_t
+nat_slow_path_owner(struct nat_config* config, struct nat_flow_id* id, bool from_outside)
+{
+	// External ports are split among cores
+	if (from_outside) {
+		return nat_config_external_port_core(config, id->dst_port);
+	}
+
+	// Otherwise, the flow is on the core its packets would go to, see nat_core_port_bucket;
+	// redirection table entry i goes to core i mod nb_cores
+	if (config->nb_cores == 1 || config->rss_reta_size == 0) {
+		return 0;
+	}
+	return nat_rss_reta_index(nat_rss_fold(id->src_addr, id->dst_addr, id->src_port, id->dst_port), config->rss_reta_size)
+	       % config->nb_cores;
+}
+
+
+static struct nat_slow_path_datagram_id
+nat_slow_path_datagram_id_of(struct nat_slow_path_packet* packet)
+{
+	struct nat_slow_path_datagram_id id;
+	id.src_addr = packet->ipv4_header->src_addr;
+	id.dst_addr = packet->ipv4_header->dst_addr;
+	id.packet_id = packet->ipv4_header->packet_id;
+	id.protocol = packet->ipv4_header->next_proto_id;
+	id.from_outside = packet->from_outside;
+	return id;
+}
+
+// Forgets a datagram, dropping its held fragments
+static void
+nat_slow_path_datagram_release(struct nat_slow_path_state* state, struct nat_slow_path_datagram* datagram)
+{
+	for (uint8_t n = 0; n < datagram->pending_len; n++) {
+		rte_pktmbuf_free(datagram->pending[n]);
+	}
+	state->stats->dropped_fragment += datagram->pending_len;
+	datagram->pending_len = 0;
+	datagram->used = 0;
+}
+
+// Finds a datagram, adding it if it is not there and add is set; returns NULL if it is not there or cannot be added
+static struct nat_slow_path_datagram*
+nat_slow_path_datagram_find(struct nat_slow_path_state* state, struct nat_slow_path_datagram_id* id, uint32_t now, bool add)
+{
+	uint32_t hash = rte_hash_crc(id, sizeof(struct nat_slow_path_datagram_id), state->datagrams_seed);
+
+	struct nat_slow_path_datagram* free_datagram = NULL;
+	for (uint32_t probe = 0; probe < NAT_SLOW_PATH_FRAGMENT_PROBES; probe++) {
+		struct nat_slow_path_datagram* datagram = &state->datagrams[(hash + probe) & (NAT_SLOW_PATH_FRAGMENT_SLOTS - 1)];
+		if (datagram->used && now - datagram->timestamp > NAT_SLOW_PATH_FRAGMENT_TIMEOUT) {
+			nat_slow_path_datagram_release(state, datagram);
+		}
+
+		if (!datagram->used) {
+			if (free_datagram == NULL) {
+				free_datagram = datagram;
+			}
+		} else if (memcmp(&datagram->id, id, sizeof(struct nat_slow_path_datagram_id)) == 0) {
+			datagram->timestamp = now;
+			return datagram;
+		}
+	}
+
+	if (!add || free_datagram == NULL) {
+		return NULL;
+	}
+
+	free_datagram->id = *id;
+	free_datagram->used = 1;
+	free_datagram->resolved = 0;
+	free_datagram->pending_len = 0;
+	free_datagram->timestamp = now;
+	return free_datagram;
+}
+
+
+static void
+nat_slow_path_send(struct nat_config* config, struct nat_slow_path_state* state, struct rte_mbuf* mbuf, uint8_t device)
+{
+	nat_l2_rewrite(nat_get_mbuf_ether_header(mbuf), &config->l2_templates[device]);
+	nat_tx_buffer_add(&state->tx_buffers[device], mbuf);
+}
+
+// Translates and sends a non-first fragment of a datagram whose first fragment was translated
+static void
+nat_slow_path_send_fragment(struct nat_config* config, struct nat_slow_path_state* state,
+			    struct nat_slow_path_datagram* datagram, struct rte_mbuf* mbuf)
+{
+	nat_slow_path_set_addr(nat_get_mbuf_ipv4_header(mbuf), !datagram->id.from_outside, datagram->translated_addr);
+	nat_slow_path_send(config, state, mbuf, datagram->output_device);
+}
+
+// Translates a flow or error packet, given its flow; returns the device to send it to
+static uint8_t
+nat_slow_path_translate(struct nat_config* config, struct nat_slow_path_packet* packet, struct nat_slow_request* request)
+{
+	// From the inside, the internal address and port become the external ones, and the other way around
+	uint32_t addr = packet->from_outside ? request->internal_addr : request->external_addr;
+	uint16_t port = packet->from_outside ? request->internal_port : request->external_port;
+
+	if (packet->kind == NAT_SLOW_PATH_KIND_FLOW) {
+		uint32_t addr_diff = nat_slow_path_set_addr(packet->ipv4_header, !packet->from_outside, addr);
+		nat_slow_path_set_port(packet->ipv4_header->next_proto_id, packet->l4_header, packet->l4_len,
+				       !packet->from_outside, port, addr_diff);
+	} else {
+		// The error itself goes to or comes from the host, even if a router in between sent it,
+		// and the embedded packet is the other way around
+		nat_slow_path_set_addr(packet->ipv4_header, !packet->from_outside, addr);
+		uint32_t addr_diff = nat_slow_path_set_addr(packet->inner_ipv4_header, packet->from_outside, addr);
+		nat_slow_path_set_port(packet->inner_ipv4_header->next_proto_id, packet->inner_l4_header, packet->inner_l4_len,
+				       packet->from_outside, port, addr_diff);
+
+		// The ICMP checksum covers the embedded packet, which is short
+		struct icmp_hdr* icmp_header = (struct icmp_hdr*) packet->l4_header;
+		icmp_header->icmp_cksum = 0;
+		icmp_header->icmp_cksum = (uint16_t) ~rte_raw_cksum(icmp_header, packet->l4_len);
+	}
+
+	return packet->from_outside ? request->internal_device : config->wan_device;
+}
+
+
+// Handles a packet from the cores; requests its flow from the core that owns it, unless it is a non-first fragment
+static void
+nat_slow_path_handle(struct nat_config* config, struct nat_slow_path_state* state, struct rte_mbuf* mbuf, uint32_t now)
+{
+	struct nat_slow_path_slot* slot = state->free_slots;
+	if (slot == NULL) {
+		NAT_DEBUG("Slow path full, dropping");
+		rte_pktmbuf_free(mbuf);
+		state->stats->dropped_slow_path_full++;
+		return;
+	}
+
+	struct nat_slow_path_packet* packet = &slot->packet;
+	struct nat_slow_request* request = &slot->request;
+	if (!nat_slow_path_parse(config, mbuf, packet, &request->id)) {
+		NAT_DEBUG("Cannot translate, dropping");
+		rte_pktmbuf_free(mbuf);
+		state->stats->dropped_not_tcpudp++;
+		return;
+	}
+
+	if (packet->kind == NAT_SLOW_PATH_KIND_FRAGMENT) {
+		struct nat_slow_path_datagram_id datagram_id = nat_slow_path_datagram_id_of(packet);
+		struct nat_slow_path_datagram* datagram = nat_slow_path_datagram_find(state, &datagram_id, now, true);
+		if (datagram != NULL && datagram->resolved) {
+			nat_slow_path_send_fragment(config, state, datagram, mbuf);
+		} else if (datagram != NULL && datagram->pending_len < NAT_SLOW_PATH_FRAGMENT_PENDING) {
+			datagram->pending[datagram->pending_len] = mbuf;
+			datagram->pending_len++;
+		} else {
+			NAT_DEBUG("Cannot hold fragment, dropping");
+			rte_pktmbuf_free(mbuf);
+			state->stats->dropped_fragment++;
+		}
+		return;
+	}
+
+	int32_t owner = nat_slow_path_owner(config, &request->id, packet->from_outside);
+	if (owner < 0) {
+		NAT_DEBUG("Unknown flow, dropping");
+		rte_pktmbuf_free(mbuf);
+		state->stats->dropped_unknown_flow++;
+		return;
+	}
+
+	// Fragments that arrive while the first one is being translated are held
+	if ((packet->ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG)) != 0) {
+		struct nat_slow_path_datagram_id datagram_id = nat_slow_path_datagram_id_of(packet);
+		nat_slow_path_datagram_find(state, &datagram_id, now, true);
+	}
+
+	request->from_outside = packet->from_outside;
+	request->create = !packet->from_outside && packet->kind == NAT_SLOW_PATH_KIND_FLOW;
+	request->device = mbuf->port;
+	request->refresh = packet->kind == NAT_SLOW_PATH_KIND_FLOW;
+	request->found = 0;
+
+	state->free_slots = slot->next_free;
+	// Cannot fail, the ring has room for all requests
+	rte_ring_enqueue(nat_slow_path_requests[owner], request);
+}
+
+// Translates and sends the packet of a request that a core responded to
+static void
+nat_slow_path_finish(struct nat_config* config, struct nat_slow_path_state* state, struct nat_slow_path_slot* slot, uint32_t now)
+{
+	struct nat_slow_path_packet* packet = &slot->packet;
+	struct nat_slow_request* request = &slot->request;
+
+	struct nat_slow_path_datagram* datagram = NULL;
+	if ((packet->ipv4_header->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG)) != 0) {
+		struct nat_slow_path_datagram_id datagram_id = nat_slow_path_datagram_id_of(packet);
+		datagram = nat_slow_path_datagram_find(state, &datagram_id, now, false);
+	}
+
+	if (!request->found) {
+		// The core counted the drop
+		rte_pktmbuf_free(packet->mbuf);
+		if (datagram != NULL) {
+			nat_slow_path_datagram_release(state, datagram);
+		}
+	} else {
+		uint8_t device = nat_slow_path_translate(config, packet, request);
+		nat_slow_path_send(config, state, packet->mbuf, device);
+
+		if (datagram != NULL) {
+			datagram->resolved = 1;
+			datagram->output_device = device;
+			datagram->translated_addr = packet->from_outside ? packet->ipv4_header->dst_addr : packet->ipv4_header->src_addr;
+			for (uint8_t n = 0; n < datagram->pending_len; n++) {
+				nat_slow_path_send_fragment(config, state, datagram, datagram->pending[n]);
+			}
+			datagram->pending_len = 0;
+		}
+	}
+
+	slot->next_free = state->free_slots;
+	state->free_slots = slot;
+}
+
+
+void
+nat_slow_path_init(struct nat_config* config)
+{
+	nat_slow_path_exceptions = rte_ring_create("nat_slow_path_exceptions", NAT_SLOW_PATH_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+	nat_slow_path_responses = rte_ring_create("nat_slow_path_responses", NAT_SLOW_PATH_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+	if (nat_slow_path_exceptions == NULL || nat_slow_path_responses == NULL) {
+		rte_exit(EXIT_FAILURE, "Cannot create the slow path rings\n");
+	}
+
+	for (uint16_t core = 0; core < config->nb_cores; core++) {
+		char name[RTE_RING_NAMESIZE];
+		snprintf(name, sizeof(name), "nat_slow_path_requests_%" PRIu16, core);
+		nat_slow_path_requests[core] = rte_ring_create(name, NAT_SLOW_PATH_RING_SIZE, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (nat_slow_path_requests[core] == NULL) {
+			rte_exit(EXIT_FAILURE, "Cannot create the slow path requests ring of core %" PRIu16 "\n", core);
+		}
+	}
+
+	struct nat_slow_path_state* state = (struct nat_slow_path_state*) rte_zmalloc("nat_slow_path_state",
+										     sizeof(struct nat_slow_path_state), RTE_CACHE_LINE_SIZE);
+	// Zeroed memory means all slots are unused
+	state->datagrams = (struct nat_slow_path_datagram*) rte_zmalloc("nat_slow_path_datagrams",
+			NAT_SLOW_PATH_FRAGMENT_SLOTS * sizeof(struct nat_slow_path_datagram), RTE_CACHE_LINE_SIZE);
+	if (state == NULL || state->datagrams == NULL) {
+		rte_exit(EXIT_FAILURE, "Out of memory in nat_slow_path_init\n");
+	}
+
+	state->free_slots = NULL;
+	for (uint32_t slot = 0; slot < NAT_SLOW_PATH_REQUESTS; slot++) {
+		state->slots[slot].next_free = state->free_slots;
+		state->free_slots = &state->slots[slot];
+	}
+
+	// Datagram IDs are chosen by remote hosts, which must not be able to predict collisions
+	state->datagrams_seed = (uint32_t) rte_rand();
+	state->sweep_cursor = 0;
+
+	// The slow path core's counters and TX queues come after those of the cores
+	state->stats = nat_core_stats_get(config->nb_cores);
+	for (uint8_t device = 0; device < RTE_MAX_ETHPORTS; device++) {
+		// Even in pipeline mode, the slow path has its own TX queue
+		nat_tx_buffer_init(&state->tx_buffers[device], device, config->nb_cores, NULL, state->stats);
+	}
+
+	slow_path_state = state;
+}
+
+void
+nat_slow_path_process(struct nat_config* config)
+{
+	struct nat_slow_path_state* state = slow_path_state;
+	uint32_t now = (uint32_t) nat_clock_now();
+
+	// Responses first, since they free request slots
+	struct nat_slow_request* responses[NAT_SLOW_PATH_BURST];
+	uint16_t responses_len = rte_ring_dequeue_burst(nat_slow_path_responses, (void**) responses, NAT_SLOW_PATH_BURST, NULL);
+	for (uint16_t n = 0; n < responses_len; n++) {
+		nat_slow_path_finish(config, state, (struct nat_slow_path_slot*) responses[n], now);
+	}
+
+	struct rte_mbuf* bufs[NAT_SLOW_PATH_BURST];
+	uint16_t bufs_len = rte_ring_dequeue_burst(nat_slow_path_exceptions, (void**) bufs, NAT_SLOW_PATH_BURST, NULL);
+	for (uint16_t buf = 0; buf < bufs_len; buf++) {
+		nat_slow_path_handle(config, state, bufs[buf], now);
+	}
+
+	// Datagrams whose first fragment never came must not hold their fragments forever
+	for (uint32_t n = 0; n < NAT_SLOW_PATH_FRAGMENT_SWEEP; n++) {
+		struct nat_slow_path_datagram* datagram = &state->datagrams[state->sweep_cursor];
+		if (datagram->used && now - datagram->timestamp > NAT_SLOW_PATH_FRAGMENT_TIMEOUT) {
+			nat_slow_path_datagram_release(state, datagram);
+		}
+		state->sweep_cursor = (state->sweep_cursor + 1) & (NAT_SLOW_PATH_FRAGMENT_SLOTS - 1);
+	}
+
+	// Latency matters more than batching for exceptions; devices disabled at runtime still get packets, see nat_core_flush
+	for (uint8_t device = 0; device < RTE_MAX_ETHPORTS; device++) {
+		nat_tx_buffer_flush(&state->tx_buffers[device]);
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include "nat_flow.h"
+
+// Slow path: cores hand the packets they cannot translate on their own (ICMP, fragments, IPv4 options) to a dedicated core.
+// That core parses them and tracks fragments, but flows belong to the cores, which never share them;
+// it thus asks the core that owns a packet's flow to look it up (or create it), then translates and sends the packet itself.
+//
+// Cores -> slow path: nat_slow_path_exceptions, packets as received (the device they came from is mbuf->port).
+// Slow path -> core: nat_slow_path_requests[core], flows to look up.
+// Cores -> slow path: nat_slow_path_responses, the same requests, with their results.
+// Cores only process requests when they flush their TX buffers, so that the fast path is not slowed down by them.
+
+// Number of requests that can be in flight; the rings are larger, so that requests can always be enqueued
+#define NAT_SLOW_PATH_REQUESTS 512
+#define NAT_SLOW_PATH_RING_SIZE 1024
+
+struct nat_slow_request {
+	// Flow ID to look up, from the inside, or from the outside (i.e. as replies see it)
+	struct nat_flow_id id;
+	uint8_t from_outside;
+	// Whether to create the flow if it does not exist, only from the inside; the flow's internal device is then this one
+	uint8_t create;
+	uint8_t device;
+	// Whether the packet is part of the flow, and thus refreshes it, as opposed to e.g. an ICMP error about it
+	uint8_t refresh;
+
+	// Set by the core that owns the flow; the rest is only set if found is.
+	// Addresses and ports are in network order.
+	uint8_t found;
+	uint8_t internal_device;
+	uint16_t internal_port;
+	uint32_t internal_addr;
+	uint32_t external_addr;
+	uint16_t external_port;
+};
+
+
+extern struct rte_ring* nat_slow_path_exceptions;
+extern struct rte_ring* nat_slow_path_requests[RTE_MAX_LCORE];
+extern struct rte_ring* nat_slow_path_responses;
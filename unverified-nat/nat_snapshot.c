@@ -0,0 +1,172 @@
+// This file is a C++ file masquerading as a C file, see nat_forward_nat.c
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../nat_config.h"
+#include "../nat_log.h"
+
+#include "nat_snapshot.h"
+
+
+// Snapshots are first written here, then renamed
+static void
+nat_snapshot_temp_path(const char* path, char* temp_path)
+{
+	snprintf(temp_path, PATH_MAX, "%s.tmp", path);
+}
+
+uint64_t
+nat_snapshot_time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void
+nat_snapshot_header_init(struct nat_snapshot_header* header, struct nat_config* config)
+{
+	memset(header, 0, sizeof(struct nat_snapshot_header));
+	header->magic = NAT_SNAPSHOT_MAGIC;
+	header->version = NAT_SNAPSHOT_VERSION;
+	header->nb_cores = config->nb_cores;
+	header->max_flows = config->max_flows;
+	header->start_port = config->start_port;
+	header->rss_reta_size = config->rss_reta_size;
+	header->nb_external_addrs = config->nb_external_addrs;
+	header->wan_lookup_direct = config->wan_lookup_direct;
+	memcpy(header->external_addrs, config->external_addrs, config->nb_external_addrs * sizeof(uint32_t));
+	header->saved_time = nat_snapshot_time();
+}
+
+bool
+nat_snapshot_header_matches(const struct nat_snapshot_header* header, struct nat_config* config)
+{
+	// Cores, the port range and the RSS table decide which core owns a flow and which ports it may use,
+	// the flow table size decides whether the flows fit, and external addresses are stored by index
+	return header->nb_cores == config->nb_cores
+	    && header->max_flows == config->max_flows
+	    && header->start_port == config->start_port
+	    && header->rss_reta_size == config->rss_reta_size
+	    && header->nb_external_addrs == config->nb_external_addrs
+	    && header->wan_lookup_direct == config->wan_lookup_direct
+	    && memcmp(header->external_addrs, config->external_addrs, config->nb_external_addrs * sizeof(uint32_t)) == 0;
+}
+
+const struct nat_snapshot_header*
+nat_snapshot_map(const char* path, struct nat_config* config)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		NAT_INFO("No snapshot at %s (%s), starting without flows.", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(struct nat_snapshot_header)) {
+		NAT_INFO("Snapshot %s is truncated, ignoring it.", path);
+		close(fd);
+		return NULL;
+	}
+
+	// Pages are read ahead, since all of them are read once
+	void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		NAT_INFO("Cannot map snapshot %s (%s), ignoring it.", path, strerror(errno));
+		return NULL;
+	}
+
+	const struct nat_snapshot_header* header = (const struct nat_snapshot_header*) data;
+	const char* problem = NULL;
+	if (header->magic != NAT_SNAPSHOT_MAGIC) {
+		problem = "not a snapshot";
+	} else if (header->version != NAT_SNAPSHOT_VERSION) {
+		problem = "unsupported version";
+	} else if (header->file_size != (uint64_t) file_stat.st_size) {
+		problem = "truncated";
+	} else if (!nat_snapshot_header_matches(header, config)) {
+		problem = "taken with another configuration";
+	} else if (sizeof(struct nat_snapshot_header) + header->nb_cores * sizeof(struct nat_snapshot_core) > header->file_size) {
+		problem = "corrupted";
+	} else {
+		// Cores trust their sections
+		const struct nat_snapshot_core* cores = (const struct nat_snapshot_core*) (header + 1);
+		for (uint32_t core = 0; core < header->nb_cores; core++) {
+			if (cores[core].flows_offset + cores[core].nb_flows * sizeof(struct nat_snapshot_flow) > header->file_size
+			    || cores[core].port_cursors_offset + cores[core].nb_port_cursors * sizeof(uint32_t) > header->file_size) {
+				problem = "corrupted";
+			}
+		}
+	}
+
+	if (problem != NULL) {
+		NAT_INFO("Snapshot %s is %s, ignoring it.", path, problem);
+		munmap(data, file_stat.st_size);
+		return NULL;
+	}
+
+	// The mapping stays valid; if the NAT stops before saving again, it must not restore the same flows later
+	unlink(path);
+
+	NAT_INFO("Restoring flows from snapshot %s.", path);
+	return header;
+}
+
+void*
+nat_snapshot_create(const char* path, size_t size)
+{
+	char temp_path[PATH_MAX];
+	nat_snapshot_temp_path(path, temp_path);
+
+	int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		NAT_INFO("Cannot create snapshot %s (%s).", temp_path, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		NAT_INFO("Cannot size snapshot %s (%s).", temp_path, strerror(errno));
+		close(fd);
+		unlink(temp_path);
+		return NULL;
+	}
+
+	void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		NAT_INFO("Cannot map snapshot %s (%s).", temp_path, strerror(errno));
+		unlink(temp_path);
+		return NULL;
+	}
+
+	return data;
+}
+
+bool
+nat_snapshot_commit(const char* path, void* data, size_t size)
+{
+	char temp_path[PATH_MAX];
+	nat_snapshot_temp_path(path, temp_path);
+
+	bool synced = msync(data, size, MS_SYNC) == 0;
+	munmap(data, size);
+	if (!synced || rename(temp_path, path) != 0) {
+		NAT_INFO("Cannot write snapshot %s (%s).", path, strerror(errno));
+		unlink(temp_path);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../nat_config.h"
+
+#include "nat_flow.h"
+
+
+// Warm restart: on shutdown, all flows are written to a snapshot file, from which the cores restore them on startup,
+// so that restarting the NAT (e.g. to upgrade it) does not break connections.
+//
+// The file is written and read through mmap, in the host's byte order:
+// a header, one nat_snapshot_core per core, then each core's flows and port cursors, at the offsets the cores give.
+// Flows can only be restored with the same config, since which core owns a flow, and which external ports it can use,
+// depend on it; snapshots from other configs are ignored.
+// Flow timestamps are stored as ages, and the wall-clock time elapsed between saving and restoring is added to them,
+// so that flows still expire on time across restarts.
+// A snapshot is only restored once; it is deleted once mapped and checked.
+
+#define NAT_SNAPSHOT_MAGIC 0x54414E53444E56ULL // "VNDSNAT"
+#define NAT_SNAPSHOT_VERSION 1
+
+struct nat_snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+
+	// Config the flows were created with, see nat_snapshot_header_matches
+	uint32_t nb_cores;
+	uint32_t max_flows;
+	uint16_t start_port;
+	uint16_t rss_reta_size;
+	uint16_t nb_external_addrs;
+	uint8_t wan_lookup_direct;
+	uint8_t padding;
+	uint32_t external_addrs[NAT_MAX_EXTERNAL_ADDRS];
+
+	// Wall-clock time at which the snapshot was taken, in milliseconds since the epoch
+	uint64_t saved_time;
+
+	// Size of the whole file, to detect truncated ones
+	uint64_t file_size;
+};
+
+struct nat_snapshot_core {
+	// Offsets from the start of the file
+	uint64_t flows_offset;
+	uint64_t port_cursors_offset;
+	uint32_t nb_flows;
+	uint32_t nb_port_cursors;
+};
+
+struct nat_snapshot_flow {
+	struct nat_flow_id id;
+	uint8_t internal_device;
+	uint8_t external_addr_index;
+	uint16_t external_port;
+	// Time since the flow's last packet when the snapshot was taken, in milliseconds
+	uint32_t age;
+} __attribute__((__packed__));
+
+
+// Wall-clock time, in milliseconds since the epoch
+uint64_t
+nat_snapshot_time(void);
+
+void
+nat_snapshot_header_init(struct nat_snapshot_header* header, struct nat_config* config);
+
+// Whether flows from the snapshot can be restored with the config
+bool
+nat_snapshot_header_matches(const struct nat_snapshot_header* header, struct nat_config* config);
+
+// Maps the snapshot at the path read-only and deletes it; returns NULL, logging why, if there is none or it is not valid
+const struct nat_snapshot_header*
+nat_snapshot_map(const char* path, struct nat_config* config);
+
+// Creates a file of the given size next to the path, mapped read-write; returns NULL, logging why, on failure
+void*
+nat_snapshot_create(const char* path, size_t size);
+
+// Writes the file created by nat_snapshot_create to disk, and moves it to the path, so that snapshots are never partial
+bool
+nat_snapshot_commit(const char* path, void* data, size_t size);